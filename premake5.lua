@@ -50,6 +50,8 @@ workspace "gmod_riscv"
 
         links {
             "rvvm",
+            "Cabinet",
+            "Psapi",
         }
 
         filter { "architecture:x86" }
@@ -30,15 +30,149 @@ extern "C"
 
 typedef struct gmod_machine_t gmod_machine_t;
 
+// Refers to one listed machine, goes stale once it's destroyed or unlisted even if its id is reused. 0 is never valid.
+typedef uint64_t gmod_machine_handle_t;
+
+// Machine options handled on the gmod_riscv side, passed through gmod_machine_get_opt/set_opt like RVVM_OPT_*
+#define GMOD_OPT_EXEC_MODE      0x40000001U //!< How harts are run, GMOD_EXEC_*, only changeable while paused
+#define GMOD_OPT_TICK_BUDGET_US 0x40000002U //!< Host time each hart may run per server tick in GMOD_EXEC_TICKED
+#define GMOD_OPT_TICK_STEPS     0x40000003U //!< Steps each hart may run per server tick in GMOD_EXEC_TICKED, 0 is unlimited
+#define GMOD_OPT_CPU_WEIGHT     0x40000004U //!< Weight of the machine within its owner's CPU share
+#define GMOD_OPT_PRIORITY       0x40000005U //!< Scheduling class of pooled/ticked machines, GMOD_PRIORITY_*
+#define GMOD_OPT_TIME_MODE      0x40000006U //!< What drives the guest clock of pooled/ticked machines, GMOD_TIME_*
+#define GMOD_OPT_TIME_CATCHUP_CENT 0x40000007U //!< How fast a virtual clock that fell behind catches up, in percent of real time
+
+#define GMOD_EXEC_THREADED 0 //!< Each hart runs on its own RVVM thread
+#define GMOD_EXEC_POOLED   1 //!< Harts are stepped by the shared worker pool
+#define GMOD_EXEC_TICKED   2 //!< Harts are stepped by the worker pool within a per-tick budget
+
+#define GMOD_PRIORITY_BACKGROUND  0 //!< Nobody is watching, runs when interactive harts leave room
+#define GMOD_PRIORITY_NORMAL      1
+#define GMOD_PRIORITY_INTERACTIVE 2 //!< A player is using the machine right now
+
+#define GMOD_TIME_HOST    0 //!< The guest clock follows the host clock
+#define GMOD_TIME_VIRTUAL 1 //!< The guest clock follows server ticks and only runs while the harts are allowed to
+
+typedef struct gmod_merge_stats_t
+{
+	uint32_t machines;
+	uint64_t shared_blocks; //!< 64 KiB blocks of guest RAM mapped from a merged copy
+	uint64_t merged_blocks; //!< Merged copies those blocks point to
+	uint64_t saved_bytes;   //!< Host RAM the merging saves right now
+	uint64_t merges;
+	uint64_t unmerges;      //!< Sharing broken by a guest write
+	uint64_t scans;
+} gmod_merge_stats_t;
+
+typedef struct gmod_image_cache_stats_t
+{
+	uint32_t images;
+	uint64_t bytes;
+	uint64_t hits;    //!< Loads served from memory
+	uint64_t misses;  //!< Loads that read the file
+	uint64_t reloads; //!< Files that changed on disk since they were cached
+} gmod_image_cache_stats_t;
+
+typedef struct gmod_reclaim_stats_t
+{
+	uint64_t resident_bytes; //!< Guest RAM backed by host memory, as of the last full scan
+	uint64_t zero_bytes;     //!< Resident but zeroed, released on the next pass
+	uint64_t released_bytes; //!< Given back to the host so far
+	uint64_t scans;
+	uint32_t last_pause_us;
+} gmod_reclaim_stats_t;
+
+typedef struct gmod_hibernation_stats_t
+{
+	uint32_t hibernated;     //!< Machines on disk right now
+	uint64_t hibernations;
+	uint64_t resumes;
+	uint32_t failures;       //!< Saves or loads that didn't go through
+	uint32_t last_resume_ms;
+} gmod_hibernation_stats_t;
+
+#define GMOD_ADMIT_REJECT   0 //!< Machines that don't fit into the memory limit aren't created
+#define GMOD_ADMIT_DOWNSIZE 1 //!< They get less RAM instead, down to GMOD_MEMORY_MIN_RAM
+
+typedef struct gmod_memory_stats_t
+{
+	uint64_t limit_bytes;     //!< 0 if there is none
+	uint64_t committed_bytes; //!< Guest RAM, JIT caches and device buffers of all machines
+	uint32_t machines;
+	uint64_t rejected;
+	uint64_t downsized;
+	uint64_t hibernated;      //!< Background machines hibernated to make room
+} gmod_memory_stats_t;
+
+#define GMOD_WATCHDOG_WARN     0 //!< A hart spun for one window, nothing was done yet
+#define GMOD_WATCHDOG_THROTTLE 1 //!< The CPU share of the machine was halved again
+#define GMOD_WATCHDOG_PAUSE    2 //!< The share would be too low to matter, the machine was paused
+#define GMOD_WATCHDOG_RELEASE  3 //!< The guest stopped spinning, its share is back
+
+typedef struct gmod_watchdog_event_t
+{
+	int id;
+	int action;         //!< GMOD_WATCHDOG_*
+	uint32_t hart;
+	uint64_t pc;        //!< Where the stuck hart was last seen
+	char symbol[128];   //!< Closest symbol to pc if symbols were loaded for the machine, empty otherwise
+	uint32_t busy_cent; //!< Of one host core, used by the stuck hart
+	uint32_t cpu_cent;  //!< CPU share the machine is held to now, 0 if it isn't
+} gmod_watchdog_event_t;
+
+#define GMOD_DEFAULT_TICK_BUDGET_US 2000
+#define GMOD_DEFAULT_CPU_WEIGHT     100
+#define GMOD_DEFAULT_TIME_CATCHUP_CENT 10
+
+#define GMOD_GOVERNOR_INTERVAL_MS 1000
+
+#define GMOD_RECLAIM_INTERVAL_MS  1000
+#define GMOD_RECLAIM_MIN_PAGES    256  //!< Zeroed pages worth pausing a machine for, 1 MiB
+#define GMOD_RECLAIM_MAX_PAGES    4096 //!< Released per pause, each one is checked again first
+
+#define GMOD_DEFAULT_HIBERNATE_DIR  "riscv_hibernate"
+#define GMOD_HIBERNATE_INTERVAL_MS  1000
+#define GMOD_HIBERNATE_IDLE_CENT    2 //!< Machines using less of a host core than this count as idle
+
+#define GMOD_WATCHDOG_BASE_CENT 100 //!< First share of a spinning machine, halved from there
+#define GMOD_WATCHDOG_MIN_CENT  10  //!< Machines that would get less are paused instead
+
+#define GMOD_MEMORY_MACHINE_OVERHEAD (8ULL << 20)  //!< Device buffers and hart state counted per machine
+#define GMOD_MEMORY_JIT_ESTIMATE     (16ULL << 20) //!< JIT cache per hart assumed before a machine exists
+#define GMOD_MEMORY_MIN_RAM          (32ULL << 20)
+
+// Lookups may be done from any thread, off the Lua thread inside a read section (see below)
 GMOD_API gmod_machine_t* get_machine(int id);
 
 GMOD_API gmod_machine_t* gmod_machine_create(int id, int ram_size, int harts_num, bool is_64bit);
 
+// Creates a machine that isn't reachable through get_machine() until it's given an id,
+// unlisted machines may be set up from any thread. Fails if it doesn't fit into the memory limit.
+GMOD_API gmod_machine_t* gmod_machine_create_unlisted(int ram_size, int harts_num, bool is_64bit);
+GMOD_API bool gmod_machine_assign_id(gmod_machine_t* machine, int id);
+
 GMOD_API int gmod_machine_get_id(gmod_machine_t* machine);
+
+// 0 for unlisted machines
+GMOD_API gmod_machine_handle_t gmod_machine_get_handle(gmod_machine_t* machine);
+
+// Null once the machine the handle was taken from is gone, safe to call from any thread
+GMOD_API gmod_machine_t* gmod_machine_from_handle(gmod_machine_handle_t handle);
+
+// Off the Lua thread, a machine looked up by id, handle or RVVM machine is only kept from being
+// freed until the read section the lookup was done in ends. Keep sections short.
+GMOD_API uint32_t gmod_machine_read_begin();
+GMOD_API void gmod_machine_read_end(uint32_t section);
 GMOD_API rvvm_machine_t* gmod_machine_get_rvvm_machine(gmod_machine_t* machine);
 
 GMOD_API void gmod_machine_destroy(gmod_machine_t* machine);
 
+// gmod_machine_destroy() in two halves: detach stops the machine and takes it off every list
+// on the Lua thread, free then waits for the read sections begun before it and releases its
+// memory and devices, it may run on any thread but never inside a read section
+GMOD_API void gmod_machine_detach(gmod_machine_t* machine);
+GMOD_API void gmod_machine_free(gmod_machine_t* machine);
+
 GMOD_API bool gmod_machine_start(gmod_machine_t* machine);
 GMOD_API bool gmod_machine_pause(gmod_machine_t* machine);
 GMOD_API bool gmod_machine_reset(gmod_machine_t* machine, bool reset = false);
@@ -51,6 +185,8 @@ GMOD_API bool gmod_machine_load_dtb(gmod_machine_t* machine, const char* path);
 GMOD_API bool gmod_machine_attach_nvme(gmod_machine_t* machine, const char* path, bool rw = false);
 
 GMOD_API bool gmod_machine_dump_dtb(gmod_machine_t* machine, const char* path);
+// Flattened device tree of the machine as RVVM would dump it, returns the size needed when buffer is null
+GMOD_API size_t gmod_machine_serialize_dtb(gmod_machine_t* machine, void* buffer, size_t size);
 
 GMOD_API bool gmod_machine_is_running(gmod_machine_t* machine);
 GMOD_API bool gmod_machine_is_powered(gmod_machine_t* machine);
@@ -74,4 +210,145 @@ GMOD_API bool gmod_machine_mouse_move(gmod_machine_t* machine, int32_t x, int32_
 GMOD_API bool gmod_machine_mouse_place(gmod_machine_t* machine, int32_t x, int32_t y);
 GMOD_API bool gmod_machine_mouse_resolution(gmod_machine_t* machine, uint32_t x, uint32_t y);
 
+GMOD_API bool gmod_machine_set_owner(gmod_machine_t* machine, const char* owner);
+GMOD_API const char* gmod_machine_get_owner(gmod_machine_t* machine);
+
+// Host CPU usage measured by the governor and the share it granted, in percent of one host core.
+// Threaded machines whose hart threads couldn't be picked out when started are charged their share.
+GMOD_API bool gmod_machine_get_cpu_usage(gmod_machine_t* machine, uint32_t* out_usage_cent, uint32_t* out_share_cent);
+
+// Host CPU time, in nanoseconds, the harts took since the machine was last started. Fails for
+// threaded machines whose hart threads couldn't be picked out.
+GMOD_API bool gmod_machine_get_cpu_time(gmod_machine_t* machine, uint64_t* out_ns);
+
+// The governor splits a server-wide CPU budget between owners by weight, then between the
+// machines of each owner, and enforces the shares through RVVM_OPT_MAX_CPU_CENT or the worker pool
+GMOD_API void gmod_machine_governor_enable(bool enable);
+GMOD_API bool gmod_machine_governor_enabled();
+GMOD_API void gmod_machine_governor_set_budget(uint32_t cent);
+GMOD_API uint32_t gmod_machine_governor_get_budget();
+GMOD_API uint32_t gmod_machine_governor_get_used();
+GMOD_API void gmod_machine_governor_set_owner_weight(const char* owner, uint32_t weight);
+
+// Must be called periodically from the Lua thread
+GMOD_API void gmod_machine_governor_update();
+
+// Restricts the harts of a pooled/ticked machine to the worker threads pinned on these host cores.
+// Fails if no worker is pinned inside the mask, harts run on any worker if the workers move out of it.
+// The hart threads of a threaded machine are pinned to the mask themselves, now or once started.
+// Fails if they couldn't be picked out when the machine was started.
+GMOD_API bool gmod_machine_set_affinity(gmod_machine_t* machine, uint64_t core_mask);
+GMOD_API uint64_t gmod_machine_get_affinity(gmod_machine_t* machine);
+
+// Pins the machine to the cores of a NUMA node and faults its guest RAM in on that node, only while paused
+GMOD_API bool gmod_machine_set_numa_node(gmod_machine_t* machine, int node);
+GMOD_API int gmod_machine_get_numa_node(gmod_machine_t* machine);
+
+GMOD_API int gmod_machine_get_numa_node_count();
+GMOD_API uint64_t gmod_machine_get_numa_node_cores(int node);
+
+// Opts the machine into same-page merging: identical 64 KiB blocks of guest RAM that stay
+// unchanged are mapped read-only onto one copy shared by all merged machines, a write gets
+// the machine a private copy again. Not available for machines with NVMe drives: their reads are
+// written into guest RAM by the OS, which fails on read-only blocks. Drives can't be attached while merging is on.
+GMOD_API bool gmod_machine_set_page_merge(gmod_machine_t* machine, bool enable);
+
+GMOD_API void gmod_machine_merge_set_scan_rate(uint32_t mb_per_sec);
+GMOD_API void gmod_machine_get_merge_stats(gmod_merge_stats_t* out_stats);
+
+// Bootroms and kernels of pooled/ticked machines are read once into a cache shared by all of them
+// and copied into their RAM on the first power on, files that changed on disk are read again.
+// Threaded machines don't use the cache, RVVM reads their images from disk itself, and so it does
+// for ELF bootroms, DTBs and resets after the first. Switching a machine to threaded hands its
+// cached images over. Images no machine waits on are dropped beyond mb, least recently used first.
+GMOD_API void gmod_machine_image_cache_set_max(uint32_t mb);
+GMOD_API void gmod_machine_get_image_cache_stats(gmod_image_cache_stats_t* out_stats);
+
+// Memory reclaim: a background thread scans the resident guest RAM of the machine for pages
+// the guest zeroed, which are handed back to the host during a short pause. Windows only backs
+// guest RAM with host memory once it's touched, so with this the machine's footprint follows
+// what the guest actually uses. Linux guests only zero freed pages when booted with
+// init_on_free=1. Not available together with page merging, NVMe drives or a NIC, which are
+// refused while reclaim is on.
+GMOD_API bool gmod_machine_set_ram_reclaim(gmod_machine_t* machine, bool enable);
+
+GMOD_API void gmod_machine_reclaim_set_scan_rate(uint32_t mb_per_sec);
+GMOD_API bool gmod_machine_get_reclaim_stats(gmod_machine_t* machine, gmod_reclaim_stats_t* out_stats);
+
+// Must be called periodically from the Lua thread, releases the zeroed pages of at most one machine
+GMOD_API void gmod_machine_reclaim_update();
+
+// Hibernation: machines that sat idle for idle_s seconds (0 turns it off) without input are
+// saved to dir and their guest RAM is given back to the OS. They're brought back on the next
+// gmod_machine_hibernation_update() after input reaches them, or right away when anything
+// needs their state. Guest accesses to the NIC count as activity, packets that arrive while the
+// machine is hibernated are dropped and don't bring it back. Threaded running machines whose hart
+// threads couldn't be picked out (see gmod_machine_get_cpu_usage()) and those with merged RAM
+// are left alone. The directory only changes while none are hibernated.
+GMOD_API void gmod_machine_hibernation_set(const char* dir, uint32_t idle_s);
+
+// Hibernates a listed machine right away, it comes back running if it was
+GMOD_API bool gmod_machine_hibernate(gmod_machine_t* machine);
+GMOD_API bool gmod_machine_resume(gmod_machine_t* machine);
+GMOD_API bool gmod_machine_is_hibernated(gmod_machine_t* machine);
+
+GMOD_API void gmod_machine_get_hibernation_stats(gmod_hibernation_stats_t* out_stats);
+
+// Must be called periodically from the Lua thread, brings back machines that got input and
+// hibernates at most one idle machine
+GMOD_API void gmod_machine_hibernation_update();
+
+// Memory budget: guest RAM, JIT caches and device buffers of all machines are counted against
+// limit_bytes (0 turns it off), hibernated machines without their RAM. Creating a listed
+// machine that would go over it first makes room by hibernating background machines that sat
+// idle the longest, then fails, or with GMOD_ADMIT_DOWNSIZE gets less RAM if it's created
+// through gmod_machine_create(). Pools need their size and fail instead. Machines coming back from hibernation are always let in, they were
+// admitted before.
+GMOD_API void gmod_machine_memory_set_limit(uint64_t limit_bytes, int policy = GMOD_ADMIT_REJECT);
+GMOD_API void gmod_machine_get_memory_stats(gmod_memory_stats_t* out_stats);
+
+// How far a new machine of that shape would go over the limit, 0 if it fits
+GMOD_API uint64_t gmod_machine_memory_shortfall(uint64_t ram_size, uint32_t harts);
+
+// Host memory counted for the machine right now
+GMOD_API uint64_t gmod_machine_get_memory(gmod_machine_t* machine);
+
+// Runaway watchdog: a background thread samples the harts of running machines and looks for
+// ones stuck in a tight loop, running without ever going idle with their PC confined to one
+// page. Every window a machine stays stuck its CPU share is halved, starting from
+// GMOD_WATCHDOG_BASE_CENT, and once it would drop below GMOD_WATCHDOG_MIN_CENT the machine is
+// paused. The share is given back when the guest stops spinning. Threaded harts are judged by
+// the CPU time of their threads, as it isn't known which thread runs which hart.
+GMOD_API void gmod_machine_watchdog_enable(bool enable);
+GMOD_API bool gmod_machine_watchdog_enabled();
+
+// Kernel symbols (System.map) for the PCs in watchdog events
+GMOD_API bool gmod_machine_load_symbols(gmod_machine_t* machine, const char* path);
+
+// Must be called periodically from the Lua thread, acts on what the watchdog found and returns up
+// to max events, the rest are returned by the next calls
+GMOD_API uint32_t gmod_machine_watchdog_update(gmod_watchdog_event_t* out_events, uint32_t max);
+
+// Keeps the machine from counting as idle, e.g. while someone is watching its screen. May be
+// called from any thread.
+GMOD_API void gmod_machine_mark_active(gmod_machine_t* machine);
+
+// The listed machine wrapping an RVVM machine, for devices that only know the latter
+GMOD_API gmod_machine_t* gmod_machine_from_rvvm(rvvm_machine_t* machine);
+
+// Wakes the event thread after injecting input or IRQs into the machine from outside of it,
+// and brings the machine back if it's hibernated
+GMOD_API void gmod_machine_notify(gmod_machine_t* machine);
+
+// Started machines whose guest hasn't powered itself off, may be called from any thread
+GMOD_API int gmod_machine_running_count();
+
+// The threaded ones among them, which need the event thread to tick their devices. Pooled and
+// ticked machines are ticked by the worker that steps them, on their own deadline.
+GMOD_API int gmod_machine_event_count();
+
+// Must be called periodically from the Lua thread, pauses the machines whose guest powered
+// itself off so that they can be started again
+GMOD_API void gmod_machine_power_update();
+
 GMOD_API void gmod_machine_shutdown_all();
\ No newline at end of file
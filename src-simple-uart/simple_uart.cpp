@@ -38,6 +38,11 @@ LUA_FUNCTION(uart_write)
 
 	chardev_simple_uart_push_rx(uart, buf, str_len);
 
+	// Also brings a hibernated machine back for the data
+	rvvm_mmio_dev_t* dev = simple_uart_get_mmio_dev(uart);
+	if (dev)
+		gmod_machine_notify(gmod_machine_from_rvvm(dev->machine));
+
 	return 0;
 }
 
@@ -194,6 +194,10 @@ static void web_fb_timer(void* data)
 	if (!fb->tj_compressor)
 		return;
 
+	// A machine somebody is watching isn't idle
+	if (!fb->connections.empty())
+		gmod_machine_mark_active(gmod_machine_from_rvvm(fb->mmio->machine));
+
 	//memcpy(fb->send_buffer, fb->buffer, fb->size);
 
 	if (tjCompress2(fb->tj_compressor, fb->buffer, fb->width, 0, fb->height,
@@ -229,6 +233,9 @@ static void web_fb_event_handler(struct mg_connection* conn, int ev, void* ev_da
 		{
 			fb->connections.push_back(conn);
 
+			// Brings a hibernated machine back for the viewer
+			gmod_machine_mark_active(gmod_machine_from_rvvm(fb->mmio->machine));
+
 			mg_printf(conn, "HTTP/1.1 200 OK\r\n"
 				"Content-Type: multipart/x-mixed-replace; boundary=--frame\r\n"
 				"Cache-Control: no-cache\r\n"
@@ -0,0 +1,119 @@
+#include "async_queue.h"
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+
+typedef struct async_task_t
+{
+	async_work_t work;
+	async_work_t done;
+} async_task_t;
+
+static std::mutex async_mutex; // guards everything below
+static std::condition_variable async_cond;
+static std::vector<std::thread> async_threads;
+static std::deque<async_task_t> async_queued;
+static std::deque<async_work_t> async_completed;
+static uint32_t async_running = 0;
+static uint64_t async_total = 0;
+static bool async_stop = false;
+
+static void async_thread_main()
+{
+	std::unique_lock<std::mutex> lock(async_mutex);
+
+	for (;;)
+	{
+		async_cond.wait(lock, [] { return async_stop || !async_queued.empty(); });
+
+		// Queued work still runs on shutdown, it may own resources only it releases
+		if (async_queued.empty()) return;
+
+		async_task_t task = std::move(async_queued.front());
+		async_queued.pop_front();
+		async_running++;
+
+		lock.unlock();
+
+		if (task.work)
+			task.work();
+
+		lock.lock();
+
+		async_running--;
+
+		if (task.done)
+			async_completed.push_back(std::move(task.done));
+	}
+}
+
+void async_queue_submit(async_work_t work, async_work_t done)
+{
+	std::lock_guard<std::mutex> lock(async_mutex);
+
+	if (async_threads.empty())
+	{
+		async_stop = false;
+
+		for (int i = 0; i < ASYNC_QUEUE_THREADS; i++)
+			async_threads.emplace_back(async_thread_main);
+	}
+
+	async_queued.push_back({ std::move(work), std::move(done) });
+	async_total++;
+
+	async_cond.notify_one();
+}
+
+uint32_t async_queue_poll()
+{
+	std::deque<async_work_t> completed;
+
+	{
+		std::lock_guard<std::mutex> lock(async_mutex);
+		completed.swap(async_completed);
+	}
+
+	// Callbacks may submit more work
+	for (async_work_t& done : completed)
+		done();
+
+	return (uint32_t)completed.size();
+}
+
+async_queue_stats_t async_queue_get_stats()
+{
+	std::lock_guard<std::mutex> lock(async_mutex);
+
+	async_queue_stats_t stats;
+
+	stats.queued = (uint32_t)async_queued.size();
+	stats.running = async_running;
+	stats.completed = (uint32_t)async_completed.size();
+	stats.total = async_total;
+
+	return stats;
+}
+
+void async_queue_shutdown()
+{
+	std::vector<std::thread> threads;
+
+	{
+		std::lock_guard<std::mutex> lock(async_mutex);
+
+		async_stop = true;
+		threads.swap(async_threads);
+	}
+
+	async_cond.notify_all();
+
+	for (std::thread& thread : threads)
+		thread.join();
+
+	std::lock_guard<std::mutex> lock(async_mutex);
+	async_completed.clear();
+}
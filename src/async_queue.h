@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <functional>
+
+#define ASYNC_QUEUE_THREADS 2 // mostly waiting on disk
+
+typedef std::function<void()> async_work_t;
+
+typedef struct async_queue_stats_t
+{
+	uint32_t queued;    // waiting for a worker
+	uint32_t running;
+	uint32_t completed; // done, waiting for async_queue_poll()
+	uint64_t total;
+} async_queue_stats_t;
+
+// Workers are started with the first submit
+void async_queue_submit(async_work_t work, async_work_t done);
+
+// Lua thread only, runs the done callbacks of finished work in the order it finished
+uint32_t async_queue_poll();
+
+async_queue_stats_t async_queue_get_stats();
+
+// Waits for queued work to finish, done callbacks that didn't run yet are dropped
+void async_queue_shutdown();
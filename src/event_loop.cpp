@@ -0,0 +1,162 @@
+#include "event_loop.h"
+
+#include <gmod_machine.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+typedef std::chrono::steady_clock event_clock;
+
+static std::thread event_thread;
+static std::mutex event_mutex;
+static std::condition_variable event_cond;
+
+// Guarded by event_mutex
+static bool event_running = false;
+static bool event_kicked = false;
+static event_clock::time_point event_kick_time;
+static event_loop_stats_t event_stats = {};
+
+static std::atomic<uint32_t> event_period_ms = EVENT_LOOP_DEFAULT_PERIOD_MS;
+
+static uint64_t to_ns(event_clock::duration duration)
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+}
+
+static void event_loop_thread()
+{
+	std::unique_lock<std::mutex> lock(event_mutex);
+
+	event_clock::time_point deadline = event_clock::now();
+
+	while (event_running)
+	{
+		event_clock::time_point wait_begin = event_clock::now();
+
+		// Checked again every period, guests may power themselves off
+		if (gmod_machine_event_count() > 0)
+		{
+			event_cond.wait_until(lock, deadline, [] { return event_kicked || !event_running; });
+		}
+		else
+		{
+			// Nothing to tick, park until a machine is started or the loop is kicked
+			event_cond.wait(lock, [] { return event_kicked || !event_running || gmod_machine_event_count() > 0; });
+		}
+
+		if (!event_running) break;
+
+		event_clock::time_point now = event_clock::now();
+
+		event_stats.wakeups++;
+		event_stats.idle_ns += to_ns(now - wait_begin);
+
+		if (event_kicked)
+		{
+			uint64_t latency = to_ns(now - event_kick_time);
+
+			event_stats.kick_wakeups++;
+			event_stats.kick_latency_total_ns += latency;
+			if (latency > event_stats.kick_latency_max_ns)
+				event_stats.kick_latency_max_ns = latency;
+
+			event_kicked = false;
+		}
+		else if (now >= deadline)
+		{
+			uint64_t lateness = to_ns(now - deadline);
+
+			event_stats.timer_wakeups++;
+			event_stats.timer_lateness_total_ns += lateness;
+			if (lateness > event_stats.timer_lateness_max_ns)
+				event_stats.timer_lateness_max_ns = lateness;
+		}
+
+		lock.unlock();
+		rvvm_external_tick_eventloop(true);
+		lock.lock();
+
+		deadline = event_clock::now() + std::chrono::milliseconds(event_period_ms.load());
+	}
+}
+
+void event_loop_start()
+{
+	std::lock_guard<std::mutex> lock(event_mutex);
+
+	if (event_running) return;
+
+	event_running = true;
+	event_kicked = false;
+	event_thread = std::thread(event_loop_thread);
+}
+
+void event_loop_stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(event_mutex);
+
+		if (!event_running) return;
+
+		event_running = false;
+	}
+
+	event_cond.notify_all();
+
+	if (event_thread.joinable())
+		event_thread.join();
+}
+
+bool event_loop_is_running()
+{
+	std::lock_guard<std::mutex> lock(event_mutex);
+	return event_running;
+}
+
+void event_loop_kick()
+{
+	{
+		std::lock_guard<std::mutex> lock(event_mutex);
+
+		if (!event_running) return;
+
+		if (!event_kicked)
+		{
+			event_kicked = true;
+			event_kick_time = event_clock::now();
+		}
+	}
+
+	event_cond.notify_one();
+}
+
+void event_loop_set_period(uint32_t ms)
+{
+	if (ms < 1) ms = 1;
+	if (ms > 1000) ms = 1000;
+
+	event_period_ms.store(ms);
+
+	event_loop_kick();
+}
+
+uint32_t event_loop_get_period()
+{
+	return event_period_ms.load();
+}
+
+event_loop_stats_t event_loop_get_stats()
+{
+	std::lock_guard<std::mutex> lock(event_mutex);
+	return event_stats;
+}
+
+void event_loop_reset_stats()
+{
+	std::lock_guard<std::mutex> lock(event_mutex);
+	event_stats = {};
+}
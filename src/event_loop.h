@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct event_loop_stats_t
+{
+	uint64_t wakeups;
+	uint64_t kick_wakeups;
+	uint64_t timer_wakeups;
+
+	uint64_t kick_latency_total_ns; // event_loop_kick() -> event thread running
+	uint64_t kick_latency_max_ns;
+
+	uint64_t timer_lateness_total_ns; // tick deadline -> event thread running
+	uint64_t timer_lateness_max_ns;
+
+	uint64_t idle_ns;
+} event_loop_stats_t;
+
+#define EVENT_LOOP_DEFAULT_PERIOD_MS 10
+
+// The event thread sleeps while no threaded machine is started and powered, and
+// otherwise ticks devices once per period, or immediately after event_loop_kick().
+// librvvm doesn't tell when devices need ticking next, so threaded machines get a
+// fixed period. Pooled and ticked machines are ticked by the scheduler instead.
+void event_loop_start();
+void event_loop_stop();
+bool event_loop_is_running();
+
+// Safe to call from any thread
+void event_loop_kick();
+
+void event_loop_set_period(uint32_t ms);
+uint32_t event_loop_get_period();
+
+event_loop_stats_t event_loop_get_stats();
+void event_loop_reset_stats();
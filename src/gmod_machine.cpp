@@ -1,30 +1,227 @@
 #include "gmod_machine.h"
 
+#include "event_loop.h"
+#include "machine_scheduler.h"
+#include "machine_snapshot.h"
+#include "machine_watchdog.h"
+#include "page_merge.h"
+#include "ram_reclaim.h"
+#include "image_cache.h"
+#include "hart_threads.h"
+#include "machine_registry.h"
+#include "rvvm_machine_prefix.h"
+
+extern "C"
+{
+#include <fdtlib.h>
+}
+
+#include <string.h>
+
 #include <map>
+#include <algorithm>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <filesystem>
+
+#include <Windows.h>
+
+// Where RVVM puts the kernel, right behind the space it leaves the bootrom
+#define GMOD_KERNEL_OFFSET_RV64 0x200000
+#define GMOD_KERNEL_OFFSET_RV32 0x400000
+
+typedef struct gmod_image_t
+{
+	std::string path;
+	image_cache_entry_t* cached; // null if RVVM loads it itself
+} gmod_image_t;
 
 typedef struct gmod_machine_t
 {
 	int id;
+	gmod_machine_handle_t handle; // 0 while unlisted
 	rvvm_machine_t* machine;
 
 	hid_keyboard_t* keyboard;
 	hid_mouse_t* mouse;
 
 	tap_dev_t* tap;
+	bool nic;       // has a NIC
+	bool networked; // has a NIC whose registers couldn't be watched for traffic
+
+	bool nvme; // has an NVMe drive, see gmod_machine_has_nvme()
+
+	bool started;
+	bool is_64bit;
+
+	// Copied in from the image cache on the first power on, RVVM gets the files after that
+	// for the resets it does on its own
+	gmod_image_t bootrom;
+	gmod_image_t kernel;
+	bool images_handed;
+
+	page_merge_region_t* merge_region;
+
+	// Zeroed guest pages are handed back to the host, the region is dropped while hibernated
+	bool reclaim;
+	ram_reclaim_region_t* reclaim_region;
+	uint32_t reclaim_pause_us;
+
+	// Saved to disk with its guest RAM given back, brought back before anything needs it again
+	bool hibernated;
+	bool hibernated_running;
+	std::atomic<bool> wake_requested;
+	std::atomic<int64_t> active_ns; // last input or CPU use, steady clock
+	uint64_t idle_cpu_ns;
+
+	uint64_t memory_bytes; // counted against the memory limit
+
+	uint32_t watchdog_cent; // CPU share the watchdog holds a spinning guest to, 0 if none
+	machine_symbols_t* symbols;
+
+	uint32_t exec_mode;
+	uint32_t tick_budget_us;
+	uint32_t tick_steps;
+
+	std::string owner;
+	uint32_t cpu_weight;
+	uint32_t harts;
+	uint32_t max_cpu_cent; // per hart, as set through RVVM_OPT_MAX_CPU_CENT
+	uint64_t last_cpu_ns;
+	hart_threads_t* hart_threads; // of a threaded machine since it was last started, null if they couldn't be found
+	uint32_t usage_cent;   // whole machine, percent of one host core
+	uint32_t share_cent;
+
+	uint64_t affinity;
+	int numa_node;
+
+	uint32_t priority;
+
+	uint32_t time_mode;
+	uint32_t time_catchup_cent;
 } gmod_machine_t;
 
-std::map<int, gmod_machine_t*> machines;
+typedef struct gmod_started_t
+{
+	rvvm_machine_t* machine;
+	bool threaded;
+} gmod_started_t;
+
+// Started machines, read by the event thread. Guests may power themselves off at any time,
+// which only shows through rvvm_machine_powered().
+static std::mutex started_mutex;
+static std::vector<gmod_started_t> started_machines;
+
+static std::atomic<uint64_t> memory_limit = 0;
+static std::atomic<uint64_t> memory_committed = 0;
+static std::atomic<uint32_t> memory_machines = 0;
+static std::atomic<uint64_t> memory_rejected = 0; // pools create machines from their own thread
+static int memory_policy = GMOD_ADMIT_REJECT;
+static gmod_memory_stats_t memory_stats = {};
+
+// Brings the server-wide total in line with what the machine takes right now
+static void gmod_machine_account_memory(gmod_machine_t* machine, bool release = false)
+{
+	uint64_t bytes = 0;
+
+	if (!release)
+	{
+		bytes = GMOD_MEMORY_MACHINE_OVERHEAD;
 
-gmod_machine_t* get_machine(int id)
+		// Hibernated machines gave their RAM back, RVVM keeps the JIT caches
+		if (!machine->hibernated)
+			bytes += rvvm_get_opt(machine->machine, RVVM_OPT_MEM_SIZE);
+
+		if (rvvm_get_opt(machine->machine, RVVM_OPT_JIT))
+			bytes += rvvm_get_opt(machine->machine, RVVM_OPT_JIT_CACHE) * machine->harts;
+	}
+
+	memory_committed += bytes - machine->memory_bytes;
+	machine->memory_bytes = bytes;
+}
+
+// Adds bytes to the total unless that would go over the limit
+static bool gmod_machine_memory_reserve(uint64_t bytes)
 {
-	auto it = machines.find(id);
-	if (it != machines.end())
+	uint64_t committed = memory_committed.load();
+
+	do
 	{
-		return it->second;
+		uint64_t limit = memory_limit;
+
+		if (limit && committed + bytes > limit) return false;
 	}
-	return nullptr;
+	while (!memory_committed.compare_exchange_weak(committed, committed + bytes));
+
+	return true;
+}
+
+// Host CPU time the harts took since the machine was last started, false if it can't be told
+static bool gmod_machine_get_cpu_ns(gmod_machine_t* machine, uint64_t* out_ns)
+{
+	if (machine->exec_mode != GMOD_EXEC_THREADED)
+		*out_ns = machine_scheduler_get_cpu_ns(machine);
+	else if (machine->hart_threads)
+		*out_ns = hart_threads_cpu_ns(machine->hart_threads);
+	else
+		return false;
+
+	return true;
+}
+
+static void gmod_machine_set_started(gmod_machine_t* machine, bool started)
+{
+	if (machine->started == started) return;
+
+	machine->started = started;
+
+	{
+		std::lock_guard<std::mutex> lock(started_mutex);
+
+		if (started)
+			started_machines.push_back({ machine->machine, machine->exec_mode == GMOD_EXEC_THREADED });
+		else
+		{
+			started_machines.erase(std::remove_if(started_machines.begin(), started_machines.end(), [machine](const gmod_started_t& entry) {
+				return entry.machine == machine->machine;
+			}), started_machines.end());
+		}
+	}
+
+	if (started)
+		machine->active_ns = std::chrono::steady_clock::now().time_since_epoch().count();
+
+	event_loop_kick();
+}
+
+static machine_budget_t gmod_machine_get_budget(gmod_machine_t* machine)
+{
+	machine_budget_t budget = {};
+
+	if (machine->exec_mode == GMOD_EXEC_TICKED)
+	{
+		budget.time_ns = (uint64_t)machine->tick_budget_us * 1000;
+		budget.steps = machine->tick_steps;
+	}
+
+	return budget;
 }
 
+static bool gmod_machine_thaw(gmod_machine_t* machine);
+static void gmod_machine_drop_hibernation(gmod_machine_t* machine);
+static uint64_t gmod_machine_memory_make_room(uint64_t ram_size, uint32_t harts);
+
+gmod_machine_t* get_machine(int id)
+{
+	return machine_registry_find(id);
+}
+
+// Runs on the Lua thread, which may hibernate listed machines to make room
 gmod_machine_t* gmod_machine_create(int id, int ram_size, int harts_num, bool is_64bit)
 {
 	if (get_machine(id) != nullptr)
@@ -32,10 +229,55 @@ gmod_machine_t* gmod_machine_create(int id, int ram_size, int harts_num, bool is
 		return nullptr;
 	}
 
+	uint64_t shortfall = gmod_machine_memory_make_room(ram_size, harts_num);
+
+	if (shortfall && memory_policy == GMOD_ADMIT_DOWNSIZE && shortfall < (uint64_t)ram_size)
+	{
+		uint64_t fitting = ((uint64_t)ram_size - shortfall) & ~((1ULL << 20) - 1);
+
+		if (fitting >= GMOD_MEMORY_MIN_RAM)
+		{
+			ram_size = (int)fitting;
+			memory_stats.downsized++;
+		}
+	}
+
+	gmod_machine_t* gmod_machine = gmod_machine_create_unlisted(ram_size, harts_num, is_64bit);
+
+	if (!gmod_machine)
+	{
+		return nullptr;
+	}
+
+	// Taken in the meantime, or every slot is in use
+	if (!gmod_machine_assign_id(gmod_machine, id))
+	{
+		gmod_machine_destroy(gmod_machine);
+		return nullptr;
+	}
+
+	return gmod_machine;
+}
+
+gmod_machine_t* gmod_machine_create_unlisted(int ram_size, int harts_num, bool is_64bit)
+{
+	if (ram_size <= 0 || harts_num <= 0) return nullptr;
+
+	// Taken before RVVM allocates anything, pools create machines on several threads at once.
+	// The JIT cache size is only known once RVVM made the machine.
+	uint64_t reserved = (uint64_t)ram_size + harts_num * GMOD_MEMORY_JIT_ESTIMATE + GMOD_MEMORY_MACHINE_OVERHEAD;
+
+	if (!gmod_machine_memory_reserve(reserved))
+	{
+		memory_rejected++;
+		return nullptr;
+	}
+
 	rvvm_machine_t* machine = rvvm_create_machine(ram_size, harts_num, is_64bit ? "rv64" : "rv32");
 
 	if (!machine)
 	{
+		memory_committed -= reserved;
 		return nullptr;
 	}
 
@@ -43,15 +285,67 @@ gmod_machine_t* gmod_machine_create(int id, int ram_size, int harts_num, bool is
 
 	gmod_machine_t* gmod_machine = new gmod_machine_t();
 
-	gmod_machine->id = id;
+	gmod_machine->id = 0;
+	gmod_machine->handle = 0;
 	gmod_machine->machine = machine;
 	gmod_machine->tap = nullptr;
-
-	machines.emplace(id, gmod_machine);
+	gmod_machine->nic = false;
+	gmod_machine->networked = false;
+	gmod_machine->nvme = false;
+	gmod_machine->bootrom.cached = nullptr;
+	gmod_machine->kernel.cached = nullptr;
+	gmod_machine->images_handed = false;
+	gmod_machine->exec_mode = GMOD_EXEC_THREADED;
+	gmod_machine->tick_budget_us = GMOD_DEFAULT_TICK_BUDGET_US;
+	gmod_machine->tick_steps = 0;
+	gmod_machine->cpu_weight = GMOD_DEFAULT_CPU_WEIGHT;
+	gmod_machine->harts = harts_num;
+	gmod_machine->is_64bit = is_64bit;
+	gmod_machine->merge_region = nullptr;
+	gmod_machine->reclaim = false;
+	gmod_machine->reclaim_region = nullptr;
+	gmod_machine->reclaim_pause_us = 0;
+	gmod_machine->hibernated = false;
+	gmod_machine->hibernated_running = false;
+	gmod_machine->wake_requested = false;
+	gmod_machine->active_ns = std::chrono::steady_clock::now().time_since_epoch().count();
+	gmod_machine->idle_cpu_ns = 0;
+	gmod_machine->hart_threads = nullptr;
+	gmod_machine->max_cpu_cent = (uint32_t)rvvm_get_opt(machine, RVVM_OPT_MAX_CPU_CENT);
+	gmod_machine->numa_node = -1;
+	gmod_machine->priority = GMOD_PRIORITY_NORMAL;
+	gmod_machine->time_mode = GMOD_TIME_HOST;
+	gmod_machine->time_catchup_cent = GMOD_DEFAULT_TIME_CATCHUP_CENT;
+	gmod_machine->memory_bytes = reserved;
+	gmod_machine->watchdog_cent = 0;
+	gmod_machine->symbols = nullptr;
+
+	// The reservation turns into what the machine really takes
+	gmod_machine_account_memory(gmod_machine);
+	memory_machines++;
 
 	return gmod_machine;
 }
 
+bool gmod_machine_assign_id(gmod_machine_t* machine, int id)
+{
+	if (!machine || machine->handle) return false;
+
+	// Set first, others may find it as soon as it's listed
+	int old_id = machine->id;
+	machine->id = id;
+
+	machine->handle = machine_registry_add(id, machine, machine->machine);
+
+	if (!machine->handle)
+	{
+		machine->id = old_id;
+		return false;
+	}
+
+	return true;
+}
+
 int gmod_machine_get_id(gmod_machine_t* machine)
 {
 	if (machine)
@@ -60,6 +354,29 @@ int gmod_machine_get_id(gmod_machine_t* machine)
 	return 0;
 }
 
+gmod_machine_handle_t gmod_machine_get_handle(gmod_machine_t* machine)
+{
+	if (machine)
+		return machine->handle;
+
+	return 0;
+}
+
+gmod_machine_t* gmod_machine_from_handle(gmod_machine_handle_t handle)
+{
+	return machine_registry_get(handle);
+}
+
+uint32_t gmod_machine_read_begin()
+{
+	return machine_registry_read_begin();
+}
+
+void gmod_machine_read_end(uint32_t section)
+{
+	machine_registry_read_end(section);
+}
+
 rvvm_machine_t* gmod_machine_get_rvvm_machine(gmod_machine_t* machine)
 {
 	if (machine)
@@ -68,24 +385,98 @@ rvvm_machine_t* gmod_machine_get_rvvm_machine(gmod_machine_t* machine)
 	return nullptr;
 }
 
-void gmod_machine_destroy(gmod_machine_t* machine)
+void gmod_machine_detach(gmod_machine_t* machine)
 {
 	if (!machine) return;
 
-	auto it = machines.find(machine->id);
-	if (it != machines.end())
-	{
-		if (machine->tap)
-			tap_close(machine->tap);
+	gmod_machine_drop_hibernation(machine);
+
+	machine_scheduler_remove(machine);
+	gmod_machine_set_started(machine, false);
+
+	// Unlisted machines may share their id with a listed one and are destroyed on pool threads,
+	// they never go near the registry. The handle only ever refers to this one.
+	if (machine->handle)
+		machine_registry_remove(machine->handle);
+
+	machine->handle = 0;
+}
+
+// gmod_machine_free() once no other thread can be looking at the machine
+static void gmod_machine_release(gmod_machine_t* machine)
+{
+	if (machine->tap)
+		tap_close(machine->tap);
+
+	page_merge_remove(machine->merge_region, false);
+	ram_reclaim_remove(machine->reclaim_region);
+
+	image_cache_release(machine->bootrom.cached);
+	image_cache_release(machine->kernel.cached);
+
+	gmod_machine_account_memory(machine, true);
+	memory_machines--;
+
+	machine_symbols_free(machine->symbols);
+
+	// Sampled by the watchdog until then
+	hart_threads_free(machine->hart_threads);
+	rvvm_free_machine(machine->machine);
+	delete machine;
+}
+
+void gmod_machine_free(gmod_machine_t* machine)
+{
+	if (!machine) return;
 
-		rvvm_free_machine(machine->machine);
-		delete machine;
-		machines.erase(it);
+	// Detached, but another thread may have found it just before
+	machine_registry_synchronize();
+
+	gmod_machine_release(machine);
+}
+
+void gmod_machine_destroy(gmod_machine_t* machine)
+{
+	gmod_machine_detach(machine);
+	gmod_machine_free(machine);
+}
+
+// Hands the image paths to RVVM, which loads them on every reset from then on
+static bool gmod_machine_hand_images(gmod_machine_t* machine)
+{
+	if (machine->images_handed) return true;
+
+	if (machine->bootrom.cached && !rvvm_load_bootrom(machine->machine, machine->bootrom.path.c_str())) return false;
+	if (machine->kernel.cached && !rvvm_load_kernel(machine->machine, machine->kernel.path.c_str())) return false;
+
+	image_cache_release(machine->bootrom.cached);
+	image_cache_release(machine->kernel.cached);
+
+	machine->bootrom.cached = nullptr;
+	machine->kernel.cached = nullptr;
+	machine->images_handed = true;
+
+	return true;
+}
+
+// Same places RVVM loads them to, harts are reset but haven't run yet
+static void gmod_machine_copy_images(gmod_machine_t* machine)
+{
+	rvvm_addr_t mem_base = rvvm_get_opt(machine->machine, RVVM_OPT_MEM_BASE);
+	size_t mem_size = (size_t)rvvm_get_opt(machine->machine, RVVM_OPT_MEM_SIZE);
+
+	if (machine->bootrom.cached)
+	{
+		size_t size = image_cache_size(machine->bootrom.cached);
+		rvvm_write_ram(machine->machine, mem_base, image_cache_data(machine->bootrom.cached), size < mem_size ? size : mem_size);
 	}
-	else
+
+	size_t kernel_offset = machine->is_64bit ? GMOD_KERNEL_OFFSET_RV64 : GMOD_KERNEL_OFFSET_RV32;
+
+	if (machine->kernel.cached && kernel_offset < mem_size)
 	{
-		rvvm_free_machine(machine->machine);
-		delete machine;
+		size_t size = image_cache_size(machine->kernel.cached);
+		rvvm_write_ram(machine->machine, mem_base + kernel_offset, image_cache_data(machine->kernel.cached), size < mem_size - kernel_offset ? size : mem_size - kernel_offset);
 	}
 }
 
@@ -93,29 +484,164 @@ bool gmod_machine_start(gmod_machine_t* machine)
 {
 	if (!machine) return false;
 
-	return rvvm_start_machine(machine->machine);
+	if (machine->hibernated && !gmod_machine_thaw(machine)) return false;
+
+	if (machine->exec_mode != GMOD_EXEC_THREADED)
+	{
+		if (machine->started) return true;
+
+		bool cold = !rvvm_machine_powered(machine->machine);
+
+		rvvm_external_init_single_step(machine->machine);
+
+		// Stepped harts only run once the machine is scheduled, which leaves room to fill RAM from the cache
+		if (cold && !machine->images_handed)
+			gmod_machine_copy_images(machine);
+
+		if (!gmod_machine_hand_images(machine)) return false;
+
+		machine_budget_t budget = gmod_machine_get_budget(machine);
+
+		if (!machine_scheduler_add(machine, &budget, machine->affinity, machine->priority))
+			return false;
+
+		machine_scheduler_set_virtual_time(machine, machine->time_mode == GMOD_TIME_VIRTUAL, machine->time_catchup_cent);
+	}
+	else
+	{
+		if (!gmod_machine_hand_images(machine)) return false;
+
+		hart_threads_t* threads = nullptr;
+
+		if (!hart_threads_start([machine] { return rvvm_start_machine(machine->machine); }, machine->harts, &threads))
+			return false;
+
+		hart_threads_free(machine->hart_threads);
+		machine->hart_threads = threads;
+
+		hart_threads_watch(threads, machine);
+
+		if (machine->affinity)
+			hart_threads_set_affinity(threads, machine->affinity);
+	}
+
+	// Both the pool and new hart threads count CPU time from 0 again
+	machine->last_cpu_ns = 0;
+	machine->idle_cpu_ns = 0;
+
+	gmod_machine_set_started(machine, true);
+
+	return true;
 }
 
 bool gmod_machine_pause(gmod_machine_t* machine)
 {
 	if (!machine) return false;
 
-	return rvvm_pause_machine(machine->machine);
+	// Stays on disk, but won't run once it's brought back
+	if (machine->hibernated)
+	{
+		machine->hibernated_running = false;
+		return true;
+	}
+
+	if (machine->exec_mode != GMOD_EXEC_THREADED)
+	{
+		machine_scheduler_remove(machine);
+		rvvm_pause_machine(machine->machine);
+	}
+	else
+	{
+		if (!rvvm_pause_machine(machine->machine)) return false;
+
+		hart_threads_free(machine->hart_threads);
+		machine->hart_threads = nullptr;
+	}
+
+	gmod_machine_set_started(machine, false);
+
+	return true;
 }
 
 bool gmod_machine_reset(gmod_machine_t* machine, bool reset)
 {
 	if (!machine) return false;
 
+	if (machine->hibernated && !gmod_machine_resume(machine)) return false;
+
 	rvvm_reset_machine(machine->machine, reset);
 
 	return true;
 }
 
+// Register handlers of the rtl8169, the same for every NIC
+static std::atomic<rvvm_mmio_handler_t> nic_read = nullptr;
+static std::atomic<rvvm_mmio_handler_t> nic_write = nullptr;
+
+static void gmod_machine_nic_touched(rvvm_mmio_dev_t* dev)
+{
+	uint32_t section = machine_registry_read_begin();
+
+	gmod_machine_t* machine = machine_registry_find_rvvm(dev->machine);
+
+	if (machine)
+		machine->active_ns = std::chrono::steady_clock::now().time_since_epoch().count();
+
+	machine_registry_read_end(section);
+}
+
+static bool gmod_machine_nic_read(rvvm_mmio_dev_t* dev, void* dest, size_t offset, uint8_t size)
+{
+	gmod_machine_nic_touched(dev);
+
+	return nic_read.load(std::memory_order_relaxed)(dev, dest, offset, size);
+}
+
+static bool gmod_machine_nic_write(rvvm_mmio_dev_t* dev, void* dest, size_t offset, uint8_t size)
+{
+	gmod_machine_nic_touched(dev);
+
+	return nic_write.load(std::memory_order_relaxed)(dev, dest, offset, size);
+}
+
+// The tap doesn't let packets be seen, but the guest driver goes through the NIC registers for
+// every one it sends or takes in, which keeps the machine from counting as idle. Wraps the
+// handlers of the MMIO regions attached since first_dev, returns false if there were none.
+static bool gmod_machine_watch_nic(gmod_machine_t* machine, size_t first_dev)
+{
+	rvvm_machine_prefix_t* prefix = rvvm_machine_prefix(machine->machine);
+	bool watched = false;
+
+	for (size_t i = first_dev; i < prefix->mmio_devs.count; i++)
+	{
+		rvvm_mmio_dev_t* dev = prefix->mmio_devs.data[i];
+
+		if (!dev->read || !dev->write) continue;
+
+		rvvm_mmio_handler_t read = nullptr;
+		rvvm_mmio_handler_t write = nullptr;
+
+		nic_read.compare_exchange_strong(read, dev->read);
+		nic_write.compare_exchange_strong(write, dev->write);
+
+		if (dev->read != nic_read.load() || dev->write != nic_write.load()) continue;
+
+		dev->read = gmod_machine_nic_read;
+		dev->write = gmod_machine_nic_write;
+
+		watched = true;
+	}
+
+	return watched;
+}
+
 bool gmod_machine_load_def_devices(gmod_machine_t* machine)
 {
 	if (!machine) return false;
 
+	// See gmod_machine_set_ram_reclaim()
+	if (machine->reclaim) return false;
+
 	riscv_clint_init_auto(machine->machine);
 	riscv_plic_init_auto(machine->machine);
 	/*riscv_imsic_init_auto(machine->machine);
@@ -129,7 +655,11 @@ bool gmod_machine_load_def_devices(gmod_machine_t* machine)
 
 	if (tap)
 	{
+		size_t first_dev = rvvm_machine_prefix(machine->machine)->mmio_devs.count;
+
 		rtl8169_init(pci, tap);
+		machine->nic = true;
+		machine->networked = !gmod_machine_watch_nic(machine, first_dev);
 	}
 
 	i2c_oc_init_auto(machine->machine);
@@ -139,18 +669,40 @@ bool gmod_machine_load_def_devices(gmod_machine_t* machine)
 	return true;
 }
 
+// Pooled/ticked machines copy the image from the cache on their first power on. RVVM reads it
+// itself for threaded machines, whose harts start right away, ELF bootroms, which it loads segment
+// by segment, and images given after the machine was powered.
+static bool gmod_machine_set_image(gmod_machine_t* machine, gmod_image_t* image, const char* path, bool maybe_elf)
+{
+	bool cacheable = !machine->images_handed && machine->exec_mode != GMOD_EXEC_THREADED;
+	image_cache_entry_t* cached = cacheable ? image_cache_acquire(path) : nullptr;
+
+	if (cached && maybe_elf && image_cache_size(cached) >= 4 && memcmp(image_cache_data(cached), "\x7f" "ELF", 4) == 0)
+	{
+		image_cache_release(cached);
+		cached = nullptr;
+	}
+
+	image_cache_release(image->cached);
+
+	image->path = path;
+	image->cached = cached;
+
+	return cached != nullptr;
+}
+
 bool gmod_machine_load_bootrom(gmod_machine_t* machine, const char* path)
 {
-	if (!machine) return false;
+	if (!machine || !path) return false;
 
-	return rvvm_load_bootrom(machine->machine, path);
+	return gmod_machine_set_image(machine, &machine->bootrom, path, true) || rvvm_load_bootrom(machine->machine, path);
 }
 
 bool gmod_machine_load_kernel(gmod_machine_t* machine, const char* path)
 {
-	if (!machine) return false;
+	if (!machine || !path) return false;
 
-	return rvvm_load_kernel(machine->machine, path);
+	return gmod_machine_set_image(machine, &machine->kernel, path, false) || rvvm_load_kernel(machine->machine, path);
 }
 
 bool gmod_machine_load_dtb(gmod_machine_t* machine, const char* path)
@@ -160,11 +712,26 @@ bool gmod_machine_load_dtb(gmod_machine_t* machine, const char* path)
 	return rvvm_load_dtb(machine->machine, path);
 }
 
+// RVVM's NVMe reads go straight from the image into guest RAM through the OS, which fails on
+// pages that are mapped read-only instead of faulting them in. The guest would see I/O errors,
+// so drives and merged RAM are kept apart.
+static bool gmod_machine_has_nvme(gmod_machine_t* machine)
+{
+	return machine->nvme;
+}
+
 bool gmod_machine_attach_nvme(gmod_machine_t* machine, const char* path, bool rw)
 {
 	if (!machine) return false;
 
-	return (nvme_init_auto(machine->machine, path, rw) != nullptr);
+	// See gmod_machine_has_nvme() and gmod_machine_set_ram_reclaim()
+	if (machine->merge_region || machine->reclaim) return false;
+
+	if (nvme_init_auto(machine->machine, path, rw) == nullptr) return false;
+
+	machine->nvme = true;
+
+	return true;
 }
 
 bool gmod_machine_dump_dtb(gmod_machine_t* machine, const char* path)
@@ -174,6 +741,16 @@ bool gmod_machine_dump_dtb(gmod_machine_t* machine, const char* path)
 	return rvvm_dump_dtb(machine->machine, path);
 }
 
+size_t gmod_machine_serialize_dtb(gmod_machine_t* machine, void* buffer, size_t size)
+{
+	if (!machine) return 0;
+
+	struct fdt_node* root = rvvm_get_fdt_root(machine->machine);
+	if (!root) return 0;
+
+	return fdt_serialize(root, buffer, size, 0);
+}
+
 bool gmod_machine_is_running(gmod_machine_t* machine)
 {
 	if (!machine) return false;
@@ -208,12 +785,103 @@ bool gmod_machine_set_cmdline(gmod_machine_t* machine, const char* cmd)
 
 rvvm_addr_t gmod_machine_get_opt(gmod_machine_t* machine, uint32_t opt)
 {
-	return rvvm_get_opt(machine->machine, opt);
+	if (!machine) return 0;
+
+	switch (opt)
+	{
+	case GMOD_OPT_EXEC_MODE:
+		return machine->exec_mode;
+	case GMOD_OPT_TICK_BUDGET_US:
+		return machine->tick_budget_us;
+	case GMOD_OPT_TICK_STEPS:
+		return machine->tick_steps;
+	case GMOD_OPT_CPU_WEIGHT:
+		return machine->cpu_weight;
+	case GMOD_OPT_PRIORITY:
+		return machine->priority;
+	case GMOD_OPT_TIME_MODE:
+		return machine->time_mode;
+	case GMOD_OPT_TIME_CATCHUP_CENT:
+		return machine->time_catchup_cent;
+	case RVVM_OPT_MAX_CPU_CENT:
+		return machine->max_cpu_cent;
+	default:
+		return rvvm_get_opt(machine->machine, opt);
+	}
 }
 
 bool gmod_machine_set_opt(gmod_machine_t* machine, uint32_t opt, rvvm_addr_t value)
 {
-	return rvvm_set_opt(machine->machine, opt, value);
+	if (!machine) return false;
+
+	switch (opt)
+	{
+	case GMOD_OPT_EXEC_MODE:
+		// Harts can't be moved between their own threads and the pool while running
+		if (machine->started || value > GMOD_EXEC_TICKED) return false;
+
+		// RVVM would read the cached images again when the harts start, let go of them now
+		if (value == GMOD_EXEC_THREADED && !gmod_machine_hand_images(machine)) return false;
+
+		machine->exec_mode = (uint32_t)value;
+		return true;
+	case GMOD_OPT_TICK_BUDGET_US:
+	case GMOD_OPT_TICK_STEPS:
+	{
+		if (opt == GMOD_OPT_TICK_BUDGET_US)
+		{
+			if (value == 0) return false;
+			machine->tick_budget_us = (uint32_t)value;
+		}
+		else
+			machine->tick_steps = (uint32_t)value;
+
+		if (machine->started && machine->exec_mode == GMOD_EXEC_TICKED)
+		{
+			machine_budget_t budget = gmod_machine_get_budget(machine);
+			machine_scheduler_set_budget(machine, &budget);
+		}
+
+		return true;
+	}
+	case GMOD_OPT_CPU_WEIGHT:
+		if (value == 0) return false;
+		machine->cpu_weight = (uint32_t)value;
+		return true;
+	case GMOD_OPT_PRIORITY:
+		if (value > GMOD_PRIORITY_INTERACTIVE) return false;
+		machine->priority = (uint32_t)value;
+		if (machine->started && machine->exec_mode != GMOD_EXEC_THREADED)
+			machine_scheduler_set_priority(machine, machine->priority);
+		return true;
+	case GMOD_OPT_TIME_MODE:
+	case GMOD_OPT_TIME_CATCHUP_CENT:
+		if (opt == GMOD_OPT_TIME_MODE)
+		{
+			if (value > GMOD_TIME_VIRTUAL) return false;
+			machine->time_mode = (uint32_t)value;
+		}
+		else
+			machine->time_catchup_cent = (uint32_t)value;
+
+		// Threaded harts run on their own, their clock can only follow the host
+		if (machine->started && machine->exec_mode != GMOD_EXEC_THREADED)
+			machine_scheduler_set_virtual_time(machine, machine->time_mode == GMOD_TIME_VIRTUAL, machine->time_catchup_cent);
+
+		return true;
+	case RVVM_OPT_MAX_CPU_CENT:
+		// Upper bound for the governor, which overrides the RVVM option while enabled
+		if (!rvvm_set_opt(machine->machine, opt, value)) return false;
+		machine->max_cpu_cent = (uint32_t)value;
+		return true;
+	case RVVM_OPT_JIT:
+	case RVVM_OPT_JIT_CACHE:
+		if (!rvvm_set_opt(machine->machine, opt, value)) return false;
+		gmod_machine_account_memory(machine);
+		return true;
+	default:
+		return rvvm_set_opt(machine->machine, opt, value);
+	}
 }
 
 bool gmod_machine_attach_keyboard(gmod_machine_t* machine)
@@ -244,10 +912,25 @@ bool gmod_machine_attach_mouse(gmod_machine_t* machine)
 	return true;
 }
 
-GMOD_API bool gmod_machine_keyboard_press(gmod_machine_t* machine, hid_key_t key)
+bool gmod_machine_load_symbols(gmod_machine_t* machine, const char* path)
 {
-	if (!machine || !machine->keyboard) return false;
-	hid_keyboard_press(machine->keyboard, key);
+	if (!machine || !path) return false;
+
+	machine_symbols_t* symbols = machine_symbols_load(path);
+
+	if (!symbols) return false;
+
+	machine_symbols_free(machine->symbols);
+	machine->symbols = symbols;
+
+	return true;
+}
+
+GMOD_API bool gmod_machine_keyboard_press(gmod_machine_t* machine, hid_key_t key)
+{
+	if (!machine || !machine->keyboard) return false;
+	hid_keyboard_press(machine->keyboard, key);
+	gmod_machine_notify(machine);
 	return true;
 }
 
@@ -255,6 +938,7 @@ GMOD_API bool gmod_machine_keyboard_release(gmod_machine_t* machine, hid_key_t k
 {
 	if (!machine || !machine->keyboard) return false;
 	hid_keyboard_release(machine->keyboard, key);
+	gmod_machine_notify(machine);
 	return true;
 }
 
@@ -262,6 +946,7 @@ GMOD_API bool gmod_machine_mouse_press(gmod_machine_t* machine, hid_btns_t btns)
 {
 	if (!machine || !machine->mouse) return false;
 	hid_mouse_press(machine->mouse, btns);
+	gmod_machine_notify(machine);
 	return true;
 }
 
@@ -269,6 +954,7 @@ GMOD_API bool gmod_machine_mouse_release(gmod_machine_t* machine, hid_btns_t btn
 {
 	if (!machine || !machine->mouse) return false;
 	hid_mouse_release(machine->mouse, btns);
+	gmod_machine_notify(machine);
 	return true;
 }
 
@@ -276,6 +962,7 @@ GMOD_API bool gmod_machine_mouse_scroll(gmod_machine_t* machine, int32_t offset)
 {
 	if (!machine || !machine->mouse) return false;
 	hid_mouse_scroll(machine->mouse, offset);
+	gmod_machine_notify(machine);
 	return true;
 }
 
@@ -283,6 +970,7 @@ GMOD_API bool gmod_machine_mouse_move(gmod_machine_t* machine, int32_t x, int32_
 {
 	if (!machine || !machine->mouse) return false;
 	hid_mouse_move(machine->mouse, x, y);
+	gmod_machine_notify(machine);
 	return true;
 }
 
@@ -290,6 +978,7 @@ GMOD_API bool gmod_machine_mouse_place(gmod_machine_t* machine, int32_t x, int32
 {
 	if (!machine || !machine->mouse) return false;
 	hid_mouse_place(machine->mouse, x, y);
+	gmod_machine_notify(machine);
 	return true;
 }
 
@@ -297,16 +986,1060 @@ GMOD_API bool gmod_machine_mouse_resolution(gmod_machine_t* machine, uint32_t x,
 {
 	if (!machine || !machine->mouse) return false;
 	hid_mouse_resolution(machine->mouse, x, y);
+	gmod_machine_notify(machine);
+	return true;
+}
+
+/*
+ * CPU governor
+ */
+
+typedef std::chrono::steady_clock governor_clock;
+
+typedef struct governor_share_t
+{
+	gmod_machine_t* machine;
+	double weight;
+	double demand;
+	double share;
+} governor_share_t;
+
+static bool governor_enabled = false;
+static uint32_t governor_budget_cent = 0;
+static uint32_t governor_used_cent = 0;
+static std::map<std::string, uint32_t> governor_owner_weights;
+static governor_clock::time_point governor_last_update;
+
+// Weighted max-min fair share: nobody gets more than they ask for, leftovers are redistributed by weight
+static void governor_fair_share(std::vector<governor_share_t*> entries, double budget)
+{
+	while (!entries.empty())
+	{
+		double total_weight = 0.0;
+		for (auto entry : entries)
+			total_weight += entry->weight;
+
+		double left = budget;
+		bool satisfied = false;
+
+		for (auto it = entries.begin(); it != entries.end();)
+		{
+			double fair = budget * (*it)->weight / total_weight;
+
+			if ((*it)->demand <= fair)
+			{
+				(*it)->share = (*it)->demand;
+				left -= (*it)->demand;
+				it = entries.erase(it);
+				satisfied = true;
+			}
+			else
+				++it;
+		}
+
+		if (!satisfied)
+		{
+			for (auto entry : entries)
+				entry->share = budget * entry->weight / total_weight;
+
+			return;
+		}
+
+		budget = left;
+	}
+}
+
+static void governor_apply(gmod_machine_t* machine, uint32_t share_cent)
+{
+	machine->share_cent = share_cent;
+
+	if (machine->exec_mode == GMOD_EXEC_THREADED)
+	{
+		uint32_t per_hart = share_cent / (machine->harts ? machine->harts : 1);
+
+		if (per_hart < 1) per_hart = 1;
+		if (per_hart > machine->max_cpu_cent) per_hart = machine->max_cpu_cent;
+
+		rvvm_set_opt(machine->machine, RVVM_OPT_MAX_CPU_CENT, per_hart);
+	}
+	else
+	{
+		machine_scheduler_set_cpu_limit(machine, share_cent);
+	}
+}
+
+static void governor_release(gmod_machine_t* machine)
+{
+	machine->share_cent = 0;
+
+	rvvm_set_opt(machine->machine, RVVM_OPT_MAX_CPU_CENT, machine->max_cpu_cent);
+	machine_scheduler_set_cpu_limit(machine, 0);
+}
+
+// Holds the machine to the share the watchdog left it with, or lets it go. The governor
+// keeps to it as well from its next update on.
+static void gmod_machine_watchdog_apply(gmod_machine_t* machine)
+{
+	if (machine->watchdog_cent)
+		governor_apply(machine, machine->watchdog_cent);
+	else
+		governor_release(machine);
+}
+
+void gmod_machine_governor_enable(bool enable)
+{
+	if (governor_enabled == enable) return;
+
+	governor_enabled = enable;
+
+	if (!governor_budget_cent)
+	{
+		uint32_t cores = std::thread::hardware_concurrency();
+		governor_budget_cent = (cores > 1 ? cores - 1 : 1) * 100;
+	}
+
+	governor_last_update = governor_clock::now();
+
+	if (!enable)
+		for (gmod_machine_t* machine : machine_registry_list())
+			gmod_machine_watchdog_apply(machine);
+}
+
+bool gmod_machine_governor_enabled()
+{
+	return governor_enabled;
+}
+
+void gmod_machine_governor_set_budget(uint32_t cent)
+{
+	governor_budget_cent = cent ? cent : 1;
+}
+
+uint32_t gmod_machine_governor_get_budget()
+{
+	return governor_budget_cent;
+}
+
+uint32_t gmod_machine_governor_get_used()
+{
+	return governor_used_cent;
+}
+
+void gmod_machine_governor_set_owner_weight(const char* owner, uint32_t weight)
+{
+	if (!owner) return;
+
+	if (weight == GMOD_DEFAULT_CPU_WEIGHT)
+		governor_owner_weights.erase(owner);
+	else
+		governor_owner_weights[owner] = weight ? weight : 1;
+}
+
+void gmod_machine_governor_update()
+{
+	if (!governor_enabled) return;
+
+	governor_clock::time_point now = governor_clock::now();
+
+	double elapsed = std::chrono::duration<double>(now - governor_last_update).count();
+
+	if (elapsed * 1000.0 < GMOD_GOVERNOR_INTERVAL_MS) return;
+
+	governor_last_update = now;
+
+	std::vector<gmod_machine_t*> listed = machine_registry_list();
+
+	std::vector<governor_share_t> shares;
+	shares.reserve(listed.size());
+
+	governor_used_cent = 0;
+
+	for (gmod_machine_t* machine : listed)
+	{
+		if (!machine->started) continue;
+
+		double cap = (double)machine->max_cpu_cent * machine->harts;
+		double usage;
+
+		if (machine->watchdog_cent && cap > machine->watchdog_cent)
+			cap = machine->watchdog_cent;
+
+		uint64_t cpu_ns;
+
+		if (gmod_machine_get_cpu_ns(machine, &cpu_ns))
+		{
+			usage = (double)(cpu_ns - machine->last_cpu_ns) / (elapsed * 1e9) * 100.0;
+			machine->last_cpu_ns = cpu_ns;
+		}
+		else
+		{
+			// Hart threads that couldn't be told apart from others, charge them their current share
+			usage = machine->share_cent ? machine->share_cent : cap;
+		}
+
+		machine->usage_cent = (uint32_t)usage;
+		governor_used_cent += machine->usage_cent;
+
+		// Machines using most of their share may want more, the rest get what they use plus headroom
+		double demand = cap;
+		if (machine->share_cent && usage < machine->share_cent * 0.9)
+			demand = usage * 1.25 + 5.0;
+		if (demand > cap)
+			demand = cap;
+
+		shares.push_back({ machine, (double)machine->cpu_weight, demand, 0.0 });
+	}
+
+	// Split the budget between owners first, then between the machines of each owner
+	std::map<std::string, std::vector<governor_share_t*>> by_owner;
+	for (auto& share : shares)
+		by_owner[share.machine->owner].push_back(&share);
+
+	std::vector<governor_share_t> owner_shares;
+	owner_shares.reserve(by_owner.size());
+
+	for (auto& [owner, owned] : by_owner)
+	{
+		auto weight = governor_owner_weights.find(owner);
+
+		governor_share_t owner_share = {};
+		owner_share.weight = weight != governor_owner_weights.end() ? weight->second : GMOD_DEFAULT_CPU_WEIGHT;
+
+		for (auto share : owned)
+			owner_share.demand += share->demand;
+
+		owner_shares.push_back(owner_share);
+	}
+
+	std::vector<governor_share_t*> owner_ptrs;
+	for (auto& owner_share : owner_shares)
+		owner_ptrs.push_back(&owner_share);
+
+	governor_fair_share(owner_ptrs, governor_budget_cent);
+
+	size_t index = 0;
+	for (auto& [owner, owned] : by_owner)
+		governor_fair_share(owned, owner_shares[index++].share);
+
+	for (auto& share : shares)
+		governor_apply(share.machine, share.share < 1.0 ? 1 : (uint32_t)share.share);
+}
+
+bool gmod_machine_set_owner(gmod_machine_t* machine, const char* owner)
+{
+	if (!machine) return false;
+
+	machine->owner = owner ? owner : "";
+
+	return true;
+}
+
+const char* gmod_machine_get_owner(gmod_machine_t* machine)
+{
+	if (!machine) return "";
+
+	return machine->owner.c_str();
+}
+
+bool gmod_machine_get_cpu_time(gmod_machine_t* machine, uint64_t* out_ns)
+{
+	if (!machine || !out_ns) return false;
+
+	return gmod_machine_get_cpu_ns(machine, out_ns);
+}
+
+bool gmod_machine_get_cpu_usage(gmod_machine_t* machine, uint32_t* out_usage_cent, uint32_t* out_share_cent)
+{
+	if (!machine) return false;
+
+	if (out_usage_cent) *out_usage_cent = machine->usage_cent;
+	if (out_share_cent) *out_share_cent = machine->share_cent;
+
+	return true;
+}
+
+bool gmod_machine_set_affinity(gmod_machine_t* machine, uint64_t core_mask)
+{
+	if (!machine) return false;
+
+	if (machine->exec_mode == GMOD_EXEC_THREADED)
+	{
+		// Hart threads that couldn't be picked out when started can't be pinned
+		if (machine->started && !hart_threads_set_affinity(machine->hart_threads, core_mask)) return false;
+
+		machine->affinity = core_mask;
+
+		return true;
+	}
+
+	// The harts would only ever be queued up on workers that can't take them
+	uint64_t worker_cores = machine_scheduler_get_worker_cores();
+	if (core_mask && worker_cores && !(core_mask & worker_cores)) return false;
+
+	machine->affinity = core_mask;
+
+	if (machine->started)
+		machine_scheduler_set_affinity(machine, core_mask);
+
+	return true;
+}
+
+uint64_t gmod_machine_get_affinity(gmod_machine_t* machine)
+{
+	if (!machine) return 0;
+
+	return machine->affinity;
+}
+
+uint64_t gmod_machine_get_numa_node_cores(int node)
+{
+	ULONGLONG mask = 0;
+
+	if (node < 0 || node > 255 || !GetNumaNodeProcessorMask((UCHAR)node, &mask))
+		return 0;
+
+	return mask;
+}
+
+int gmod_machine_get_numa_node_count()
+{
+	ULONG highest = 0;
+
+	if (!GetNumaHighestNodeNumber(&highest))
+		return 1;
+
+	return (int)highest + 1;
+}
+
+bool gmod_machine_set_numa_node(gmod_machine_t* machine, int node)
+{
+	if (!machine || machine->started) return false;
+
+	if (machine->hibernated && (machine->hibernated_running || !gmod_machine_thaw(machine))) return false;
+
+	uint64_t cores = gmod_machine_get_numa_node_cores(node);
+
+	if (!cores || !gmod_machine_set_affinity(machine, cores)) return false;
+
+	machine->numa_node = node;
+
+	rvvm_addr_t mem_base = rvvm_get_opt(machine->machine, RVVM_OPT_MEM_BASE);
+	size_t mem_size = (size_t)rvvm_get_opt(machine->machine, RVVM_OPT_MEM_SIZE);
+
+	uint8_t* mem = (uint8_t*)rvvm_get_dma_ptr(machine->machine, mem_base, mem_size);
+
+	if (!mem) return true;
+
+	// Writing would unmerge merged blocks
+	if (machine->merge_region) return true;
+
+	// Windows places a page on the node of the thread that first touches it, so fault the guest
+	// RAM in from that node. Pages that are already resident stay where they are.
+	std::thread toucher([mem, mem_size, cores]()
+		{
+			SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)cores);
+
+			for (size_t offset = 0; offset < mem_size; offset += 4096)
+			{
+				volatile uint8_t* page = mem + offset;
+				*page = *page;
+			}
+		});
+
+	toucher.join();
+
+	return true;
+}
+
+int gmod_machine_get_numa_node(gmod_machine_t* machine)
+{
+	if (!machine) return -1;
+
+	return machine->numa_node;
+}
+
+bool gmod_machine_set_page_merge(gmod_machine_t* machine, bool enable)
+{
+	if (!machine) return false;
+
+	if (enable == (machine->merge_region != nullptr)) return true;
+
+	if (machine->hibernated && !gmod_machine_resume(machine)) return false;
+
+	// Reclaim decommits pages of the same RAM
+	if (enable && machine->reclaim) return false;
+
+	// Drives can't read into merged blocks
+	if (enable && gmod_machine_has_nvme(machine)) return false;
+
+	rvvm_addr_t mem_base = rvvm_get_opt(machine->machine, RVVM_OPT_MEM_BASE);
+	size_t mem_size = (size_t)rvvm_get_opt(machine->machine, RVVM_OPT_MEM_SIZE);
+
+	uint8_t* mem = (uint8_t*)rvvm_get_dma_ptr(machine->machine, mem_base, mem_size);
+	if (!mem) return false;
+
+	bool was_started = machine->started;
+
+	if (was_started && !gmod_machine_pause(machine)) return false;
+
+	if (enable)
+		machine->merge_region = page_merge_add(mem, mem_size);
+	else
+	{
+		page_merge_remove(machine->merge_region, true);
+		machine->merge_region = nullptr;
+	}
+
+	if (was_started)
+		gmod_machine_start(machine);
+
+	return enable == (machine->merge_region != nullptr);
+}
+
+void gmod_machine_merge_set_scan_rate(uint32_t mb_per_sec)
+{
+	page_merge_set_scan_rate(mb_per_sec);
+}
+
+void gmod_machine_get_merge_stats(gmod_merge_stats_t* out_stats)
+{
+	if (!out_stats) return;
+
+	page_merge_stats_t stats = page_merge_get_stats();
+
+	out_stats->machines = stats.regions;
+	out_stats->shared_blocks = stats.shared_blocks;
+	out_stats->merged_blocks = stats.merged_blocks;
+	out_stats->merges = stats.merges;
+	out_stats->unmerges = stats.unmerges;
+	out_stats->scans = stats.scans;
+	out_stats->saved_bytes = stats.shared_blocks > stats.merged_blocks ? (stats.shared_blocks - stats.merged_blocks) * PAGE_MERGE_BLOCK_SIZE : 0;
+}
+
+/*
+ * Memory reclaim
+ */
+
+static std::chrono::steady_clock::time_point reclaim_last_update;
+
+bool gmod_machine_set_ram_reclaim(gmod_machine_t* machine, bool enable)
+{
+	if (!machine) return false;
+
+	if (enable == machine->reclaim) return true;
+
+	if (!enable)
+	{
+		ram_reclaim_remove(machine->reclaim_region);
+		machine->reclaim_region = nullptr;
+		machine->reclaim = false;
+		return true;
+	}
+
+	// Merged blocks can't be decommitted page by page
+	if (machine->merge_region) return false;
+
+	// Drives and the NIC write guest RAM from their own threads, also while the machine is paused
+	// for a release, so a page could be decommitted right after it was found zeroed
+	if (gmod_machine_has_nvme(machine) || machine->nic) return false;
+
+	if (machine->hibernated && !gmod_machine_resume(machine)) return false;
+
+	rvvm_addr_t mem_base = rvvm_get_opt(machine->machine, RVVM_OPT_MEM_BASE);
+	size_t mem_size = (size_t)rvvm_get_opt(machine->machine, RVVM_OPT_MEM_SIZE);
+
+	uint8_t* mem = (uint8_t*)rvvm_get_dma_ptr(machine->machine, mem_base, mem_size);
+	if (!mem) return false;
+
+	// Only read from the scanner, so the machine can keep running
+	machine->reclaim_region = ram_reclaim_add(mem, mem_size);
+	machine->reclaim = machine->reclaim_region != nullptr;
+	machine->reclaim_pause_us = 0;
+
+	return machine->reclaim;
+}
+
+void gmod_machine_reclaim_set_scan_rate(uint32_t mb_per_sec)
+{
+	ram_reclaim_set_scan_rate(mb_per_sec);
+}
+
+bool gmod_machine_get_reclaim_stats(gmod_machine_t* machine, gmod_reclaim_stats_t* out_stats)
+{
+	if (!machine || !machine->reclaim || !out_stats) return false;
+
+	ram_reclaim_stats_t stats = {};
+	ram_reclaim_get_stats(machine->reclaim_region, &stats);
+
+	out_stats->resident_bytes = stats.resident_pages * RAM_RECLAIM_PAGE_SIZE;
+	out_stats->zero_bytes = stats.zero_pages * RAM_RECLAIM_PAGE_SIZE;
+	out_stats->released_bytes = stats.released_pages * RAM_RECLAIM_PAGE_SIZE;
+	out_stats->scans = stats.scans;
+	out_stats->last_pause_us = machine->reclaim_pause_us;
+
+	return true;
+}
+
+void gmod_machine_reclaim_update()
+{
+	auto now = std::chrono::steady_clock::now();
+
+	if (now - reclaim_last_update < std::chrono::milliseconds(GMOD_RECLAIM_INTERVAL_MS)) return;
+
+	reclaim_last_update = now;
+
+	// The machine with the most zeroed pages, one per call so that the pauses stay short
+	gmod_machine_t* target = nullptr;
+	uint64_t target_pages = GMOD_RECLAIM_MIN_PAGES - 1;
+
+	for (gmod_machine_t* machine : machine_registry_list())
+	{
+		if (!machine->reclaim_region) continue;
+
+		ram_reclaim_stats_t stats;
+		ram_reclaim_get_stats(machine->reclaim_region, &stats);
+
+		if (stats.zero_pages > target_pages)
+		{
+			target = machine;
+			target_pages = stats.zero_pages;
+		}
+	}
+
+	if (!target) return;
+
+	bool was_started = target->started;
+
+	if (was_started && !gmod_machine_pause(target)) return;
+
+	ram_reclaim_release(target->reclaim_region, GMOD_RECLAIM_MAX_PAGES);
+
+	if (was_started)
+		gmod_machine_start(target);
+
+	target->reclaim_pause_us = (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - now).count();
+}
+
+/*
+ * Hibernation
+ */
+
+typedef std::chrono::steady_clock hibernate_clock;
+
+static std::string hibernate_dir = GMOD_DEFAULT_HIBERNATE_DIR;
+static uint32_t hibernate_idle_s = 0;
+static hibernate_clock::time_point hibernate_last_scan;
+static gmod_hibernation_stats_t hibernate_stats = {};
+
+static std::string gmod_machine_hibernate_path(gmod_machine_t* machine)
+{
+	return hibernate_dir + "/machine_" + std::to_string(machine->id) + ".hib";
+}
+
+static uint8_t* gmod_machine_get_ram(gmod_machine_t* machine, size_t* out_size)
+{
+	rvvm_addr_t mem_base = rvvm_get_opt(machine->machine, RVVM_OPT_MEM_BASE);
+	*out_size = (size_t)rvvm_get_opt(machine->machine, RVVM_OPT_MEM_SIZE);
+
+	return (uint8_t*)rvvm_get_dma_ptr(machine->machine, mem_base, *out_size);
+}
+
+// Loads the state back into the paused machine, it's left paused
+static bool gmod_machine_thaw(gmod_machine_t* machine)
+{
+	auto begin = hibernate_clock::now();
+
+	// The timer kept going while the machine was away, like it does while paused
+	uint64_t time = rvvm_machine_get_time(machine->machine);
+
+	std::string path = gmod_machine_hibernate_path(machine);
+
+	if (!machine_snapshot_load(machine->machine, path.c_str()))
+	{
+		hibernate_stats.failures++;
+		return false;
+	}
+
+	rvvm_machine_set_time(machine->machine, time);
+
+	if (machine->reclaim)
+	{
+		size_t mem_size;
+		uint8_t* mem = gmod_machine_get_ram(machine, &mem_size);
+
+		machine->reclaim_region = ram_reclaim_add(mem, mem_size);
+	}
+
+	std::error_code error;
+	std::filesystem::remove(path, error);
+
+	machine->hibernated = false;
+	machine->wake_requested = false;
+	machine->active_ns = hibernate_clock::now().time_since_epoch().count();
+
+	gmod_machine_account_memory(machine);
+
+	hibernate_stats.hibernated--;
+	hibernate_stats.resumes++;
+	hibernate_stats.last_resume_ms = (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(hibernate_clock::now() - begin).count();
+
+	return true;
+}
+
+static void gmod_machine_drop_hibernation(gmod_machine_t* machine)
+{
+	if (!machine->hibernated) return;
+
+	std::error_code error;
+	std::filesystem::remove(gmod_machine_hibernate_path(machine), error);
+
+	machine->hibernated = false;
+	hibernate_stats.hibernated--;
+}
+
+void gmod_machine_hibernation_set(const char* dir, uint32_t idle_s)
+{
+	// Hibernated machines are found by their path, keep them where they are
+	if (dir && *dir && hibernate_stats.hibernated == 0)
+		hibernate_dir = dir;
+
+	hibernate_idle_s = idle_s;
+}
+
+bool gmod_machine_hibernate(gmod_machine_t* machine)
+{
+	if (!machine) return false;
+	if (machine->hibernated) return true;
+
+	// Found by its id when brought back, and merged RAM can't just be released
+	if (get_machine(machine->id) != machine) return false;
+	if (machine->merge_region) return false;
+
+	if (!rvvm_machine_powered(machine->machine)) return false;
+
+	size_t mem_size;
+	uint8_t* mem = gmod_machine_get_ram(machine, &mem_size);
+	if (!mem) return false;
+
+	std::error_code error;
+	std::filesystem::create_directories(hibernate_dir, error);
+
+	bool was_started = machine->started;
+
+	if (was_started && !gmod_machine_pause(machine)) return false;
+
+	std::string path = gmod_machine_hibernate_path(machine);
+
+	if (!machine_snapshot_save(machine->machine, path.c_str()))
+	{
+		hibernate_stats.failures++;
+
+		if (was_started)
+			gmod_machine_start(machine);
+
+		return false;
+	}
+
+	// Scanning RAM that's being decommitted would fault
+	ram_reclaim_remove(machine->reclaim_region);
+	machine->reclaim_region = nullptr;
+
+	machine_snapshot_release_ram(mem, mem_size);
+
+	machine->hibernated = true;
+	machine->hibernated_running = was_started;
+	machine->wake_requested = false;
+
+	gmod_machine_account_memory(machine);
+
+	hibernate_stats.hibernated++;
+	hibernate_stats.hibernations++;
+
 	return true;
 }
 
+bool gmod_machine_resume(gmod_machine_t* machine)
+{
+	if (!machine) return false;
+	if (!machine->hibernated) return true;
+
+	bool was_running = machine->hibernated_running;
+
+	if (!gmod_machine_thaw(machine)) return false;
+
+	return !was_running || gmod_machine_start(machine);
+}
+
+bool gmod_machine_is_hibernated(gmod_machine_t* machine)
+{
+	if (!machine) return false;
+
+	return machine->hibernated;
+}
+
+void gmod_machine_get_hibernation_stats(gmod_hibernation_stats_t* out_stats)
+{
+	if (out_stats)
+		*out_stats = hibernate_stats;
+}
+
+void gmod_machine_mark_active(gmod_machine_t* machine)
+{
+	if (!machine) return;
+
+	machine->active_ns = hibernate_clock::now().time_since_epoch().count();
+
+	// Brought back from the Lua thread, this may be called from others
+	if (machine->hibernated)
+		machine->wake_requested = true;
+}
+
+gmod_machine_t* gmod_machine_from_rvvm(rvvm_machine_t* machine)
+{
+	return machine_registry_find_rvvm(machine);
+}
+
+static bool gmod_machine_can_hibernate(gmod_machine_t* machine)
+{
+	// A NIC whose traffic can't be seen never looks idle
+	if (machine->networked) return false;
+
+	// Neither do hart threads that couldn't be picked out
+	uint64_t cpu_ns;
+	if (machine->started && !gmod_machine_get_cpu_ns(machine, &cpu_ns)) return false;
+
+	return !machine->merge_region;
+}
+
+void gmod_machine_hibernation_update()
+{
+	for (gmod_machine_t* machine : machine_registry_list())
+		if (machine->hibernated && machine->wake_requested.exchange(false))
+			gmod_machine_resume(machine);
+
+	if (!hibernate_idle_s) return;
+
+	hibernate_clock::time_point now = hibernate_clock::now();
+
+	double elapsed = std::chrono::duration<double>(now - hibernate_last_scan).count();
+
+	if (elapsed * 1000.0 < GMOD_HIBERNATE_INTERVAL_MS) return;
+
+	hibernate_last_scan = now;
+
+	int64_t idle_since = (now - std::chrono::seconds(hibernate_idle_s)).time_since_epoch().count();
+
+	// One machine per call, a save stalls the tick for as long as it takes to write the RAM
+	bool saved = false;
+
+	for (gmod_machine_t* machine : machine_registry_list())
+	{
+		if (machine->hibernated) continue;
+
+		uint64_t cpu_ns;
+
+		if (machine->started && gmod_machine_get_cpu_ns(machine, &cpu_ns))
+		{
+			// Harts waiting for interrupts don't take any host time
+			double usage = (double)(cpu_ns - machine->idle_cpu_ns) / (elapsed * 1e9) * 100.0;
+			machine->idle_cpu_ns = cpu_ns;
+
+			if (usage >= GMOD_HIBERNATE_IDLE_CENT)
+				machine->active_ns = now.time_since_epoch().count();
+		}
+
+		if (saved || machine->active_ns.load() > idle_since || !gmod_machine_can_hibernate(machine)) continue;
+
+		saved = gmod_machine_hibernate(machine);
+	}
+}
+
+/*
+ * Runaway watchdog
+ */
+
+static std::deque<gmod_watchdog_event_t> watchdog_events;
+
+void gmod_machine_watchdog_enable(bool enable)
+{
+	if (enable)
+	{
+		machine_watchdog_start();
+		return;
+	}
+
+	machine_watchdog_stop();
+
+	// Nobody is watching anymore, so nothing would ever give the share back
+	for (gmod_machine_t* machine : machine_registry_list())
+	{
+		if (!machine->watchdog_cent) continue;
+
+		machine->watchdog_cent = 0;
+		gmod_machine_watchdog_apply(machine);
+	}
+}
+
+bool gmod_machine_watchdog_enabled()
+{
+	return machine_watchdog_running();
+}
+
+static void gmod_machine_watchdog_act(gmod_machine_t* machine, const machine_watchdog_report_t& report)
+{
+	gmod_watchdog_event_t event = {};
+
+	event.id = machine->id;
+	event.hart = report.hart_id;
+	event.pc = report.pc;
+	event.busy_cent = report.busy_cent;
+
+	std::string symbol;
+	if (report.strikes && machine_symbols_lookup(machine->symbols, report.pc, symbol))
+		snprintf(event.symbol, sizeof(event.symbol), "%s", symbol.c_str());
+
+	if (!report.strikes)
+	{
+		event.action = GMOD_WATCHDOG_RELEASE;
+		machine->watchdog_cent = 0;
+		gmod_machine_watchdog_apply(machine);
+	}
+	else if (report.strikes == 1)
+	{
+		// Could be a busy wait that ends on its own
+		event.action = GMOD_WATCHDOG_WARN;
+	}
+	else
+	{
+		uint32_t cent = GMOD_WATCHDOG_BASE_CENT >> (report.strikes - 1 < 31 ? report.strikes - 1 : 31);
+
+		if (cent < GMOD_WATCHDOG_MIN_CENT)
+		{
+			event.action = GMOD_WATCHDOG_PAUSE;
+
+			gmod_machine_pause(machine);
+
+			// Starts over once someone starts it again
+			machine->watchdog_cent = 0;
+			gmod_machine_watchdog_apply(machine);
+		}
+		else
+		{
+			event.action = GMOD_WATCHDOG_THROTTLE;
+
+			machine->watchdog_cent = cent;
+			gmod_machine_watchdog_apply(machine);
+		}
+	}
+
+	event.cpu_cent = machine->watchdog_cent;
+
+	watchdog_events.push_back(event);
+}
+
+uint32_t gmod_machine_watchdog_update(gmod_watchdog_event_t* out_events, uint32_t max)
+{
+	std::vector<machine_watchdog_report_t> reports = machine_watchdog_poll();
+
+	// Reports may be about machines that were freed since, even if the id was reused
+	for (const machine_watchdog_report_t& report : reports)
+	{
+		gmod_machine_t* machine = gmod_machine_from_handle(report.handle);
+
+		if (machine && machine->started)
+			gmod_machine_watchdog_act(machine, report);
+	}
+
+	uint32_t count = 0;
+
+	while (count < max && !watchdog_events.empty())
+	{
+		out_events[count++] = watchdog_events.front();
+		watchdog_events.pop_front();
+	}
+
+	return count;
+}
+
+/*
+ * Memory budget
+ */
+
+void gmod_machine_memory_set_limit(uint64_t limit_bytes, int policy)
+{
+	memory_limit = limit_bytes;
+	memory_policy = policy == GMOD_ADMIT_DOWNSIZE ? GMOD_ADMIT_DOWNSIZE : GMOD_ADMIT_REJECT;
+}
+
+void gmod_machine_get_memory_stats(gmod_memory_stats_t* out_stats)
+{
+	if (!out_stats) return;
+
+	*out_stats = memory_stats;
+	out_stats->limit_bytes = memory_limit;
+	out_stats->committed_bytes = memory_committed;
+	out_stats->machines = memory_machines;
+	out_stats->rejected = memory_rejected;
+}
+
+uint64_t gmod_machine_memory_shortfall(uint64_t ram_size, uint32_t harts)
+{
+	uint64_t limit = memory_limit;
+
+	if (!limit) return 0;
+
+	// The JIT cache size is only known once RVVM made the machine
+	uint64_t needed = memory_committed + ram_size + harts * GMOD_MEMORY_JIT_ESTIMATE + GMOD_MEMORY_MACHINE_OVERHEAD;
+
+	return needed > limit ? needed - limit : 0;
+}
+
+uint64_t gmod_machine_get_memory(gmod_machine_t* machine)
+{
+	if (!machine) return 0;
+
+	return machine->memory_bytes;
+}
+
+// Hibernates background machines, the ones idle the longest first, until a machine of that shape
+// fits. Returns what's still missing.
+static uint64_t gmod_machine_memory_make_room(uint64_t ram_size, uint32_t harts)
+{
+	uint64_t shortfall = gmod_machine_memory_shortfall(ram_size, harts);
+
+	if (!shortfall) return 0;
+
+	std::vector<gmod_machine_t*> candidates;
+
+	for (gmod_machine_t* machine : machine_registry_list())
+		if (!machine->hibernated && machine->priority == GMOD_PRIORITY_BACKGROUND && gmod_machine_can_hibernate(machine))
+			candidates.push_back(machine);
+
+	std::sort(candidates.begin(), candidates.end(), [](gmod_machine_t* a, gmod_machine_t* b) {
+		return a->active_ns.load() < b->active_ns.load();
+	});
+
+	for (gmod_machine_t* machine : candidates)
+	{
+		if (!gmod_machine_hibernate(machine)) continue;
+
+		memory_stats.hibernated++;
+
+		shortfall = gmod_machine_memory_shortfall(ram_size, harts);
+
+		if (!shortfall) break;
+	}
+
+	return shortfall;
+}
+
+void gmod_machine_image_cache_set_max(uint32_t mb)
+{
+	image_cache_set_max_size((uint64_t)mb * 1024 * 1024);
+}
+
+void gmod_machine_get_image_cache_stats(gmod_image_cache_stats_t* out_stats)
+{
+	if (!out_stats) return;
+
+	image_cache_stats_t stats = image_cache_get_stats();
+
+	out_stats->images = stats.images;
+	out_stats->bytes = stats.bytes;
+	out_stats->hits = stats.hits;
+	out_stats->misses = stats.misses;
+	out_stats->reloads = stats.reloads;
+}
+
+void gmod_machine_notify(gmod_machine_t* machine)
+{
+	if (!machine) return;
+
+	gmod_machine_mark_active(machine);
+
+	if (machine->exec_mode != GMOD_EXEC_THREADED)
+		machine_scheduler_wake(machine);
+
+	event_loop_kick();
+}
+
+static int gmod_machine_powered_count(bool threaded_only)
+{
+	std::lock_guard<std::mutex> lock(started_mutex);
+
+	int count = 0;
+
+	for (const gmod_started_t& entry : started_machines)
+		if ((entry.threaded || !threaded_only) && rvvm_machine_powered(entry.machine))
+			count++;
+
+	return count;
+}
+
+int gmod_machine_running_count()
+{
+	return gmod_machine_powered_count(false);
+}
+
+int gmod_machine_event_count()
+{
+	return gmod_machine_powered_count(true);
+}
+
+void gmod_machine_power_update()
+{
+	for (gmod_machine_t* machine : machine_registry_list())
+	{
+		if (!machine->started || rvvm_machine_powered(machine->machine)) continue;
+
+		// RVVM stopped the harts of a threaded machine itself, pausing it again may fail
+		if (machine->exec_mode != GMOD_EXEC_THREADED)
+			machine_scheduler_remove(machine);
+
+		rvvm_pause_machine(machine->machine);
+
+		hart_threads_free(machine->hart_threads);
+		machine->hart_threads = nullptr;
+
+		gmod_machine_set_started(machine, false);
+	}
+}
+
 void gmod_machine_shutdown_all()
 {
-	for (auto& [id, machine] : machines)
+	machine_watchdog_stop();
+	watchdog_events.clear();
+
+	// Unlisted before any of them is freed, devices of the others may still look them up
+	std::vector<gmod_machine_t*> listed = machine_registry_list();
+
+	for (gmod_machine_t* machine : listed)
+	{
+		gmod_machine_drop_hibernation(machine);
+
+		machine_scheduler_remove(machine);
+		gmod_machine_set_started(machine, false);
+
+		machine->handle = 0;
+	}
+
+	machine_registry_clear();
+	machine_registry_synchronize();
+
+	for (gmod_machine_t* machine : listed)
+		gmod_machine_release(machine);
+
 	{
-		rvvm_free_machine(machine->machine);
-		delete machine;
+		std::lock_guard<std::mutex> lock(started_mutex);
+		started_machines.clear();
 	}
 
-	machines.clear();
+	memory_committed = 0;
+	memory_machines = 0;
+
+	hibernate_stats.hibernated = 0;
+
+	page_merge_shutdown();
+	ram_reclaim_shutdown();
+	image_cache_clear();
 }
@@ -0,0 +1,189 @@
+#include "hart_threads.h"
+
+#include "rvvm_machine_prefix.h"
+
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+
+#include <Windows.h>
+#include <TlHelp32.h>
+
+typedef struct hart_threads_t
+{
+	std::vector<HANDLE> handles;
+	gmod_machine_t* owner; // set while watched
+} hart_threads_t;
+
+static std::mutex hart_threads_mutex;
+
+static std::mutex hart_threads_watch_mutex; // guards hart_threads_watched
+static std::vector<hart_threads_t*> hart_threads_watched;
+
+// Ids of the threads of this process, sorted
+static bool hart_threads_list(std::vector<DWORD>& out_ids)
+{
+	HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+
+	if (snapshot == INVALID_HANDLE_VALUE) return false;
+
+	DWORD process = GetCurrentProcessId();
+
+	THREADENTRY32 entry = {};
+	entry.dwSize = sizeof(entry);
+
+	for (BOOL more = Thread32First(snapshot, &entry); more; more = Thread32Next(snapshot, &entry))
+	{
+		if (entry.th32OwnerProcessID == process)
+			out_ids.push_back(entry.th32ThreadID);
+	}
+
+	CloseHandle(snapshot);
+
+	std::sort(out_ids.begin(), out_ids.end());
+
+	return true;
+}
+
+bool hart_threads_start(const std::function<bool()>& start, uint32_t count, hart_threads_t** out_threads)
+{
+	*out_threads = nullptr;
+
+	std::lock_guard<std::mutex> lock(hart_threads_mutex);
+
+	std::vector<DWORD> before, after;
+	bool listed = hart_threads_list(before);
+
+	if (!start()) return false;
+
+	if (!listed || !hart_threads_list(after)) return true;
+
+	std::vector<DWORD> started;
+	std::set_difference(after.begin(), after.end(), before.begin(), before.end(), std::back_inserter(started));
+
+	if (started.size() != count) return true;
+
+	hart_threads_t* threads = new hart_threads_t();
+	threads->owner = nullptr;
+
+	for (DWORD id : started)
+	{
+		HANDLE handle = OpenThread(THREAD_SET_INFORMATION | THREAD_QUERY_LIMITED_INFORMATION, FALSE, id);
+
+		if (!handle)
+		{
+			hart_threads_free(threads);
+			return true;
+		}
+
+		threads->handles.push_back(handle);
+	}
+
+	*out_threads = threads;
+
+	return true;
+}
+
+static uint64_t hart_threads_thread_ns(HANDLE handle)
+{
+	FILETIME created, exited, kernel, user;
+
+	if (!GetThreadTimes(handle, &created, &exited, &kernel, &user)) return 0;
+
+	// 100 ns units
+	return (((uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) + ((uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime)) * 100;
+}
+
+uint64_t hart_threads_cpu_ns(hart_threads_t* threads)
+{
+	if (!threads) return 0;
+
+	uint64_t total = 0;
+
+	for (HANDLE handle : threads->handles)
+		total += hart_threads_thread_ns(handle);
+
+	return total;
+}
+
+bool hart_threads_set_affinity(hart_threads_t* threads, uint64_t core_mask)
+{
+	if (!threads) return false;
+
+	DWORD_PTR mask = (DWORD_PTR)core_mask;
+
+	if (!mask)
+	{
+		DWORD_PTR system_mask = 0;
+
+		if (!GetProcessAffinityMask(GetCurrentProcess(), &mask, &system_mask)) return false;
+	}
+
+	bool pinned = true;
+
+	for (HANDLE handle : threads->handles)
+	{
+		if (!SetThreadAffinityMask(handle, mask))
+			pinned = false;
+	}
+
+	return pinned;
+}
+
+void hart_threads_watch(hart_threads_t* threads, gmod_machine_t* owner)
+{
+	if (!threads || !owner) return;
+
+	std::lock_guard<std::mutex> lock(hart_threads_watch_mutex);
+
+	if (!threads->owner)
+		hart_threads_watched.push_back(threads);
+
+	threads->owner = owner;
+}
+
+void hart_threads_sample(std::vector<hart_threads_sample_t>& out)
+{
+	std::lock_guard<std::mutex> lock(hart_threads_watch_mutex);
+
+	for (hart_threads_t* threads : hart_threads_watched)
+	{
+		// Allocated while watched, the registers are read racily like the pool's last PCs
+		rvvm_machine_t* machine = gmod_machine_get_rvvm_machine(threads->owner);
+
+		hart_threads_sample_t sample;
+		sample.handle = gmod_machine_get_handle(threads->owner);
+
+		size_t harts = (size_t)rvvm_get_opt(machine, RVVM_OPT_HART_COUNT);
+
+		for (size_t i = 0; i < harts; i++)
+		{
+			rvvm_hart_t* hart = rvvm_machine_get_hart(machine, i);
+			if (!hart) break;
+
+			sample.pcs.push_back(rvvm_read_cpu_reg(hart, RVVM_REGID_PC));
+		}
+
+		for (HANDLE handle : threads->handles)
+			sample.thread_ns.push_back(hart_threads_thread_ns(handle));
+
+		out.push_back(std::move(sample));
+	}
+}
+
+void hart_threads_free(hart_threads_t* threads)
+{
+	if (!threads) return;
+
+	if (threads->owner)
+	{
+		std::lock_guard<std::mutex> lock(hart_threads_watch_mutex);
+		hart_threads_watched.erase(std::remove(hart_threads_watched.begin(), hart_threads_watched.end(), threads), hart_threads_watched.end());
+	}
+
+	for (HANDLE handle : threads->handles)
+		CloseHandle(handle);
+
+	delete threads;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <gmod_machine.h>
+
+#include <stdint.h>
+
+#include <vector>
+#include <functional>
+
+typedef struct hart_threads_t hart_threads_t;
+
+// Runs start and picks up the threads of the process it started. RVVM doesn't hand out its hart
+// threads, they are told apart by comparing the threads before and after, so starts are
+// serialized. out_threads is left null unless exactly count new threads showed up, e.g. when
+// another thread started one at the same time. Returns what start returned.
+bool hart_threads_start(const std::function<bool()>& start, uint32_t count, hart_threads_t** out_threads);
+
+// Host CPU time, user and kernel, the threads took since they started. Exited threads still count.
+uint64_t hart_threads_cpu_ns(hart_threads_t* threads);
+
+// Pins every hart thread to these host cores, 0 lets them run on any core of the process
+bool hart_threads_set_affinity(hart_threads_t* threads, uint64_t core_mask);
+
+// Lets hart_threads_sample() see the threads of the owner's harts until they're freed, which has
+// to happen before the owner's RVVM machine is freed
+void hart_threads_watch(hart_threads_t* threads, gmod_machine_t* owner);
+
+typedef struct hart_threads_sample_t
+{
+	gmod_machine_handle_t handle; // 0 if unlisted
+	std::vector<uint64_t> pcs;       // by hart
+	std::vector<uint64_t> thread_ns; // host CPU time by thread, RVVM doesn't tell which thread runs which hart
+} hart_threads_sample_t;
+
+// Samples the harts of every watched machine, for the runaway watchdog
+void hart_threads_sample(std::vector<hart_threads_sample_t>& out);
+
+void hart_threads_free(hart_threads_t* threads);
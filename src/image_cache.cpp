@@ -0,0 +1,262 @@
+#include "image_cache.h"
+
+#include <string.h>
+
+#include <mutex>
+#include <map>
+#include <string>
+
+#include <Windows.h>
+
+#define IMAGE_CACHE_READ_CHUNK (64 * 1024 * 1024) // ReadFile only takes a DWORD
+
+typedef struct image_cache_entry_t
+{
+	std::string path;
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t hash;
+
+	uint8_t* data;
+
+	uint32_t refs;
+	bool stale;        // replaced by a newer version of the file, freed with its last reference
+	uint64_t last_use;
+} image_cache_entry_t;
+
+static std::mutex cache_mutex;
+static std::map<std::string, image_cache_entry_t*> cache_entries;
+static uint64_t cache_bytes = 0; // stale images included
+static uint64_t cache_max_bytes = (uint64_t)IMAGE_CACHE_DEFAULT_MAX_MB * 1024 * 1024;
+static uint64_t cache_use_counter = 0;
+static image_cache_stats_t cache_stats = {};
+
+static bool cache_stat_file(const std::string& path, uint64_t* out_size, uint64_t* out_mtime)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+
+	if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attributes)) return false;
+	if (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) return false;
+
+	*out_size = ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+	*out_mtime = ((uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+
+	return true;
+}
+
+static uint64_t cache_hash(const uint8_t* data, size_t size)
+{
+	uint64_t hash = 0x9E3779B97F4A7C15ULL;
+	size_t i = 0;
+
+	for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001B3ULL + (hash >> 29);
+	}
+
+	for (; i < size; i++)
+		hash = (hash ^ data[i]) * 0x100000001B3ULL + (hash >> 29);
+
+	return hash;
+}
+
+static void cache_free(image_cache_entry_t* entry)
+{
+	cache_bytes -= entry->size;
+	cache_stats.images--;
+
+	VirtualFree(entry->data, 0, MEM_RELEASE);
+	delete entry;
+}
+
+// Copied rather than mapped, a mapped file couldn't be replaced on disk while machines use it
+static image_cache_entry_t* cache_read_file(const std::string& path, uint64_t size, uint64_t mtime)
+{
+	if (!size || size > SIZE_MAX) return nullptr;
+
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+	if (file == INVALID_HANDLE_VALUE) return nullptr;
+
+	uint8_t* data = (uint8_t*)VirtualAlloc(nullptr, (size_t)size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+	bool ok = data != nullptr;
+
+	for (uint64_t offset = 0; ok && offset < size;)
+	{
+		DWORD chunk = (DWORD)(size - offset < IMAGE_CACHE_READ_CHUNK ? size - offset : IMAGE_CACHE_READ_CHUNK);
+		DWORD read = 0;
+
+		ok = ReadFile(file, data + offset, chunk, &read, nullptr) && read == chunk;
+		offset += read;
+	}
+
+	CloseHandle(file);
+
+	if (!ok)
+	{
+		if (data)
+			VirtualFree(data, 0, MEM_RELEASE);
+
+		return nullptr;
+	}
+
+	// Every machine copies from it, a stray write mustn't reach them all
+	DWORD old_protect;
+	VirtualProtect(data, (size_t)size, PAGE_READONLY, &old_protect);
+
+	image_cache_entry_t* entry = new image_cache_entry_t();
+
+	entry->path = path;
+	entry->size = size;
+	entry->mtime = mtime;
+	entry->hash = cache_hash(data, (size_t)size);
+	entry->data = data;
+	entry->refs = 0;
+	entry->stale = false;
+	entry->last_use = 0;
+
+	cache_bytes += size;
+	cache_stats.images++;
+
+	return entry;
+}
+
+// Drops the least recently used images nobody holds until the cache fits again
+static void cache_trim()
+{
+	while (cache_bytes > cache_max_bytes)
+	{
+		auto oldest = cache_entries.end();
+
+		for (auto it = cache_entries.begin(); it != cache_entries.end(); ++it)
+			if (!it->second->refs && (oldest == cache_entries.end() || it->second->last_use < oldest->second->last_use))
+				oldest = it;
+
+		if (oldest == cache_entries.end()) return;
+
+		cache_free(oldest->second);
+		cache_entries.erase(oldest);
+	}
+}
+
+image_cache_entry_t* image_cache_acquire(const char* path)
+{
+	if (!path || !*path) return nullptr;
+
+	char full_path[MAX_PATH];
+	DWORD length = GetFullPathNameA(path, MAX_PATH, full_path, nullptr);
+
+	if (!length || length >= MAX_PATH) return nullptr;
+
+	std::string key = full_path;
+
+	uint64_t size, mtime;
+	if (!cache_stat_file(key, &size, &mtime)) return nullptr;
+
+	// Held while reading, machines loading the same file at once wait for the one read
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	auto it = cache_entries.find(key);
+
+	image_cache_entry_t* entry = it != cache_entries.end() ? it->second : nullptr;
+
+	if (entry && entry->size == size && entry->mtime == mtime)
+		cache_stats.hits++;
+	else
+	{
+		image_cache_entry_t* fresh = cache_read_file(key, size, mtime);
+		if (!fresh) return nullptr;
+
+		cache_stats.misses++;
+
+		if (!entry)
+			cache_entries[key] = fresh;
+		else if (entry->size == fresh->size && entry->hash == fresh->hash)
+		{
+			// Only touched, keep the copy that's already in use
+			entry->mtime = mtime;
+			cache_free(fresh);
+			fresh = entry;
+		}
+		else
+		{
+			cache_stats.reloads++;
+
+			if (entry->refs)
+				entry->stale = true;
+			else
+				cache_free(entry);
+
+			it->second = fresh;
+		}
+
+		entry = fresh;
+	}
+
+	entry->refs++;
+	entry->last_use = ++cache_use_counter;
+
+	cache_trim();
+
+	return entry;
+}
+
+void image_cache_release(image_cache_entry_t* entry)
+{
+	if (!entry) return;
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	if (--entry->refs == 0 && entry->stale)
+		cache_free(entry);
+	else
+		cache_trim();
+}
+
+const uint8_t* image_cache_data(image_cache_entry_t* entry)
+{
+	return entry ? entry->data : nullptr;
+}
+
+size_t image_cache_size(image_cache_entry_t* entry)
+{
+	return entry ? (size_t)entry->size : 0;
+}
+
+void image_cache_set_max_size(uint64_t bytes)
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	cache_max_bytes = bytes;
+	cache_trim();
+}
+
+image_cache_stats_t image_cache_get_stats()
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	image_cache_stats_t stats = cache_stats;
+	stats.bytes = cache_bytes;
+
+	return stats;
+}
+
+void image_cache_clear()
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	for (auto it = cache_entries.begin(); it != cache_entries.end();)
+	{
+		if (it->second->refs)
+		{
+			++it;
+			continue;
+		}
+
+		cache_free(it->second);
+		it = cache_entries.erase(it);
+	}
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define IMAGE_CACHE_DEFAULT_MAX_MB 512 // of images no machine holds on to anymore
+
+typedef struct image_cache_entry_t image_cache_entry_t;
+
+typedef struct image_cache_stats_t
+{
+	uint32_t images;
+	uint64_t bytes;
+	uint64_t hits;
+	uint64_t misses;  // read from disk
+	uint64_t reloads; // files that changed on disk since they were cached
+} image_cache_stats_t;
+
+// Returns the contents of the file, read once and kept in memory shared by everyone loading
+// the same path. It's read again when its size or modification time changed, a copy whose
+// contents turn out the same is kept. Thread safe, every acquire needs a release.
+image_cache_entry_t* image_cache_acquire(const char* path);
+void image_cache_release(image_cache_entry_t* entry);
+
+const uint8_t* image_cache_data(image_cache_entry_t* entry);
+size_t image_cache_size(image_cache_entry_t* entry);
+
+void image_cache_set_max_size(uint64_t bytes);
+image_cache_stats_t image_cache_get_stats();
+
+// Drops every image nobody holds on to
+void image_cache_clear();
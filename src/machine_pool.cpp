@@ -0,0 +1,511 @@
+#include "machine_pool.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <atomic>
+
+typedef std::chrono::steady_clock pool_clock;
+
+#define POOL_POLL_MS 100
+
+// A booting machine counts as settled once its harts use less than this share of one host core
+#define POOL_QUIET_CENT 10
+
+// Guests that never go quiet are handed out anyway after this long
+#define POOL_BOOT_TIMEOUT_MS 120000
+
+typedef struct pool_booting_t
+{
+	gmod_machine_t* machine;
+	pool_clock::time_point started;
+	pool_clock::time_point last_poll;
+	uint64_t last_cpu_ns;
+} pool_booting_t;
+
+typedef struct machine_pool_t
+{
+	std::string name;
+	machine_template_t tmpl;
+	uint32_t size;
+
+	bool removed;
+
+	std::vector<gmod_machine_t*> ready; // booted and paused
+	std::vector<pool_booting_t> booting;
+	uint32_t creating; // being set up by the pool thread outside of the lock
+
+	machine_pool_stats_t stats;
+} machine_pool_t;
+
+static std::mutex pool_mutex; // guards everything below and the pools themselves
+static std::condition_variable pool_cond;
+static std::map<std::string, std::shared_ptr<machine_pool_t>> pools;
+static std::thread pool_thread;
+static bool pool_running = false;
+
+static bool pool_setup_machine(gmod_machine_t* machine, const machine_template_t& tmpl)
+{
+	if (!gmod_machine_set_opt(machine, GMOD_OPT_EXEC_MODE, tmpl.exec_mode)) return false;
+
+	if (tmpl.def_devices && !gmod_machine_load_def_devices(machine)) return false;
+	if (tmpl.keyboard && !gmod_machine_attach_keyboard(machine)) return false;
+	if (tmpl.mouse && !gmod_machine_attach_mouse(machine)) return false;
+
+	if (!tmpl.bootrom.empty() && !gmod_machine_load_bootrom(machine, tmpl.bootrom.c_str())) return false;
+	if (!tmpl.kernel.empty() && !gmod_machine_load_kernel(machine, tmpl.kernel.c_str())) return false;
+	if (!tmpl.dtb.empty() && !gmod_machine_load_dtb(machine, tmpl.dtb.c_str())) return false;
+
+	if (!tmpl.cmdline.empty() && !gmod_machine_set_cmdline(machine, tmpl.cmdline.c_str())) return false;
+
+	for (const std::string& path : tmpl.nvme)
+		if (!gmod_machine_attach_nvme(machine, path.c_str(), false)) return false;
+
+	return true;
+}
+
+static gmod_machine_t* pool_create_machine(const machine_template_t& tmpl)
+{
+	gmod_machine_t* machine = gmod_machine_create_unlisted(tmpl.ram_size, tmpl.harts, tmpl.is_64bit);
+
+	if (!machine) return nullptr;
+
+	if (!pool_setup_machine(machine, tmpl))
+	{
+		gmod_machine_destroy(machine);
+		return nullptr;
+	}
+
+	return machine;
+}
+
+static uint32_t pool_count(machine_pool_t* pool)
+{
+	return (uint32_t)(pool->ready.size() + pool->booting.size()) + pool->creating;
+}
+
+// Takes every machine out of the pool, they have to be destroyed outside of the lock
+static void pool_drain(machine_pool_t* pool, std::vector<gmod_machine_t*>& out_machines)
+{
+	for (gmod_machine_t* machine : pool->ready)
+		out_machines.push_back(machine);
+
+	for (pool_booting_t& booting : pool->booting)
+		out_machines.push_back(booting.machine);
+
+	pool->ready.clear();
+	pool->booting.clear();
+}
+
+static void pool_destroy_machines(const std::vector<gmod_machine_t*>& machines)
+{
+	for (gmod_machine_t* machine : machines)
+		gmod_machine_destroy(machine);
+}
+
+static bool pool_is_settled(machine_pool_t* pool, pool_booting_t& booting, pool_clock::time_point now)
+{
+	int64_t booted_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - booting.started).count();
+
+	if (booted_ms < pool->tmpl.boot_ms) return false;
+	if (booted_ms >= POOL_BOOT_TIMEOUT_MS) return true;
+
+	// Hart threads that couldn't be picked out can't be measured, the boot time has to do
+	uint64_t cpu_ns = 0;
+	if (!gmod_machine_get_cpu_time(booting.machine, &cpu_ns)) return true;
+	int64_t poll_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - booting.last_poll).count();
+
+	bool quiet = poll_ns > 0 && (cpu_ns - booting.last_cpu_ns) * 100 < (uint64_t)poll_ns * POOL_QUIET_CENT;
+
+	booting.last_cpu_ns = cpu_ns;
+	booting.last_poll = now;
+
+	return quiet;
+}
+
+// Moves settled machines from booting to ready, pausing them on the way
+static void pool_settle(std::unique_lock<std::mutex>& lock)
+{
+	std::vector<std::pair<std::shared_ptr<machine_pool_t>, gmod_machine_t*>> settled;
+
+	pool_clock::time_point now = pool_clock::now();
+
+	for (auto& [name, pool] : pools)
+	{
+		for (auto it = pool->booting.begin(); it != pool->booting.end();)
+		{
+			if (pool_is_settled(pool.get(), *it, now))
+			{
+				settled.push_back({ pool, it->machine });
+				it = pool->booting.erase(it);
+				pool->creating++;
+			}
+			else
+				++it;
+		}
+	}
+
+	if (settled.empty()) return;
+
+	lock.unlock();
+
+	for (auto& [pool, machine] : settled)
+		gmod_machine_pause(machine);
+
+	lock.lock();
+
+	std::vector<gmod_machine_t*> dropped;
+
+	for (auto& [pool, machine] : settled)
+	{
+		pool->creating--;
+
+		if (pool->removed || pool_count(pool.get()) >= pool->size)
+			dropped.push_back(machine);
+		else
+			pool->ready.push_back(machine);
+	}
+
+	if (dropped.empty()) return;
+
+	lock.unlock();
+	pool_destroy_machines(dropped);
+	lock.lock();
+}
+
+// Starts booting one machine for the emptiest pool, returns false if there's nothing to do
+static bool pool_refill(std::unique_lock<std::mutex>& lock)
+{
+	uint32_t booting = 0;
+	std::shared_ptr<machine_pool_t> target;
+
+	for (auto& [name, pool] : pools)
+	{
+		booting += (uint32_t)pool->booting.size() + pool->creating;
+
+		if (pool_count(pool.get()) < pool->size && (!target || pool_count(pool.get()) < pool_count(target.get())))
+			target = pool;
+	}
+
+	if (!target || booting >= MACHINE_POOL_MAX_BOOTING) return false;
+
+	machine_template_t tmpl = target->tmpl;
+	target->creating++;
+
+	lock.unlock();
+
+	gmod_machine_t* machine = pool_create_machine(tmpl);
+
+	if (machine)
+	{
+		// Booting in the background shouldn't get in the way of machines players are using
+		gmod_machine_set_opt(machine, GMOD_OPT_PRIORITY, GMOD_PRIORITY_BACKGROUND);
+
+		if (!gmod_machine_start(machine))
+		{
+			gmod_machine_destroy(machine);
+			machine = nullptr;
+		}
+	}
+
+	lock.lock();
+
+	target->creating--;
+
+	if (!machine)
+	{
+		// Don't hammer a broken template, try again on the next poll
+		target->stats.failures++;
+		return false;
+	}
+
+	target->stats.boots++;
+
+	if (target->removed)
+	{
+		lock.unlock();
+		gmod_machine_destroy(machine);
+		lock.lock();
+		return true;
+	}
+
+	pool_clock::time_point now = pool_clock::now();
+	target->booting.push_back({ machine, now, now, 0 });
+
+	return true;
+}
+
+static void pool_thread_func()
+{
+	std::unique_lock<std::mutex> lock(pool_mutex);
+
+	while (pool_running)
+	{
+		pool_settle(lock);
+
+		if (!pool_running) break;
+
+		if (pool_refill(lock)) continue;
+
+		pool_cond.wait_for(lock, std::chrono::milliseconds(POOL_POLL_MS));
+	}
+}
+
+void machine_pool_init()
+{
+	std::lock_guard<std::mutex> lock(pool_mutex);
+
+	if (pool_running) return;
+
+	pool_running = true;
+	pool_thread = std::thread(pool_thread_func);
+}
+
+void machine_pool_shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+
+		if (!pool_running) return;
+
+		pool_running = false;
+	}
+
+	pool_cond.notify_all();
+
+	if (pool_thread.joinable())
+		pool_thread.join();
+
+	std::vector<gmod_machine_t*> machines;
+
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+
+		for (auto& [name, pool] : pools)
+		{
+			pool->removed = true;
+			pool_drain(pool.get(), machines);
+		}
+
+		pools.clear();
+	}
+
+	pool_destroy_machines(machines);
+}
+
+bool machine_pool_define(const char* name, const machine_template_t& tmpl, uint32_t size)
+{
+	if (!name || tmpl.ram_size <= 0 || tmpl.harts <= 0 || tmpl.exec_mode > GMOD_EXEC_TICKED) return false;
+
+	auto pool = std::make_shared<machine_pool_t>();
+
+	pool->name = name;
+	pool->tmpl = tmpl;
+	pool->size = size;
+	pool->removed = false;
+	pool->creating = 0;
+	pool->stats = {};
+
+	std::vector<gmod_machine_t*> machines;
+
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+
+		auto it = pools.find(pool->name);
+		if (it != pools.end())
+		{
+			it->second->removed = true;
+			pool_drain(it->second.get(), machines);
+		}
+
+		pools[pool->name] = pool;
+	}
+
+	pool_cond.notify_one();
+
+	pool_destroy_machines(machines);
+
+	return true;
+}
+
+bool machine_pool_set_size(const char* name, uint32_t size)
+{
+	if (!name) return false;
+
+	std::vector<gmod_machine_t*> machines;
+
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+
+		auto it = pools.find(name);
+		if (it == pools.end()) return false;
+
+		machine_pool_t* pool = it->second.get();
+
+		pool->size = size;
+
+		// Only warm machines are dropped right away, booting ones are dropped once they settle
+		while (!pool->ready.empty() && pool_count(pool) > size)
+		{
+			machines.push_back(pool->ready.back());
+			pool->ready.pop_back();
+		}
+	}
+
+	pool_cond.notify_one();
+
+	pool_destroy_machines(machines);
+
+	return true;
+}
+
+void machine_pool_remove(const char* name)
+{
+	if (!name) return;
+
+	std::vector<gmod_machine_t*> machines;
+
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+
+		auto it = pools.find(name);
+		if (it == pools.end()) return;
+
+		it->second->removed = true;
+		pool_drain(it->second.get(), machines);
+
+		pools.erase(it);
+	}
+
+	pool_destroy_machines(machines);
+}
+
+gmod_machine_t* machine_pool_take(const char* name, int id, bool* out_warm)
+{
+	if (!name || get_machine(id) != nullptr) return nullptr;
+
+	gmod_machine_t* machine = nullptr;
+	machine_template_t tmpl;
+
+	{
+		std::lock_guard<std::mutex> lock(pool_mutex);
+
+		auto it = pools.find(name);
+		if (it == pools.end()) return nullptr;
+
+		machine_pool_t* pool = it->second.get();
+
+		if (!pool->ready.empty())
+		{
+			machine = pool->ready.back();
+			pool->ready.pop_back();
+			pool->stats.hits++;
+		}
+		else
+		{
+			tmpl = pool->tmpl;
+			pool->stats.misses++;
+		}
+	}
+
+	// Refill the slot in the background
+	pool_cond.notify_one();
+
+	bool warm = machine != nullptr;
+
+	if (!machine)
+		machine = pool_create_machine(tmpl);
+
+	if (!machine) return nullptr;
+
+	gmod_machine_set_opt(machine, GMOD_OPT_PRIORITY, GMOD_PRIORITY_NORMAL);
+
+	if (!gmod_machine_assign_id(machine, id) || !gmod_machine_start(machine))
+	{
+		gmod_machine_destroy(machine);
+		return nullptr;
+	}
+
+	if (out_warm)
+		*out_warm = warm;
+
+	return machine;
+}
+
+uint32_t machine_pool_provision(const machine_template_t& tmpl, int first_id, uint32_t count, std::vector<gmod_machine_t*>& out_machines)
+{
+	if (count > MACHINE_POOL_MAX_PROVISION) count = MACHINE_POOL_MAX_PROVISION;
+
+	out_machines.assign(count, nullptr);
+
+	if (tmpl.ram_size <= 0 || tmpl.harts <= 0 || tmpl.exec_mode > GMOD_EXEC_TICKED) return 0;
+
+	// Looked up here, the machine list belongs to the Lua thread
+	std::vector<bool> wanted(count);
+	for (uint32_t i = 0; i < count; i++)
+		wanted[i] = get_machine(first_id + (int)i) == nullptr;
+
+	std::atomic<uint32_t> next = 0;
+
+	auto worker = [&]()
+		{
+			for (uint32_t i = next++; i < count; i = next++)
+				if (wanted[i])
+					out_machines[i] = pool_create_machine(tmpl);
+		};
+
+	uint32_t thread_count = std::thread::hardware_concurrency();
+	if (thread_count > MACHINE_POOL_MAX_PROVISION_THREADS) thread_count = MACHINE_POOL_MAX_PROVISION_THREADS;
+	if (thread_count > count) thread_count = count;
+	if (thread_count < 1) thread_count = 1;
+
+	std::vector<std::thread> threads;
+	for (uint32_t i = 1; i < thread_count; i++)
+		threads.emplace_back(worker);
+
+	worker();
+
+	for (std::thread& thread : threads)
+		thread.join();
+
+	uint32_t started = 0;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		gmod_machine_t* machine = out_machines[i];
+		if (!machine) continue;
+
+		if (!gmod_machine_assign_id(machine, first_id + (int)i) || !gmod_machine_start(machine))
+		{
+			gmod_machine_destroy(machine);
+			out_machines[i] = nullptr;
+			continue;
+		}
+
+		started++;
+	}
+
+	return started;
+}
+
+bool machine_pool_get_stats(const char* name, machine_pool_stats_t* out_stats)
+{
+	if (!name || !out_stats) return false;
+
+	std::lock_guard<std::mutex> lock(pool_mutex);
+
+	auto it = pools.find(name);
+	if (it == pools.end()) return false;
+
+	machine_pool_t* pool = it->second.get();
+
+	*out_stats = pool->stats;
+	out_stats->size = pool->size;
+	out_stats->ready = (uint32_t)pool->ready.size();
+	out_stats->booting = (uint32_t)pool->booting.size() + pool->creating;
+
+	return true;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <gmod_machine.h>
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+typedef struct machine_template_t
+{
+	int ram_size;
+	int harts;
+	bool is_64bit;
+
+	uint32_t exec_mode; // GMOD_EXEC_*
+
+	bool def_devices;
+	bool keyboard;
+	bool mouse;
+
+	std::string bootrom;
+	std::string kernel;
+	std::string dtb;
+	std::string cmdline;
+
+	// Attached read-only, every machine of the pool opens the same images
+	std::vector<std::string> nvme;
+
+	// Minimum time a machine boots before it's considered ready. Pooled machines
+	// additionally have to go quiet, which is the guest sitting at its login prompt.
+	uint32_t boot_ms;
+} machine_template_t;
+
+typedef struct machine_pool_stats_t
+{
+	uint32_t size;
+	uint32_t ready;
+	uint32_t booting;
+
+	uint64_t hits;     // machines handed out already booted
+	uint64_t misses;   // machines that had to be cold booted
+	uint64_t boots;
+	uint64_t failures; // machines that failed to be created or started
+} machine_pool_stats_t;
+
+#define MACHINE_POOL_DEFAULT_BOOT_MS 5000
+#define MACHINE_POOL_MAX_BOOTING     2
+
+#define MACHINE_POOL_MAX_PROVISION         4096 // machines per call
+#define MACHINE_POOL_MAX_PROVISION_THREADS 8
+
+// Keeps machines of named templates booted in the background and paused until
+// they're taken. Refills run on a pool thread, at most MACHINE_POOL_MAX_BOOTING
+// machines boot at the same time.
+void machine_pool_init();
+void machine_pool_shutdown();
+
+// Redefining a template drops its warm machines
+bool machine_pool_define(const char* name, const machine_template_t& tmpl, uint32_t size);
+bool machine_pool_set_size(const char* name, uint32_t size);
+void machine_pool_remove(const char* name);
+
+// Lua thread only. Hands out a booted machine of the template under the id, or
+// cold boots a new one if none is ready. The machine is started either way.
+gmod_machine_t* machine_pool_take(const char* name, int id, bool* out_warm = nullptr);
+
+bool machine_pool_get_stats(const char* name, machine_pool_stats_t* out_stats);
+
+// Lua thread only. Brings up count machines of the template under the ids first_id onwards without
+// a pool. They're created and set up on worker threads, images are read once for all of them
+// through the image cache, then they're listed and started here. Ids that are taken or machines
+// that fail leave a null in out_machines, returns how many came up.
+uint32_t machine_pool_provision(const machine_template_t& tmpl, int first_id, uint32_t count, std::vector<gmod_machine_t*>& out_machines);
@@ -0,0 +1,374 @@
+#include "machine_registry.h"
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+
+#define REGISTRY_TOMBSTONE UINT32_MAX
+
+#define REGISTRY_KEY_ID   0
+#define REGISTRY_KEY_RVVM 1
+#define REGISTRY_KEYS     2
+
+typedef struct registry_slot_t
+{
+	std::atomic<uint32_t> generation; // bumped on removal, so that the handles handed out go stale
+	std::atomic<gmod_machine_t*> machine;
+	std::atomic<uint64_t> keys[REGISTRY_KEYS];
+} registry_slot_t;
+
+// Open addressing, probing linearly. Entries are published and turned into tombstones in place,
+// a table with too many tombstones is rebuilt into the other buffer once no reader is left on it.
+typedef struct registry_index_t
+{
+	std::atomic<uint32_t> entries[MACHINE_REGISTRY_INDEX_SIZE]; // slot + 1, 0 is empty
+	std::atomic<uint32_t> readers;
+	uint32_t used; // entries and tombstones
+} registry_index_t;
+
+typedef struct registry_table_t
+{
+	registry_index_t buffers[2];
+	std::atomic<registry_index_t*> active;
+} registry_table_t;
+
+static registry_slot_t registry_slots[MACHINE_REGISTRY_SLOTS];
+static registry_table_t registry_tables[REGISTRY_KEYS];
+
+// Read sections, counted per phase. Waiting for the readers of the phase that was current
+// before a flip waits for every reader that could still hold a removed machine.
+static std::atomic<uint32_t> registry_section_readers[2];
+static std::atomic<uint32_t> registry_section_phase;
+static std::mutex registry_sync_mutex;
+
+static std::mutex registry_mutex; // guards everything below and serializes all changes
+static std::map<int, uint32_t> registry_ids;
+static std::vector<uint32_t> registry_free_slots;
+static bool registry_ready = false;
+
+static uint64_t registry_hash(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xFF51AFD7ED558CCDULL;
+	key ^= key >> 33;
+	key *= 0xC4CEB9FE1A85EC53ULL;
+	key ^= key >> 33;
+
+	return key;
+}
+
+static uint64_t registry_key_id(int id)
+{
+	return (uint32_t)id;
+}
+
+static uint64_t registry_key_rvvm(rvvm_machine_t* rvvm_machine)
+{
+	return (uintptr_t)rvvm_machine;
+}
+
+static void registry_init()
+{
+	if (registry_ready) return;
+
+	for (uint32_t i = MACHINE_REGISTRY_SLOTS; i-- > 0;)
+	{
+		registry_slots[i].generation = 1;
+		registry_free_slots.push_back(i);
+	}
+
+	for (registry_table_t& table : registry_tables)
+		table.active = &table.buffers[0];
+
+	registry_ready = true;
+}
+
+// The table a reader looks at can't be rebuilt until the reader leaves it
+static registry_index_t* registry_enter(registry_table_t* table)
+{
+	for (;;)
+	{
+		registry_index_t* index = table->active.load();
+
+		index->readers.fetch_add(1);
+
+		if (table->active.load() == index) return index;
+
+		index->readers.fetch_sub(1);
+	}
+}
+
+static gmod_machine_t* registry_lookup(int key_type, uint64_t key)
+{
+	// Nothing was ever added
+	if (!registry_tables[key_type].active.load()) return nullptr;
+
+	uint32_t section = machine_registry_read_begin();
+
+	registry_index_t* index = registry_enter(&registry_tables[key_type]);
+	gmod_machine_t* found = nullptr;
+
+	for (size_t i = registry_hash(key), probes = 0; probes < MACHINE_REGISTRY_INDEX_SIZE; i++, probes++)
+	{
+		uint32_t entry = index->entries[i % MACHINE_REGISTRY_INDEX_SIZE].load(std::memory_order_acquire);
+
+		if (!entry) break;
+		if (entry == REGISTRY_TOMBSTONE) continue;
+
+		// The slot may have been reused since, its key tells
+		registry_slot_t* slot = &registry_slots[entry - 1];
+		uint32_t generation = slot->generation.load(std::memory_order_acquire);
+
+		if (slot->keys[key_type].load(std::memory_order_acquire) != key) continue;
+
+		gmod_machine_t* machine = slot->machine.load(std::memory_order_acquire);
+
+		// Removed, or removed and reused, between the key and the machine
+		if (!machine || slot->generation.load(std::memory_order_acquire) != generation || slot->keys[key_type].load(std::memory_order_acquire) != key) continue;
+
+		found = machine;
+		break;
+	}
+
+	index->readers.fetch_sub(1, std::memory_order_release);
+
+	machine_registry_read_end(section);
+
+	return found;
+}
+
+static void registry_insert(registry_index_t* index, uint64_t key, uint32_t slot)
+{
+	for (size_t i = registry_hash(key);; i++)
+	{
+		std::atomic<uint32_t>& entry = index->entries[i % MACHINE_REGISTRY_INDEX_SIZE];
+		uint32_t value = entry.load(std::memory_order_relaxed);
+
+		if (value && value != REGISTRY_TOMBSTONE) continue;
+
+		if (!value)
+			index->used++;
+
+		entry.store(slot + 1, std::memory_order_release);
+		return;
+	}
+}
+
+static void registry_rebuild(registry_table_t* table, int key_type)
+{
+	registry_index_t* active = table->active.load();
+	registry_index_t* next = active == &table->buffers[0] ? &table->buffers[1] : &table->buffers[0];
+
+	// Readers only stay for one lookup
+	while (next->readers.load())
+		std::this_thread::yield();
+
+	for (auto& entry : next->entries)
+		entry.store(0, std::memory_order_relaxed);
+
+	next->used = 0;
+
+	for (auto& [id, slot] : registry_ids)
+		registry_insert(next, registry_slots[slot].keys[key_type].load(), slot);
+
+	table->active.store(next);
+}
+
+static void registry_publish(int key_type, uint64_t key, uint32_t slot)
+{
+	registry_table_t* table = &registry_tables[key_type];
+
+	// Live entries take at most half the table, the rest fills up with tombstones over time
+	if (table->active.load()->used >= MACHINE_REGISTRY_INDEX_SIZE * 3 / 4)
+		registry_rebuild(table, key_type);
+
+	registry_insert(table->active.load(), key, slot);
+}
+
+static void registry_unpublish(int key_type, uint64_t key, uint32_t slot)
+{
+	registry_index_t* index = registry_tables[key_type].active.load();
+
+	for (size_t i = registry_hash(key), probes = 0; probes < MACHINE_REGISTRY_INDEX_SIZE; i++, probes++)
+	{
+		std::atomic<uint32_t>& entry = index->entries[i % MACHINE_REGISTRY_INDEX_SIZE];
+		uint32_t value = entry.load(std::memory_order_relaxed);
+
+		if (!value) return;
+
+		if (value == slot + 1)
+		{
+			entry.store(REGISTRY_TOMBSTONE, std::memory_order_release);
+			return;
+		}
+	}
+}
+
+static uint32_t registry_handle_slot(gmod_machine_handle_t handle)
+{
+	return (uint32_t)handle - 1;
+}
+
+static uint32_t registry_handle_generation(gmod_machine_handle_t handle)
+{
+	return (uint32_t)(handle >> 32);
+}
+
+gmod_machine_handle_t machine_registry_add(int id, gmod_machine_t* machine, rvvm_machine_t* rvvm_machine)
+{
+	if (!machine) return 0;
+
+	std::lock_guard<std::mutex> lock(registry_mutex);
+
+	registry_init();
+
+	if (registry_ids.count(id) || registry_free_slots.empty()) return 0;
+
+	uint32_t slot = registry_free_slots.back();
+	registry_free_slots.pop_back();
+
+	registry_slot_t* entry = &registry_slots[slot];
+
+	entry->keys[REGISTRY_KEY_ID] = registry_key_id(id);
+	entry->keys[REGISTRY_KEY_RVVM] = registry_key_rvvm(rvvm_machine);
+	entry->machine.store(machine, std::memory_order_release);
+
+	// Listed last, a rebuild on the way would already put it in
+	registry_publish(REGISTRY_KEY_ID, registry_key_id(id), slot);
+	registry_publish(REGISTRY_KEY_RVVM, registry_key_rvvm(rvvm_machine), slot);
+
+	registry_ids.emplace(id, slot);
+
+	return ((gmod_machine_handle_t)entry->generation.load() << 32) | (slot + 1);
+}
+
+bool machine_registry_remove(gmod_machine_handle_t handle)
+{
+	std::lock_guard<std::mutex> lock(registry_mutex);
+
+	uint32_t slot = registry_handle_slot(handle);
+
+	if (!registry_ready || slot >= MACHINE_REGISTRY_SLOTS) return false;
+
+	registry_slot_t* entry = &registry_slots[slot];
+
+	if (entry->generation.load() != registry_handle_generation(handle) || !entry->machine.load()) return false;
+
+	// Stale before it can be found again, the slot isn't reused until it's out of the tables
+	uint32_t generation = entry->generation.load() + 1;
+	entry->generation.store(generation ? generation : 1);
+
+	uint64_t id_key = entry->keys[REGISTRY_KEY_ID].load();
+
+	registry_unpublish(REGISTRY_KEY_ID, id_key, slot);
+	registry_unpublish(REGISTRY_KEY_RVVM, entry->keys[REGISTRY_KEY_RVVM].load(), slot);
+
+	entry->machine.store(nullptr, std::memory_order_release);
+
+	registry_ids.erase((int)(uint32_t)id_key);
+	registry_free_slots.push_back(slot);
+
+	return true;
+}
+
+gmod_machine_t* machine_registry_get(gmod_machine_handle_t handle)
+{
+	uint32_t slot = registry_handle_slot(handle);
+
+	if (slot >= MACHINE_REGISTRY_SLOTS) return nullptr;
+
+	registry_slot_t* entry = &registry_slots[slot];
+	uint32_t generation = registry_handle_generation(handle);
+
+	if (entry->generation.load(std::memory_order_acquire) != generation) return nullptr;
+
+	uint32_t section = machine_registry_read_begin();
+
+	gmod_machine_t* machine = entry->machine.load(std::memory_order_acquire);
+
+	// Removed and reused in between
+	if (entry->generation.load(std::memory_order_acquire) != generation)
+		machine = nullptr;
+
+	machine_registry_read_end(section);
+
+	return machine;
+}
+
+gmod_machine_t* machine_registry_find(int id)
+{
+	return registry_lookup(REGISTRY_KEY_ID, registry_key_id(id));
+}
+
+gmod_machine_t* machine_registry_find_rvvm(rvvm_machine_t* rvvm_machine)
+{
+	if (!rvvm_machine) return nullptr;
+
+	return registry_lookup(REGISTRY_KEY_RVVM, registry_key_rvvm(rvvm_machine));
+}
+
+uint32_t machine_registry_read_begin()
+{
+	for (;;)
+	{
+		uint32_t phase = registry_section_phase.load() & 1;
+
+		registry_section_readers[phase].fetch_add(1);
+
+		if ((registry_section_phase.load() & 1) == phase) return phase;
+
+		registry_section_readers[phase].fetch_sub(1);
+	}
+}
+
+void machine_registry_read_end(uint32_t section)
+{
+	registry_section_readers[section & 1].fetch_sub(1, std::memory_order_release);
+}
+
+void machine_registry_synchronize()
+{
+	std::lock_guard<std::mutex> lock(registry_sync_mutex);
+
+	uint32_t phase = registry_section_phase.fetch_add(1) & 1;
+
+	// Sections are short, readers that came in since are on the other phase
+	while (registry_section_readers[phase].load(std::memory_order_acquire))
+		std::this_thread::yield();
+}
+
+std::vector<gmod_machine_t*> machine_registry_list()
+{
+	std::lock_guard<std::mutex> lock(registry_mutex);
+
+	std::vector<gmod_machine_t*> list;
+	list.reserve(registry_ids.size());
+
+	for (auto& [id, slot] : registry_ids)
+		list.push_back(registry_slots[slot].machine.load());
+
+	return list;
+}
+
+uint32_t machine_registry_count()
+{
+	std::lock_guard<std::mutex> lock(registry_mutex);
+
+	return (uint32_t)registry_ids.size();
+}
+
+void machine_registry_clear()
+{
+	std::vector<gmod_machine_handle_t> handles;
+
+	{
+		std::lock_guard<std::mutex> lock(registry_mutex);
+
+		for (auto& [id, slot] : registry_ids)
+			handles.push_back(((gmod_machine_handle_t)registry_slots[slot].generation.load() << 32) | (slot + 1));
+	}
+
+	for (gmod_machine_handle_t handle : handles)
+		machine_registry_remove(handle);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <gmod_machine.h>
+
+#include <stdint.h>
+
+#include <vector>
+
+#define MACHINE_REGISTRY_SLOTS      16384 // listed machines at once
+#define MACHINE_REGISTRY_INDEX_SIZE 32768 // power of two, at least twice the slots so probes stay short
+
+// Lookups by id, by RVVM machine and by handle are lock-free and may be done from any thread.
+// Changes are serialized, a lookup only makes sure the machine was listed when it looked. Off the
+// Lua thread, the machine found stays allocated only while the read section the lookup was done
+// in is held, machines are freed after machine_registry_synchronize().
+
+// Returns 0 if the id is taken or the registry is full
+gmod_machine_handle_t machine_registry_add(int id, gmod_machine_t* machine, rvvm_machine_t* rvvm_machine);
+
+// Every handle of the machine goes stale
+bool machine_registry_remove(gmod_machine_handle_t handle);
+
+gmod_machine_t* machine_registry_get(gmod_machine_handle_t handle);
+gmod_machine_t* machine_registry_find(int id);
+gmod_machine_t* machine_registry_find_rvvm(rvvm_machine_t* rvvm_machine);
+
+// Returns the section to end, sections may nest but must not wait for machine_registry_synchronize()
+uint32_t machine_registry_read_begin();
+void machine_registry_read_end(uint32_t section);
+
+// Waits until every read section begun before the call has ended
+void machine_registry_synchronize();
+
+// Copy of the listed machines ordered by id
+std::vector<gmod_machine_t*> machine_registry_list();
+uint32_t machine_registry_count();
+
+void machine_registry_clear();
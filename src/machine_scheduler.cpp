@@ -0,0 +1,1259 @@
+#include "machine_scheduler.h"
+
+#include "event_loop.h"
+#include "rvvm_machine_prefix.h"
+
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <map>
+#include <memory>
+
+#include <Windows.h>
+
+typedef std::chrono::steady_clock sched_clock;
+
+// A hart sitting in WFI hands its steps back right away without getting anywhere: each one returns
+// this fast and leaves PC where the last one did. librvvm doesn't expose the hart's wait state,
+// timer deadline or pending interrupts, so that's as close as it gets. A busy hart stopping on
+// the same PC this many steps in a row, all of them short, is unlikely enough.
+#define SCHED_IDLE_STEP_NS 20000
+#define SCHED_IDLE_STEPS   8
+
+#define SCHED_PRIORITIES (GMOD_PRIORITY_INTERACTIVE + 1)
+
+// Steps a hart may run back to back before going back to the queue, unless a higher priority task is waiting
+static const uint32_t sched_slice_steps[SCHED_PRIORITIES] = { 1, 2, 8 };
+
+// Interactive machines tick their events at least this often to cut timer and input latency
+#define SCHED_INTERACTIVE_TICK_NS 2000000
+
+// Every Nth pick serves the lowest priority first so background machines never starve completely
+#define SCHED_STARVE_PICKS 16
+
+// Virtual time moves on by at most one such tick when the server stalls, the rest is owed and
+// owing more than the lag cap is forgiven
+#define SCHED_VTIME_MAX_TICK_NS 100000000
+#define SCHED_VTIME_MAX_LAG_NS  1000000000
+
+typedef struct sched_hart_t
+{
+	std::atomic<int64_t> remaining_ns;
+	std::atomic<uint32_t> steps;
+	std::atomic<uint64_t> used_ns;
+	uint32_t idle_steps; // only touched by the worker holding the hart task
+
+	std::atomic<uint64_t> held_ns; // throttled or parked with a spent budget, since the last server tick
+	int64_t parked_ns;             // when it was parked, guarded by parked_mutex
+
+	std::atomic<uint64_t> last_pc;  // after the last step, read by the watchdog
+	std::atomic<uint64_t> total_ns; // used_ns is taken every server tick, this one never
+	std::atomic<uint64_t> idles;    // times the hart went idle
+} sched_hart_t;
+
+typedef struct sched_machine_t
+{
+	gmod_machine_t* owner;
+	rvvm_machine_t* machine;
+	uint32_t harts;
+
+	std::atomic<bool> removed;
+	std::atomic<int> active_steps;
+
+	std::atomic<uint64_t> cpu_ns;
+
+	std::atomic<int64_t> next_tick_ns;
+	std::atomic<bool> ticking;
+
+	std::atomic<bool> budgeted;
+	std::atomic<bool> tick_pending;
+	std::atomic<uint64_t> budget_time_ns;
+	std::atomic<uint32_t> budget_steps;
+	std::unique_ptr<sched_hart_t[]> hart_state;
+
+	std::mutex parked_mutex; // guards parked, budget_stats and budget refills
+	std::vector<uint16_t> parked;
+	machine_budget_stats_t budget_stats;
+
+	// CPU limit token bucket, in nanoseconds of host time
+	std::atomic<uint32_t> cpu_limit_cent;
+	std::mutex tokens_mutex;
+	int64_t tokens_ns;
+	int64_t tokens_refill_ns;
+
+	std::atomic<uint64_t> affinity; // host cores the harts may run on, zero is any
+
+	std::atomic<uint32_t> priority; // GMOD_PRIORITY_*
+
+	// Virtual time, steps hold the lock shared and the clock is only set while it's held exclusively
+	std::atomic<bool> vtime;
+	std::atomic<bool> vtime_pending;
+	std::shared_mutex vtime_lock;
+	std::atomic<uint64_t> vtime_target; // guest timer ticks
+	std::atomic<uint64_t> vtime_seen;   // the latest guest time a hart may have read
+	uint64_t vtime_base;                // the rest is guarded by sched_mutex
+	uint64_t vtime_elapsed_ns;
+	int64_t vtime_tick_ns;
+	uint32_t vtime_catchup_cent;
+	machine_time_stats_t time_stats;
+} sched_machine_t;
+
+typedef struct sched_task_t
+{
+	std::shared_ptr<sched_machine_t> machine;
+	uint16_t hart_id;
+	uint32_t priority; // queue the task was pushed to
+} sched_task_t;
+
+typedef struct sched_worker_t
+{
+	std::thread thread;
+
+	std::mutex queue_mutex;
+	std::deque<sched_task_t> queue[SCHED_PRIORITIES];
+	uint32_t picks; // only touched by the worker itself
+
+	std::atomic<uint64_t> steps;
+	std::atomic<uint64_t> steals;
+	std::atomic<uint64_t> busy_ns;
+	std::atomic<uint64_t> idle_ns;
+	std::atomic<uint64_t> idle_parks;
+	std::atomic<uint64_t> preemptions;
+
+	std::atomic<uint64_t> core_mask; // host core the worker is pinned to, zero if unpinned
+} sched_worker_t;
+
+static std::vector<std::unique_ptr<sched_worker_t>> sched_workers;
+static std::atomic<bool> sched_running = false;
+
+static std::mutex sched_mutex; // guards sched_machines and the worker list
+static std::map<gmod_machine_t*, std::shared_ptr<sched_machine_t>> sched_machines;
+static std::atomic<size_t> sched_machine_count = 0; // size of sched_machines, read by idle workers
+static uint32_t sched_next_worker = 0;
+static uint64_t sched_reserved_cores = 0;
+static std::atomic<uint64_t> sched_worker_cores = 0; // cores some worker is pinned to
+
+static std::mutex sched_idle_mutex;
+static std::condition_variable sched_idle_cond;
+static std::atomic<int> sched_queued = 0;
+static std::atomic<int> sched_queued_prio[SCHED_PRIORITIES] = {};
+
+// Tasks waiting for a wakeup time, not counted in sched_queued
+static std::mutex sched_sleep_mutex;
+static std::multimap<int64_t, sched_task_t> sched_sleepers;
+static std::atomic<int64_t> sched_next_wake = INT64_MAX;
+static std::atomic<uint64_t> sched_idle_wakes = 0;
+
+static std::mutex sched_remove_mutex;
+static std::condition_variable sched_remove_cond;
+
+static int64_t sched_now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(sched_clock::now().time_since_epoch()).count();
+}
+
+static void sched_push(sched_worker_t* worker, sched_task_t&& task)
+{
+	task.priority = task.machine->priority.load(std::memory_order_relaxed);
+
+	int queued;
+
+	{
+		std::lock_guard<std::mutex> lock(worker->queue_mutex);
+
+		sched_queued_prio[task.priority]++;
+		queued = sched_queued.fetch_add(1);
+
+		worker->queue[task.priority].push_back(std::move(task));
+	}
+
+	if (queued == 0)
+		sched_idle_cond.notify_all();
+}
+
+static bool sched_pop(sched_worker_t* worker, uint32_t priority, sched_task_t* task)
+{
+	std::lock_guard<std::mutex> lock(worker->queue_mutex);
+
+	std::deque<sched_task_t>& queue = worker->queue[priority];
+
+	if (queue.empty()) return false;
+
+	*task = std::move(queue.front());
+	queue.pop_front();
+
+	sched_queued_prio[priority]--;
+	sched_queued--;
+
+	return true;
+}
+
+static bool sched_higher_queued(uint32_t priority)
+{
+	for (uint32_t i = priority + 1; i < SCHED_PRIORITIES; i++)
+		if (sched_queued_prio[i].load(std::memory_order_relaxed) > 0)
+			return true;
+
+	return false;
+}
+
+static bool sched_allowed(sched_worker_t* worker, sched_machine_t* machine)
+{
+	uint64_t affinity = machine->affinity.load(std::memory_order_relaxed);
+	uint64_t core_mask = worker->core_mask.load(std::memory_order_relaxed);
+
+	// No worker is pinned inside the mask, e.g. after the workers moved, run anywhere rather than never
+	if (!(affinity & sched_worker_cores.load(std::memory_order_relaxed))) return true;
+
+	return !affinity || !core_mask || (affinity & core_mask);
+}
+
+static sched_worker_t* sched_pick_worker(sched_machine_t* machine)
+{
+	size_t count = sched_workers.size();
+
+	for (size_t i = 0; i < count; i++)
+	{
+		sched_worker_t* worker = sched_workers[(sched_next_worker + i) % count].get();
+
+		if (sched_allowed(worker, machine))
+		{
+			sched_next_worker += (uint32_t)i + 1;
+			return worker;
+		}
+	}
+
+	// Unreachable with a worker list, sched_allowed() lets any worker take a mask none is pinned in
+	return sched_workers[sched_next_worker++ % count].get();
+}
+
+static bool sched_steal(uint32_t self, uint32_t priority, sched_task_t* task)
+{
+	size_t count = sched_workers.size();
+	sched_worker_t* thief = sched_workers[self].get();
+
+	for (size_t i = 1; i < count; i++)
+	{
+		sched_worker_t* victim = sched_workers[(self + i) % count].get();
+
+		std::lock_guard<std::mutex> lock(victim->queue_mutex);
+
+		std::deque<sched_task_t>& queue = victim->queue[priority];
+
+		for (auto it = queue.rbegin(); it != queue.rend(); ++it)
+		{
+			if (!sched_allowed(thief, it->machine.get())) continue;
+
+			*task = std::move(*it);
+			queue.erase(std::next(it).base());
+
+			sched_queued_prio[priority]--;
+			sched_queued--;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Takes the highest priority task from the own queue or, failing that, from another worker
+static bool sched_pick(uint32_t self, sched_task_t* task)
+{
+	sched_worker_t* worker = sched_workers[self].get();
+
+	bool starved = ++worker->picks % SCHED_STARVE_PICKS == 0;
+
+	for (uint32_t i = 0; i < SCHED_PRIORITIES; i++)
+	{
+		uint32_t priority = starved ? i : SCHED_PRIORITIES - 1 - i;
+
+		if (sched_queued_prio[priority].load(std::memory_order_relaxed) <= 0) continue;
+
+		if (sched_pop(worker, priority, task)) return true;
+
+		if (sched_steal(self, priority, task))
+		{
+			worker->steals++;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Spreads the workers over the process cores that aren't reserved, one core each
+static void sched_pin_workers()
+{
+	DWORD_PTR process_mask = 0;
+	DWORD_PTR system_mask = 0;
+
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+		return;
+
+	uint64_t available = (uint64_t)process_mask & ~sched_reserved_cores;
+	if (!available) available = (uint64_t)process_mask;
+
+	std::vector<uint64_t> cores;
+	for (uint32_t bit = 0; bit < 64; bit++)
+		if (available & (1ULL << bit))
+			cores.push_back(1ULL << bit);
+
+	if (cores.empty()) return;
+
+	for (size_t i = 0; i < sched_workers.size(); i++)
+	{
+		sched_worker_t* worker = sched_workers[i].get();
+		uint64_t core = cores[i % cores.size()];
+
+		if (SetThreadAffinityMask((HANDLE)worker->thread.native_handle(), (DWORD_PTR)core))
+			worker->core_mask.store(core);
+	}
+
+	uint64_t pinned = 0;
+	for (auto& worker : sched_workers)
+		pinned |= worker->core_mask.load();
+
+	sched_worker_cores.store(pinned);
+}
+
+static void sched_sleep(sched_task_t&& task, int64_t wake_ns)
+{
+	std::lock_guard<std::mutex> lock(sched_sleep_mutex);
+
+	sched_sleepers.emplace(wake_ns, std::move(task));
+
+	if (wake_ns < sched_next_wake.load())
+	{
+		sched_next_wake.store(wake_ns);
+		sched_idle_cond.notify_one();
+	}
+}
+
+static void sched_wake_sleepers(sched_worker_t* worker, int64_t now)
+{
+	if (now < sched_next_wake.load(std::memory_order_relaxed)) return;
+
+	std::vector<sched_task_t> woken;
+
+	{
+		std::lock_guard<std::mutex> lock(sched_sleep_mutex);
+
+		auto it = sched_sleepers.begin();
+		while (it != sched_sleepers.end() && it->first <= now)
+		{
+			woken.push_back(std::move(it->second));
+			it = sched_sleepers.erase(it);
+		}
+
+		sched_next_wake.store(sched_sleepers.empty() ? INT64_MAX : sched_sleepers.begin()->first);
+	}
+
+	for (auto& task : woken)
+		if (!task.machine->removed.load())
+			sched_push(worker, std::move(task));
+}
+
+// Moves the sleeping harts of a machine to the front of the line, e.g. after an IRQ was injected
+static void sched_wake_machine(sched_machine_t* machine)
+{
+	int64_t now = sched_now_ns();
+
+	std::lock_guard<std::mutex> lock(sched_sleep_mutex);
+
+	std::vector<sched_task_t> woken;
+
+	for (auto it = sched_sleepers.begin(); it != sched_sleepers.end();)
+	{
+		if (it->first > now && it->second.machine.get() == machine)
+		{
+			woken.push_back(std::move(it->second));
+			it = sched_sleepers.erase(it);
+		}
+		else
+			++it;
+	}
+
+	if (woken.empty()) return;
+
+	sched_idle_wakes += woken.size();
+
+	for (auto& task : woken)
+		sched_sleepers.emplace(now, std::move(task));
+
+	sched_next_wake.store(now);
+
+	// Make sure an idle worker is either waiting already or sees the new wake time
+	{
+		std::lock_guard<std::mutex> idle_lock(sched_idle_mutex);
+	}
+
+	sched_idle_cond.notify_one();
+}
+
+// Returns how long the machine has to wait for CPU time, zero if it may run now
+static int64_t sched_cpu_throttle_ns(sched_machine_t* machine, int64_t now)
+{
+	uint32_t limit = machine->cpu_limit_cent.load(std::memory_order_relaxed);
+
+	if (!limit) return 0;
+
+	std::lock_guard<std::mutex> lock(machine->tokens_mutex);
+
+	// Allow bursts of up to 20ms worth of the limit
+	int64_t burst = 20000000LL * limit / 100;
+
+	machine->tokens_ns += (now - machine->tokens_refill_ns) * limit / 100;
+	machine->tokens_refill_ns = now;
+
+	if (machine->tokens_ns > burst)
+		machine->tokens_ns = burst;
+
+	if (machine->tokens_ns > 0) return 0;
+
+	return -machine->tokens_ns * 100 / limit + 1;
+}
+
+static void sched_cpu_charge(sched_machine_t* machine, int64_t used_ns)
+{
+	if (!machine->cpu_limit_cent.load(std::memory_order_relaxed)) return;
+
+	std::lock_guard<std::mutex> lock(machine->tokens_mutex);
+	machine->tokens_ns -= used_ns;
+}
+
+static void sched_push_harts(std::shared_ptr<sched_machine_t> machine, const std::vector<uint16_t>& harts)
+{
+	for (uint16_t hart : harts)
+		sched_push(sched_pick_worker(machine.get()), { machine, hart });
+}
+
+static void sched_tick_machine(sched_machine_t* machine, int64_t now)
+{
+	if (machine->budgeted.load())
+	{
+		// Tick-locked machines see exactly one event tick per server tick
+		if (!machine->tick_pending.load(std::memory_order_relaxed)) return;
+	}
+	else if (now < machine->next_tick_ns.load(std::memory_order_relaxed)) return;
+
+	// Only one worker ticks the machine events, the others keep stepping harts
+	if (machine->ticking.exchange(true)) return;
+
+	if (!machine->budgeted.load() || machine->tick_pending.exchange(false))
+		rvvm_external_eventloop_tick_machine(machine->machine);
+
+	int64_t period = (int64_t)event_loop_get_period() * 1000000;
+
+	if (machine->priority.load(std::memory_order_relaxed) == GMOD_PRIORITY_INTERACTIVE && period > SCHED_INTERACTIVE_TICK_NS)
+		period = SCHED_INTERACTIVE_TICK_NS;
+
+	machine->next_tick_ns.store(now + period);
+	machine->ticking.store(false);
+}
+
+static bool sched_hart_exhausted(sched_machine_t* machine, uint16_t hart_id)
+{
+	sched_hart_t* hart = &machine->hart_state[hart_id];
+
+	uint64_t budget_time = machine->budget_time_ns.load();
+	uint32_t budget_steps = machine->budget_steps.load();
+
+	if (budget_time && hart->remaining_ns.load() <= 0) return true;
+	if (budget_steps && hart->steps.load() >= budget_steps) return true;
+
+	return false;
+}
+
+static bool sched_try_park(sched_machine_t* machine, uint16_t hart_id)
+{
+	if (!machine->budgeted.load() || !sched_hart_exhausted(machine, hart_id)) return false;
+
+	std::lock_guard<std::mutex> lock(machine->parked_mutex);
+
+	// Recheck under the lock, the budget might have been refilled meanwhile
+	if (!machine->budgeted.load() || !sched_hart_exhausted(machine, hart_id)) return false;
+
+	machine->parked.push_back(hart_id);
+	machine->hart_state[hart_id].parked_ns = sched_now_ns();
+
+	return true;
+}
+
+static void sched_apply_budget(sched_machine_t* machine, const machine_budget_t* budget)
+{
+	std::lock_guard<std::mutex> lock(machine->parked_mutex);
+
+	bool budgeted = budget && (budget->time_ns || budget->steps);
+
+	machine->budget_time_ns.store(budgeted ? budget->time_ns : 0);
+	machine->budget_steps.store(budgeted ? budget->steps : 0);
+
+	for (uint32_t i = 0; i < machine->harts; i++)
+	{
+		machine->hart_state[i].remaining_ns.store(budgeted ? (int64_t)budget->time_ns : 0);
+		machine->hart_state[i].steps.store(0);
+	}
+
+	machine->tick_pending.store(budgeted);
+	machine->budgeted.store(budgeted);
+}
+
+static void sched_release(sched_machine_t* machine)
+{
+	if (machine->active_steps.fetch_sub(1) == 1 && machine->removed.load())
+	{
+		std::lock_guard<std::mutex> lock(sched_remove_mutex);
+		sched_remove_cond.notify_all();
+	}
+}
+
+static uint64_t sched_ns_to_timer(uint64_t ns, uint64_t freq)
+{
+	return ns / 1000000000 * freq + ns % 1000000000 * freq / 1000000000;
+}
+
+// Sets the guest clock to where virtual time got to, once no other hart of the machine is stepping
+static void sched_vtime_sync(sched_machine_t* machine)
+{
+	if (!machine->vtime_pending.load()) return;
+
+	// Waits out the steps of the other harts, which are short
+	std::unique_lock<std::shared_mutex> lock(machine->vtime_lock);
+
+	if (!machine->vtime_pending.exchange(false)) return;
+
+	uint64_t seen = machine->vtime_seen.load();
+	uint64_t target = machine->vtime_target.load();
+
+	// Ahead of virtual time the clock stands still rather than going back
+	uint64_t time = target > seen ? target : seen;
+
+	rvvm_machine_set_time(machine->machine, time);
+	machine->vtime_seen.store(time);
+}
+
+static void sched_vtime_observe(sched_machine_t* machine)
+{
+	uint64_t time = rvvm_machine_get_time(machine->machine);
+	uint64_t seen = machine->vtime_seen.load();
+
+	while (time > seen && !machine->vtime_seen.compare_exchange_weak(seen, time));
+}
+
+// Moves virtual time on by one server tick, runs under sched_mutex
+static void sched_vtime_tick(sched_machine_t* machine, int64_t now)
+{
+	int64_t elapsed = now - machine->vtime_tick_ns;
+	machine->vtime_tick_ns = now;
+
+	if (elapsed <= 0) return;
+
+	{
+		std::lock_guard<std::mutex> lock(machine->parked_mutex);
+
+		for (uint16_t hart_id : machine->parked)
+		{
+			sched_hart_t* hart = &machine->hart_state[hart_id];
+
+			hart->held_ns += now - hart->parked_ns;
+			hart->parked_ns = now;
+		}
+	}
+
+	// The guest only stood still while every hart was held back
+	int64_t held = elapsed;
+
+	for (uint32_t i = 0; i < machine->harts; i++)
+	{
+		int64_t hart_held = (int64_t)machine->hart_state[i].held_ns.exchange(0);
+
+		if (hart_held < held)
+			held = hart_held;
+	}
+
+	int64_t advance = elapsed < SCHED_VTIME_MAX_TICK_NS ? elapsed : SCHED_VTIME_MAX_TICK_NS;
+	advance = advance > held ? advance - held : 0;
+
+	machine_time_stats_t& stats = machine->time_stats;
+
+	stats.held_ns += held;
+	stats.lag_ns += elapsed - advance;
+
+	uint64_t repay = (uint64_t)elapsed * machine->vtime_catchup_cent / 100;
+
+	if (repay > stats.lag_ns)
+		repay = stats.lag_ns;
+
+	advance += repay;
+	stats.lag_ns -= repay;
+
+	if (stats.lag_ns > SCHED_VTIME_MAX_LAG_NS)
+	{
+		stats.dropped_ns += stats.lag_ns - SCHED_VTIME_MAX_LAG_NS;
+		stats.lag_ns = SCHED_VTIME_MAX_LAG_NS;
+	}
+
+	machine->vtime_elapsed_ns += advance;
+
+	uint64_t freq = rvvm_machine_prefix(machine->machine)->timer.freq;
+
+	machine->vtime_target.store(machine->vtime_base + sched_ns_to_timer(machine->vtime_elapsed_ns, freq));
+	machine->vtime_pending.store(true);
+}
+
+// Runs one step of the hart, returns false if it went idle
+static bool sched_step_hart(sched_worker_t* worker, sched_machine_t* machine, uint16_t hart_id)
+{
+	std::shared_lock<std::shared_mutex> vtime_lock(machine->vtime_lock, std::defer_lock);
+
+	if (machine->vtime.load(std::memory_order_relaxed))
+	{
+		sched_vtime_sync(machine);
+		vtime_lock.lock();
+	}
+
+	int64_t step_begin = sched_now_ns();
+
+	// Tick before stepping so pending timer IRQs reach a hart woken from idle
+	sched_tick_machine(machine, step_begin);
+
+	rvvm_external_step_machine(machine->machine, hart_id);
+
+	int64_t step_end = sched_now_ns();
+
+	if (vtime_lock.owns_lock())
+	{
+		sched_vtime_observe(machine);
+		vtime_lock.unlock();
+	}
+
+	sched_cpu_charge(machine, step_end - step_begin);
+
+	sched_hart_t* hart = &machine->hart_state[hart_id];
+	hart->remaining_ns -= step_end - step_begin;
+	hart->used_ns += step_end - step_begin;
+	hart->total_ns += step_end - step_begin;
+	hart->steps++;
+
+	uint64_t pc = rvvm_read_cpu_reg(rvvm_machine_get_hart(machine->machine, hart_id), RVVM_REGID_PC);
+	bool waiting = step_end - step_begin < SCHED_IDLE_STEP_NS && pc == hart->last_pc.load(std::memory_order_relaxed);
+
+	hart->last_pc.store(pc, std::memory_order_relaxed);
+
+	machine->cpu_ns += step_end - step_begin;
+	worker->busy_ns += step_end - step_begin;
+	worker->steps++;
+
+	if (waiting)
+		hart->idle_steps++;
+	else
+		hart->idle_steps = 0;
+
+	if (hart->idle_steps < SCHED_IDLE_STEPS) return true;
+
+	hart->idles++;
+
+	return false;
+}
+
+static void sched_worker_func(uint32_t index)
+{
+	sched_worker_t* worker = sched_workers[index].get();
+
+	while (sched_running.load())
+	{
+		sched_wake_sleepers(worker, sched_now_ns());
+
+		sched_task_t task;
+
+		if (!sched_pick(index, &task))
+		{
+			int64_t idle_begin = sched_now_ns();
+
+			// Nothing to run until a machine is added
+			if (!sched_machine_count.load())
+			{
+				std::unique_lock<std::mutex> lock(sched_idle_mutex);
+				sched_idle_cond.wait(lock, [] { return sched_machine_count.load() > 0 || !sched_running.load(); });
+
+				worker->idle_ns += sched_now_ns() - idle_begin;
+				continue;
+			}
+
+			int64_t timeout = sched_next_wake.load() - idle_begin;
+			if (timeout > 10000000) timeout = 10000000;
+			if (timeout < 0) timeout = 0;
+
+			int64_t idle_until = idle_begin + timeout;
+
+			// Also wake up when a sleeping task got an earlier wake time meanwhile
+			std::unique_lock<std::mutex> lock(sched_idle_mutex);
+			sched_idle_cond.wait_for(lock, std::chrono::nanoseconds(timeout), [idle_until]
+				{
+					return sched_queued.load() > 0 || !sched_running.load() || sched_next_wake.load() < idle_until;
+				});
+
+			worker->idle_ns += sched_now_ns() - idle_begin;
+			continue;
+		}
+
+		sched_machine_t* machine = task.machine.get();
+
+		if (!sched_allowed(worker, machine))
+		{
+			// Affinity changed while the task was queued
+			std::lock_guard<std::mutex> lock(sched_mutex);
+			sched_push(sched_pick_worker(machine), std::move(task));
+			continue;
+		}
+
+		machine->active_steps++;
+
+		bool idle = false;
+		uint32_t priority = machine->priority.load(std::memory_order_relaxed);
+		uint32_t slice = sched_slice_steps[priority];
+
+		for (uint32_t step = 0; step < slice; step++)
+		{
+			if (machine->removed.load() || sched_try_park(machine, task.hart_id))
+			{
+				sched_release(machine);
+				break;
+			}
+
+			int64_t now = sched_now_ns();
+			int64_t throttle = sched_cpu_throttle_ns(machine, now);
+
+			if (throttle)
+			{
+				machine->hart_state[task.hart_id].held_ns += throttle;
+
+				sched_release(machine);
+				sched_sleep(std::move(task), now + throttle);
+				break;
+			}
+
+			idle = !sched_step_hart(worker, machine, task.hart_id);
+
+			bool last = step + 1 == slice || idle || machine->removed.load();
+
+			// Cut the slice short when a more important hart is waiting for a worker
+			if (!last && sched_higher_queued(priority))
+			{
+				worker->preemptions++;
+				last = true;
+			}
+
+			if (!last) continue;
+
+			sched_release(machine);
+
+			if (machine->removed.load()) break;
+
+			if (idle)
+			{
+				// Nothing can wake the hart before the next event tick delivers timer
+				// interrupts, unless an IRQ is injected through machine_scheduler_wake().
+				// A single step that still finds it waiting is enough to park again.
+				machine->hart_state[task.hart_id].idle_steps = SCHED_IDLE_STEPS - 1;
+				worker->idle_parks++;
+				sched_sleep(std::move(task), machine->next_tick_ns.load());
+			}
+			else
+				sched_push(worker, std::move(task));
+
+			break;
+		}
+	}
+}
+
+// Starts the workers, sched_mutex must be held
+static void sched_start(uint32_t workers)
+{
+	if (sched_running.load()) return;
+
+	if (workers == 0)
+	{
+		// Leave one core to srcds itself
+		workers = std::thread::hardware_concurrency();
+		workers = workers > 1 ? workers - 1 : 1;
+	}
+
+	sched_running.store(true);
+
+	for (uint32_t i = 0; i < workers; i++)
+		sched_workers.push_back(std::make_unique<sched_worker_t>());
+
+	for (uint32_t i = 0; i < workers; i++)
+		sched_workers[i]->thread = std::thread(sched_worker_func, i);
+
+	sched_pin_workers();
+}
+
+void machine_scheduler_init(uint32_t workers)
+{
+	std::lock_guard<std::mutex> lock(sched_mutex);
+
+	sched_start(workers);
+}
+
+void machine_scheduler_shutdown()
+{
+	std::unique_lock<std::mutex> lock(sched_mutex);
+
+	if (!sched_running.load()) return;
+
+	for (auto& [owner, machine] : sched_machines)
+		machine->removed.store(true);
+
+	sched_running.store(false);
+
+	// Workers waiting for a machine have no timeout to fall back on
+	{
+		std::lock_guard<std::mutex> idle_lock(sched_idle_mutex);
+	}
+
+	sched_idle_cond.notify_all();
+
+	// Workers may need sched_mutex to finish their current task
+	lock.unlock();
+
+	for (auto& worker : sched_workers)
+		if (worker->thread.joinable())
+			worker->thread.join();
+
+	lock.lock();
+
+	{
+		std::lock_guard<std::mutex> sleep_lock(sched_sleep_mutex);
+		sched_sleepers.clear();
+		sched_next_wake = INT64_MAX;
+	}
+
+	sched_workers.clear();
+	sched_worker_cores = 0;
+	sched_machines.clear();
+	sched_machine_count = 0;
+	sched_queued = 0;
+}
+
+uint32_t machine_scheduler_get_workers()
+{
+	std::lock_guard<std::mutex> lock(sched_mutex);
+	return (uint32_t)sched_workers.size();
+}
+
+bool machine_scheduler_add(gmod_machine_t* machine, const machine_budget_t* budget, uint64_t affinity, uint32_t priority)
+{
+	if (!machine) return false;
+
+	std::lock_guard<std::mutex> lock(sched_mutex);
+
+	// The workers only start with the first machine
+	sched_start(0);
+
+	if (sched_workers.empty()) return false;
+	if (sched_machines.count(machine)) return true;
+
+	rvvm_machine_t* rvvm_machine = gmod_machine_get_rvvm_machine(machine);
+
+	auto sched_machine = std::make_shared<sched_machine_t>();
+
+	sched_machine->owner = machine;
+	sched_machine->machine = rvvm_machine;
+	sched_machine->harts = (uint32_t)rvvm_get_opt(rvvm_machine, RVVM_OPT_HART_COUNT);
+	sched_machine->removed = false;
+	sched_machine->active_steps = 0;
+	sched_machine->cpu_ns = 0;
+	sched_machine->next_tick_ns = 0;
+	sched_machine->ticking = false;
+	sched_machine->budgeted = false;
+	sched_machine->tick_pending = false;
+	sched_machine->budget_time_ns = 0;
+	sched_machine->budget_steps = 0;
+	sched_machine->hart_state = std::make_unique<sched_hart_t[]>(sched_machine->harts);
+	sched_machine->budget_stats = {};
+	sched_machine->cpu_limit_cent = 0;
+	sched_machine->tokens_ns = 0;
+	sched_machine->tokens_refill_ns = sched_now_ns();
+	sched_machine->affinity = affinity;
+	sched_machine->priority = priority < SCHED_PRIORITIES ? priority : GMOD_PRIORITY_NORMAL;
+	sched_machine->vtime = false;
+	sched_machine->vtime_pending = false;
+	sched_machine->vtime_target = 0;
+	sched_machine->vtime_seen = 0;
+	sched_machine->vtime_base = 0;
+	sched_machine->vtime_elapsed_ns = 0;
+	sched_machine->vtime_tick_ns = 0;
+	sched_machine->vtime_catchup_cent = 0;
+	sched_machine->time_stats = {};
+
+	for (uint32_t hart = 0; hart < sched_machine->harts; hart++)
+	{
+		sched_machine->hart_state[hart].remaining_ns = 0;
+		sched_machine->hart_state[hart].steps = 0;
+		sched_machine->hart_state[hart].used_ns = 0;
+		sched_machine->hart_state[hart].idle_steps = 0;
+		sched_machine->hart_state[hart].held_ns = 0;
+		sched_machine->hart_state[hart].parked_ns = 0;
+	}
+
+	sched_apply_budget(sched_machine.get(), budget);
+
+	sched_machines.emplace(machine, sched_machine);
+	sched_machine_count = sched_machines.size();
+
+	std::vector<uint16_t> harts;
+	for (uint32_t hart = 0; hart < sched_machine->harts; hart++)
+		harts.push_back((uint16_t)hart);
+
+	sched_push_harts(sched_machine, harts);
+
+	// Make sure workers waiting for a machine are either waiting already or see it
+	{
+		std::lock_guard<std::mutex> idle_lock(sched_idle_mutex);
+	}
+
+	sched_idle_cond.notify_all();
+
+	return true;
+}
+
+void machine_scheduler_remove(gmod_machine_t* machine)
+{
+	std::shared_ptr<sched_machine_t> sched_machine;
+
+	{
+		std::lock_guard<std::mutex> lock(sched_mutex);
+
+		auto it = sched_machines.find(machine);
+		if (it == sched_machines.end()) return;
+
+		sched_machine = it->second;
+		sched_machines.erase(it);
+		sched_machine_count = sched_machines.size();
+	}
+
+	// Queued tasks are dropped lazily by the workers
+	sched_machine->removed.store(true);
+
+	std::unique_lock<std::mutex> lock(sched_remove_mutex);
+	sched_remove_cond.wait(lock, [&] { return sched_machine->active_steps.load() == 0; });
+}
+
+bool machine_scheduler_contains(gmod_machine_t* machine)
+{
+	std::lock_guard<std::mutex> lock(sched_mutex);
+	return sched_machines.count(machine) != 0;
+}
+
+uint64_t machine_scheduler_get_cpu_ns(gmod_machine_t* machine)
+{
+	std::lock_guard<std::mutex> lock(sched_mutex);
+
+	auto it = sched_machines.find(machine);
+	if (it == sched_machines.end()) return 0;
+
+	return it->second->cpu_ns.load();
+}
+
+void machine_scheduler_set_budget(gmod_machine_t* machine, const machine_budget_t* budget)
+{
+	std::lock_guard<std::mutex> lock(sched_mutex);
+
+	auto it = sched_machines.find(machine);
+	if (it == sched_machines.end()) return;
+
+	std::shared_ptr<sched_machine_t> sched_machine = it->second;
+
+	sched_apply_budget(sched_machine.get(), budget);
+
+	std::vector<uint16_t> parked;
+	{
+		std::lock_guard<std::mutex> parked_lock(sched_machine->parked_mutex);
+		parked.swap(sched_machine->parked);
+	}
+
+	sched_push_harts(sched_machine, parked);
+}
+
+void machine_scheduler_set_cpu_limit(gmod_machine_t* machine, uint32_t cent)
+{
+	std::lock_guard<std::mutex> lock(sched_mutex);
+
+	auto it = sched_machines.find(machine);
+	if (it == sched_machines.end()) return;
+
+	sched_machine_t* sched_machine = it->second.get();
+
+	std::lock_guard<std::mutex> tokens_lock(sched_machine->tokens_mutex);
+
+	if (!sched_machine->cpu_limit_cent.load())
+	{
+		sched_machine->tokens_ns = 0;
+		sched_machine->tokens_refill_ns = sched_now_ns();
+	}
+
+	sched_machine->cpu_limit_cent.store(cent);
+}
+
+bool machine_scheduler_get_budget_stats(gmod_machine_t* machine, machine_budget_stats_t* out_stats)
+{
+	if (!out_stats) return false;
+
+	std::lock_guard<std::mutex> lock(sched_mutex);
+
+	auto it = sched_machines.find(machine);
+	if (it == sched_machines.end()) return false;
+
+	std::lock_guard<std::mutex> parked_lock(it->second->parked_mutex);
+	*out_stats = it->second->budget_stats;
+
+	return true;
+}
+
+void machine_scheduler_set_virtual_time(gmod_machine_t* machine, bool enable, uint32_t catchup_cent)
+{
+	std::lock_guard<std::mutex> lock(sched_mutex);
+
+	auto it = sched_machines.find(machine);
+	if (it == sched_machines.end()) return;
+
+	sched_machine_t* sched_machine = it->second.get();
+
+	sched_machine->vtime_catchup_cent = catchup_cent;
+
+	if (enable == sched_machine->vtime.load()) return;
+
+	if (enable)
+	{
+		// Starts out from where the guest clock is, nothing is owed yet
+		uint64_t time = rvvm_machine_get_time(sched_machine->machine);
+
+		sched_machine->vtime_base = time;
+		sched_machine->vtime_elapsed_ns = 0;
+		sched_machine->vtime_tick_ns = sched_now_ns();
+		sched_machine->vtime_target.store(time);
+		sched_machine->vtime_seen.store(time);
+		sched_machine->vtime_pending.store(false);
+		sched_machine->time_stats.lag_ns = 0;
+
+		for (uint32_t i = 0; i < sched_machine->harts; i++)
+			sched_machine->hart_state[i].held_ns.store(0);
+	}
+
+	sched_machine->vtime.store(enable);
+}
+
+bool machine_scheduler_get_time_stats(gmod_machine_t* machine, machine_time_stats_t* out_stats)
+{
+	if (!out_stats) return false;
+
+	std::lock_guard<std::mutex> lock(sched_mutex);
+
+	auto it = sched_machines.find(machine);
+	if (it == sched_machines.end() || !it->second->vtime.load()) return false;
+
+	*out_stats = it->second->time_stats;
+
+	return true;
+}
+
+void machine_scheduler_tick(std::vector<machine_overrun_t>& out_overruns)
+{
+	std::lock_guard<std::mutex> lock(sched_mutex);
+
+	int64_t now = sched_now_ns();
+
+	for (auto& [owner, sched_machine] : sched_machines)
+	{
+		// Before the refill, parked harts count as held until now
+		if (sched_machine->vtime.load())
+			sched_vtime_tick(sched_machine.get(), now);
+
+		if (!sched_machine->budgeted.load()) continue;
+
+		std::vector<uint16_t> parked;
+		uint64_t overrun_ns = 0;
+
+		{
+			std::lock_guard<std::mutex> parked_lock(sched_machine->parked_mutex);
+
+			int64_t budget_time = (int64_t)sched_machine->budget_time_ns.load();
+
+			machine_budget_stats_t& stats = sched_machine->budget_stats;
+			stats.ticks++;
+			stats.last_used_ns = 0;
+			stats.last_steps = 0;
+
+			for (uint32_t i = 0; i < sched_machine->harts; i++)
+			{
+				sched_hart_t* hart = &sched_machine->hart_state[i];
+
+				int64_t remaining = hart->remaining_ns.load();
+
+				stats.last_used_ns += hart->used_ns.exchange(0);
+				stats.last_steps += hart->steps.exchange(0);
+
+				if (budget_time && remaining < 0)
+				{
+					overrun_ns += (uint64_t)-remaining;
+
+					// Carry the debt over so the average stays within budget, but never
+					// starve a hart for more than one tick because of a single long step
+					if (remaining < -budget_time) remaining = -budget_time;
+					hart->remaining_ns.store(budget_time + remaining);
+				}
+				else
+				{
+					hart->remaining_ns.store(budget_time);
+				}
+			}
+
+			stats.last_overrun_ns = overrun_ns;
+
+			if (overrun_ns)
+			{
+				stats.overruns++;
+				stats.overrun_ns += overrun_ns;
+			}
+
+			parked.swap(sched_machine->parked);
+			sched_machine->tick_pending.store(true);
+		}
+
+		sched_push_harts(sched_machine, parked);
+
+		// Unlisted machines have no handle to report them by
+		gmod_machine_handle_t handle = gmod_machine_get_handle(owner);
+
+		if (overrun_ns && handle)
+			out_overruns.push_back({ handle, overrun_ns });
+	}
+}
+
+void machine_scheduler_set_affinity(gmod_machine_t* machine, uint64_t core_mask)
+{
+	std::lock_guard<std::mutex> lock(sched_mutex);
+
+	auto it = sched_machines.find(machine);
+	if (it == sched_machines.end()) return;
+
+	// Queued tasks are moved over by the workers that pop them
+	it->second->affinity.store(core_mask);
+}
+
+void machine_scheduler_set_priority(gmod_machine_t* machine, uint32_t priority)
+{
+	if (priority >= SCHED_PRIORITIES) return;
+
+	std::shared_ptr<sched_machine_t> sched_machine;
+
+	{
+		std::lock_guard<std::mutex> lock(sched_mutex);
+
+		auto it = sched_machines.find(machine);
+		if (it == sched_machines.end()) return;
+
+		sched_machine = it->second;
+	}
+
+	// Queued tasks keep their place, they move to the new queue the next time they're pushed
+	uint32_t previous = sched_machine->priority.exchange(priority);
+
+	if (priority == GMOD_PRIORITY_INTERACTIVE && previous != priority)
+	{
+		// Don't leave parked harts waiting for the old, longer tick period
+		sched_machine->next_tick_ns.store(0);
+		sched_wake_machine(sched_machine.get());
+	}
+}
+
+void machine_scheduler_set_reserved_cores(uint64_t core_mask)
+{
+	std::lock_guard<std::mutex> lock(sched_mutex);
+
+	sched_reserved_cores = core_mask;
+
+	if (sched_running.load())
+		sched_pin_workers();
+}
+
+uint64_t machine_scheduler_get_worker_cores()
+{
+	std::lock_guard<std::mutex> lock(sched_mutex);
+
+	uint64_t cores = 0;
+	for (auto& worker : sched_workers)
+		cores |= worker->core_mask.load();
+
+	return cores;
+}
+
+void machine_scheduler_wake(gmod_machine_t* machine)
+{
+	std::shared_ptr<sched_machine_t> sched_machine;
+
+	{
+		std::lock_guard<std::mutex> lock(sched_mutex);
+
+		auto it = sched_machines.find(machine);
+		if (it == sched_machines.end()) return;
+
+		sched_machine = it->second;
+	}
+
+	// Deliver the IRQ with the next step instead of waiting for the event tick
+	sched_machine->next_tick_ns.store(0);
+
+	sched_wake_machine(sched_machine.get());
+}
+
+void machine_scheduler_sample(std::vector<machine_hart_sample_t>& out)
+{
+	std::lock_guard<std::mutex> lock(sched_mutex);
+
+	for (auto& [owner, machine] : sched_machines)
+	{
+		// Still allocated while scheduled, the machine may be gone once the lock is let go
+		gmod_machine_handle_t handle = gmod_machine_get_handle(owner);
+
+		for (uint32_t i = 0; i < machine->harts; i++)
+		{
+			sched_hart_t* hart = &machine->hart_state[i];
+
+			out.push_back({ owner, handle, i, hart->last_pc.load(std::memory_order_relaxed), hart->total_ns.load(), hart->idles.load() });
+		}
+	}
+}
+
+machine_scheduler_stats_t machine_scheduler_get_stats()
+{
+	std::lock_guard<std::mutex> lock(sched_mutex);
+
+	machine_scheduler_stats_t stats = {};
+
+	stats.workers = (uint32_t)sched_workers.size();
+	stats.machines = (uint32_t)sched_machines.size();
+	stats.tasks = (uint32_t)sched_queued.load();
+
+	for (auto& worker : sched_workers)
+	{
+		stats.steps += worker->steps.load();
+		stats.steals += worker->steals.load();
+		stats.busy_ns += worker->busy_ns.load();
+		stats.idle_ns += worker->idle_ns.load();
+		stats.idle_parks += worker->idle_parks.load();
+		stats.preemptions += worker->preemptions.load();
+	}
+
+	stats.idle_wakes = sched_idle_wakes.load();
+
+	return stats;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <gmod_machine.h>
+
+#include <stdint.h>
+
+#include <vector>
+
+typedef struct machine_scheduler_stats_t
+{
+	uint32_t workers;
+	uint32_t machines;
+	uint32_t tasks;
+
+	uint64_t steps;
+	uint64_t steals;
+	uint64_t busy_ns;
+	uint64_t idle_ns;
+
+	uint64_t idle_parks; // harts parked until the next event tick after going idle
+	uint64_t idle_wakes; // parked harts woken early by machine_scheduler_wake()
+
+	uint64_t preemptions; // slices cut short for a higher priority hart
+} machine_scheduler_stats_t;
+
+// Per-hart execution budget granted on every server tick, zero fields mean unlimited.
+// A machine with no budget at all is free-running.
+typedef struct machine_budget_t
+{
+	uint64_t time_ns;
+	uint32_t steps;
+} machine_budget_t;
+
+typedef struct machine_budget_stats_t
+{
+	uint64_t ticks;
+	uint64_t last_used_ns;  // host time used by all harts during the last tick
+	uint32_t last_steps;
+	uint64_t overruns;      // ticks where a hart went over its time budget
+	uint64_t overrun_ns;
+	uint64_t last_overrun_ns;
+} machine_budget_stats_t;
+
+typedef struct machine_time_stats_t
+{
+	uint64_t lag_ns;     // guest time owed, paid back at the catch-up rate
+	uint64_t held_ns;    // all harts were held back by a budget or CPU limit
+	uint64_t dropped_ns; // owed beyond the cap and never paid back
+} machine_time_stats_t;
+
+typedef struct machine_hart_sample_t
+{
+	gmod_machine_t* machine;
+	gmod_machine_handle_t handle; // taken while the machine was scheduled, 0 if unlisted
+	uint32_t hart_id;
+	uint64_t pc;      // after its last step
+	uint64_t used_ns; // host time spent stepping it so far
+	uint64_t idles;   // times it went idle, e.g. into WFI
+} machine_hart_sample_t;
+
+typedef struct machine_overrun_t
+{
+	gmod_machine_handle_t handle; // the machine may be freed before the overrun is handled
+	uint64_t overrun_ns;
+} machine_overrun_t;
+
+// Runs the harts of pooled machines on a fixed set of worker threads through
+// rvvm_external_step_machine(). Every hart is a task that lives in the run queue
+// of one worker, idle workers steal tasks from the back of the other queues. The workers are
+// started by the first machine_scheduler_add() unless started here beforehand.
+void machine_scheduler_init(uint32_t workers = 0);
+void machine_scheduler_shutdown();
+
+uint32_t machine_scheduler_get_workers();
+
+// Machine must be prepared with rvvm_external_init_single_step()
+bool machine_scheduler_add(gmod_machine_t* machine, const machine_budget_t* budget = nullptr, uint64_t affinity = 0, uint32_t priority = GMOD_PRIORITY_NORMAL);
+
+// Blocks until no worker is stepping the machine anymore
+void machine_scheduler_remove(gmod_machine_t* machine);
+
+// Workers always take the highest priority task first. Interactive harts run longer slices,
+// tick their events more often and cut lower priority slices short while they wait.
+void machine_scheduler_set_priority(gmod_machine_t* machine, uint32_t priority);
+
+// Workers are pinned to one host core each. A machine with an affinity mask only
+// runs on the workers pinned inside of it, zero or a mask no worker is pinned in allows every worker.
+void machine_scheduler_set_affinity(gmod_machine_t* machine, uint64_t core_mask);
+
+// Keeps the workers off these cores, e.g. for srcds itself
+void machine_scheduler_set_reserved_cores(uint64_t core_mask);
+uint64_t machine_scheduler_get_worker_cores();
+
+// Wakes harts parked in idle, call after injecting an IRQ into the machine
+void machine_scheduler_wake(gmod_machine_t* machine);
+
+bool machine_scheduler_contains(gmod_machine_t* machine);
+
+// Host time spent stepping the machine harts
+uint64_t machine_scheduler_get_cpu_ns(gmod_machine_t* machine);
+
+// Budgeted machines only run after being granted a tick, their harts are parked
+// once the budget is spent. Events are ticked once per grant instead of by wall clock.
+void machine_scheduler_set_budget(gmod_machine_t* machine, const machine_budget_t* budget);
+// Limits the host CPU time of all machine harts combined, in percent of one host core. Zero is unlimited.
+void machine_scheduler_set_cpu_limit(gmod_machine_t* machine, uint32_t cent);
+
+bool machine_scheduler_get_budget_stats(gmod_machine_t* machine, machine_budget_stats_t* out_stats);
+
+// Virtual time: the guest clock moves on by the time between server ticks, up to a cap, minus
+// the time all harts were held back by their budget or CPU limit. What it falls behind by is
+// paid back at catchup_cent percent of real time at most. The clock is only set between steps,
+// never backwards from what the guest may have read.
+void machine_scheduler_set_virtual_time(gmod_machine_t* machine, bool enable, uint32_t catchup_cent);
+bool machine_scheduler_get_time_stats(gmod_machine_t* machine, machine_time_stats_t* out_stats);
+
+// Called once per server tick: refills budgets, moves virtual time on and collects machines that overran the previous one
+void machine_scheduler_tick(std::vector<machine_overrun_t>& out_overruns);
+
+// Appends the harts of all scheduled machines, for watching them from another thread
+void machine_scheduler_sample(std::vector<machine_hart_sample_t>& out);
+
+machine_scheduler_stats_t machine_scheduler_get_stats();
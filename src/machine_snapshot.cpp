@@ -0,0 +1,441 @@
+#include "machine_snapshot.h"
+
+#include "rvvm_machine_prefix.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+#include <Windows.h>
+#include <compressapi.h>
+
+#define SNAPSHOT_MAGIC "GMRVSNAP"
+
+#define SNAPSHOT_PAGE_SIZE    4096
+#define SNAPSHOT_CHUNK_PAGES  64
+#define SNAPSHOT_CHUNK_SIZE   (SNAPSHOT_PAGE_SIZE * SNAPSHOT_CHUNK_PAGES)
+#define SNAPSHOT_CHUNK_END    UINT64_MAX
+
+#define SNAPSHOT_HART_REGS 65 // x0-x31, f0-f31, pc
+
+typedef struct snapshot_header_t
+{
+	char magic[8];
+	uint32_t version;
+
+	uint64_t mem_base;
+	uint64_t mem_size;
+	uint32_t harts;
+
+	uint64_t time;
+	uint64_t time_freq;
+} snapshot_header_t;
+
+typedef struct snapshot_chunk_t
+{
+	uint64_t first_page;
+	uint64_t page_mask;   // bit N set if page first_page + N is stored
+	uint32_t raw_size;
+	uint32_t packed_size; // equal to raw_size if the pages are stored as is
+} snapshot_chunk_t;
+
+typedef struct snapshot_file_deleter_t
+{
+	void operator()(FILE* file) const { fclose(file); }
+} snapshot_file_deleter_t;
+
+typedef std::unique_ptr<FILE, snapshot_file_deleter_t> snapshot_file_t;
+
+static bool snapshot_write(FILE* file, const void* data, size_t size)
+{
+	return fwrite(data, 1, size, file) == size;
+}
+
+static bool snapshot_read(FILE* file, void* data, size_t size)
+{
+	return fread(data, 1, size, file) == size;
+}
+
+static bool snapshot_page_is_zero(const uint8_t* page)
+{
+	const uint64_t* words = (const uint64_t*)page;
+
+	for (size_t i = 0; i < SNAPSHOT_PAGE_SIZE / sizeof(uint64_t); i++)
+		if (words[i]) return false;
+
+	return true;
+}
+
+// Returns pages to the OS as zero pages where possible instead of touching them
+static void snapshot_zero_pages(uint8_t* data, size_t size)
+{
+	if (!size) return;
+
+	if (VirtualFree(data, size, MEM_DECOMMIT) && VirtualAlloc(data, size, MEM_COMMIT, PAGE_READWRITE))
+		return;
+
+	memset(data, 0, size);
+}
+
+static uint32_t snapshot_page_count(uint64_t page_mask)
+{
+	uint32_t count = 0;
+
+	for (; page_mask; page_mask &= page_mask - 1)
+		count++;
+
+	return count;
+}
+
+static bool snapshot_read_header(FILE* file, snapshot_header_t* header)
+{
+	if (!snapshot_read(file, header, sizeof(*header))) return false;
+
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) return false;
+	if (header->version != MACHINE_SNAPSHOT_VERSION) return false;
+
+	return header->harts != 0 && header->mem_size % SNAPSHOT_PAGE_SIZE == 0;
+}
+
+// Reads the header and the registers of all harts
+static bool snapshot_read_head(FILE* file, snapshot_header_t* header, std::vector<uint64_t>* regs)
+{
+	if (!snapshot_read_header(file, header)) return false;
+
+	regs->resize((size_t)header->harts * SNAPSHOT_HART_REGS);
+
+	return snapshot_read(file, regs->data(), regs->size() * sizeof(uint64_t));
+}
+
+// Collects the non-zero pages of one chunk at a time and writes them out compressed
+typedef struct snapshot_writer_t
+{
+	FILE* file;
+	COMPRESSOR_HANDLE compressor;
+
+	std::unique_ptr<uint8_t[]> raw;
+	std::unique_ptr<uint8_t[]> packed;
+
+	snapshot_chunk_t chunk;
+} snapshot_writer_t;
+
+static void snapshot_writer_init(snapshot_writer_t* writer, FILE* file)
+{
+	writer->file = file;
+
+	// Chunks are stored uncompressed if the compressor isn't available
+	if (!CreateCompressor(COMPRESS_ALGORITHM_XPRESS_HUFF | COMPRESS_RAW, nullptr, &writer->compressor))
+		writer->compressor = nullptr;
+
+	writer->raw = std::make_unique<uint8_t[]>(SNAPSHOT_CHUNK_SIZE);
+	writer->packed = std::make_unique<uint8_t[]>(SNAPSHOT_CHUNK_SIZE);
+
+	writer->chunk = {};
+}
+
+static void snapshot_writer_close(snapshot_writer_t* writer)
+{
+	if (writer->compressor)
+		CloseCompressor(writer->compressor);
+
+	writer->compressor = nullptr;
+}
+
+static void snapshot_writer_begin(snapshot_writer_t* writer, uint64_t first_page)
+{
+	writer->chunk = {};
+	writer->chunk.first_page = first_page;
+}
+
+static void snapshot_writer_add(snapshot_writer_t* writer, uint32_t index, const uint8_t* page)
+{
+	if (snapshot_page_is_zero(page)) return;
+
+	memcpy(writer->raw.get() + writer->chunk.raw_size, page, SNAPSHOT_PAGE_SIZE);
+
+	writer->chunk.raw_size += SNAPSHOT_PAGE_SIZE;
+	writer->chunk.page_mask |= 1ULL << index;
+}
+
+static bool snapshot_writer_flush(snapshot_writer_t* writer)
+{
+	snapshot_chunk_t& chunk = writer->chunk;
+
+	if (!chunk.page_mask) return true;
+
+	SIZE_T packed_size = 0;
+	const uint8_t* data = writer->raw.get();
+
+	if (writer->compressor && Compress(writer->compressor, writer->raw.get(), chunk.raw_size, writer->packed.get(), chunk.raw_size, &packed_size) && packed_size < chunk.raw_size)
+	{
+		chunk.packed_size = (uint32_t)packed_size;
+		data = writer->packed.get();
+	}
+	else
+		chunk.packed_size = chunk.raw_size;
+
+	return snapshot_write(writer->file, &chunk, sizeof(chunk)) && snapshot_write(writer->file, data, chunk.packed_size);
+}
+
+static bool snapshot_writer_finish(snapshot_writer_t* writer)
+{
+	snapshot_chunk_t end = {};
+	end.first_page = SNAPSHOT_CHUNK_END;
+
+	return snapshot_write(writer->file, &end, sizeof(end));
+}
+
+static void snapshot_append(std::vector<uint8_t>& out, const void* data, size_t size)
+{
+	out.insert(out.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+}
+
+static bool snapshot_append_regs(rvvm_machine_t* machine, uint32_t harts, std::vector<uint8_t>& out)
+{
+	for (uint32_t i = 0; i < harts; i++)
+	{
+		rvvm_hart_t* hart = rvvm_machine_get_hart(machine, i);
+		if (!hart) return false;
+
+		uint64_t regs[SNAPSHOT_HART_REGS];
+
+		for (size_t reg = 0; reg < 32; reg++)
+		{
+			regs[reg] = rvvm_read_cpu_reg(hart, RVVM_REGID_X0 + reg);
+			regs[32 + reg] = rvvm_read_cpu_reg(hart, RVVM_REGID_F0 + reg);
+		}
+
+		regs[64] = rvvm_read_cpu_reg(hart, RVVM_REGID_PC);
+
+		snapshot_append(out, regs, sizeof(regs));
+	}
+
+	return true;
+}
+
+// Puts the registers and timer back once RAM holds what goes with them
+static bool snapshot_restore_regs(rvvm_machine_t* machine, const uint64_t* regs, uint32_t harts, uint64_t time, uint64_t time_freq)
+{
+	for (uint32_t i = 0; i < harts; i++)
+	{
+		rvvm_hart_t* hart = rvvm_machine_get_hart(machine, i);
+		if (!hart) return false;
+
+		uint64_t hart_regs[SNAPSHOT_HART_REGS];
+		memcpy(hart_regs, regs + (size_t)i * SNAPSHOT_HART_REGS, sizeof(hart_regs));
+
+		for (size_t reg = 0; reg < 32; reg++)
+		{
+			rvvm_write_cpu_reg(hart, RVVM_REGID_X0 + reg, (rvvm_addr_t)hart_regs[reg]);
+			rvvm_write_cpu_reg(hart, RVVM_REGID_F0 + reg, (rvvm_addr_t)hart_regs[32 + reg]);
+		}
+
+		rvvm_write_cpu_reg(hart, RVVM_REGID_PC, (rvvm_addr_t)hart_regs[64]);
+	}
+
+	// The code in RAM changed under the JIT
+	rvvm_flush_icache(machine, rvvm_get_opt(machine, RVVM_OPT_MEM_BASE), (size_t)rvvm_get_opt(machine, RVVM_OPT_MEM_SIZE));
+
+	if (rvvm_machine_prefix(machine)->timer.freq == time_freq)
+		rvvm_machine_set_time(machine, time);
+
+	return true;
+}
+
+// Writes everything but the RAM, the machine must be paused
+static bool snapshot_write_head(FILE* file, rvvm_machine_t* machine, const snapshot_header_t& header)
+{
+	std::vector<uint8_t> head;
+
+	snapshot_append(head, &header, sizeof(header));
+
+	return snapshot_append_regs(machine, header.harts, head) && snapshot_write(file, head.data(), head.size());
+}
+
+bool machine_snapshot_save(rvvm_machine_t* machine, const char* path)
+{
+	if (!machine || !path) return false;
+
+	snapshot_header_t header = {};
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = MACHINE_SNAPSHOT_VERSION;
+	header.mem_base = rvvm_get_opt(machine, RVVM_OPT_MEM_BASE);
+	header.mem_size = rvvm_get_opt(machine, RVVM_OPT_MEM_SIZE);
+	header.harts = (uint32_t)rvvm_get_opt(machine, RVVM_OPT_HART_COUNT);
+	header.time = rvvm_machine_get_time(machine);
+	header.time_freq = rvvm_machine_prefix(machine)->timer.freq;
+
+	uint8_t* mem = (uint8_t*)rvvm_get_dma_ptr(machine, header.mem_base, (size_t)header.mem_size);
+	if (!mem || header.mem_size % SNAPSHOT_PAGE_SIZE != 0) return false;
+
+	snapshot_file_t file(fopen(path, "wb"));
+	if (!file) return false;
+
+	setvbuf(file.get(), nullptr, _IOFBF, 1 << 20);
+
+	if (!snapshot_write_head(file.get(), machine, header)) return false;
+
+	snapshot_writer_t writer;
+	snapshot_writer_init(&writer, file.get());
+
+	uint64_t pages = header.mem_size / SNAPSHOT_PAGE_SIZE;
+	bool ok = true;
+
+	for (uint64_t first = 0; first < pages && ok; first += SNAPSHOT_CHUNK_PAGES)
+	{
+		snapshot_writer_begin(&writer, first);
+
+		for (uint32_t i = 0; i < SNAPSHOT_CHUNK_PAGES && first + i < pages; i++)
+			snapshot_writer_add(&writer, i, mem + (first + i) * SNAPSHOT_PAGE_SIZE);
+
+		ok = snapshot_writer_flush(&writer);
+	}
+
+	snapshot_writer_close(&writer);
+
+	return ok && snapshot_writer_finish(&writer);
+}
+
+// Reads the chunks of a file back in order
+typedef struct snapshot_reader_t
+{
+	FILE* file;
+	DECOMPRESSOR_HANDLE decompressor;
+
+	std::unique_ptr<uint8_t[]> raw;
+	std::unique_ptr<uint8_t[]> packed;
+
+	uint64_t pages; // of guest RAM
+
+	snapshot_chunk_t chunk;
+	const uint8_t* data; // pages of the current chunk in page_mask order
+} snapshot_reader_t;
+
+static bool snapshot_reader_init(snapshot_reader_t* reader, FILE* file, uint64_t pages)
+{
+	reader->file = file;
+	reader->pages = pages;
+	reader->chunk = {};
+	reader->data = nullptr;
+
+	if (!CreateDecompressor(COMPRESS_ALGORITHM_XPRESS_HUFF | COMPRESS_RAW, nullptr, &reader->decompressor))
+		return false;
+
+	reader->raw = std::make_unique<uint8_t[]>(SNAPSHOT_CHUNK_SIZE);
+	reader->packed = std::make_unique<uint8_t[]>(SNAPSHOT_CHUNK_SIZE);
+
+	return true;
+}
+
+static void snapshot_reader_close(snapshot_reader_t* reader)
+{
+	if (reader->decompressor)
+		CloseDecompressor(reader->decompressor);
+
+	reader->decompressor = nullptr;
+}
+
+// False if the file is damaged, chunk.first_page is SNAPSHOT_CHUNK_END after the last chunk
+static bool snapshot_reader_next(snapshot_reader_t* reader)
+{
+	snapshot_chunk_t& chunk = reader->chunk;
+
+	if (!snapshot_read(reader->file, &chunk, sizeof(chunk))) return false;
+
+	if (chunk.first_page == SNAPSHOT_CHUNK_END) return true;
+
+	if (chunk.first_page >= reader->pages) return false;
+	if (chunk.raw_size != snapshot_page_count(chunk.page_mask) * SNAPSHOT_PAGE_SIZE || chunk.packed_size > chunk.raw_size) return false;
+	if (reader->pages - chunk.first_page < SNAPSHOT_CHUNK_PAGES && chunk.page_mask >> (reader->pages - chunk.first_page)) return false;
+
+	if (!snapshot_read(reader->file, reader->packed.get(), chunk.packed_size)) return false;
+
+	reader->data = reader->packed.get();
+
+	if (chunk.packed_size < chunk.raw_size)
+	{
+		SIZE_T raw_size = 0;
+		if (!Decompress(reader->decompressor, reader->packed.get(), chunk.packed_size, reader->raw.get(), chunk.raw_size, &raw_size) || raw_size != chunk.raw_size)
+			return false;
+
+		reader->data = reader->raw.get();
+	}
+
+	return true;
+}
+
+// Copies the stored pages into RAM and zeroes the ones it doesn't store
+static bool snapshot_load_pages(snapshot_reader_t* reader, uint8_t* mem)
+{
+	uint64_t next_page = 0; // pages below were either loaded or zeroed
+
+	for (;;)
+	{
+		if (!snapshot_reader_next(reader)) return false;
+
+		const snapshot_chunk_t& chunk = reader->chunk;
+
+		if (chunk.first_page == SNAPSHOT_CHUNK_END)
+		{
+			snapshot_zero_pages(mem + next_page * SNAPSHOT_PAGE_SIZE, (size_t)((reader->pages - next_page) * SNAPSHOT_PAGE_SIZE));
+
+			return true;
+		}
+
+		if (chunk.first_page < next_page) return false;
+
+		const uint8_t* data = reader->data;
+
+		for (uint64_t i = 0; i < SNAPSHOT_CHUNK_PAGES; i++)
+		{
+			uint64_t page = chunk.first_page + i;
+
+			if (!(chunk.page_mask & (1ULL << i))) continue;
+
+			snapshot_zero_pages(mem + next_page * SNAPSHOT_PAGE_SIZE, (size_t)((page - next_page) * SNAPSHOT_PAGE_SIZE));
+
+			memcpy(mem + page * SNAPSHOT_PAGE_SIZE, data, SNAPSHOT_PAGE_SIZE);
+			data += SNAPSHOT_PAGE_SIZE;
+
+			next_page = page + 1;
+		}
+	}
+}
+
+void machine_snapshot_release_ram(uint8_t* mem, size_t size)
+{
+	if (mem)
+		snapshot_zero_pages(mem, size);
+}
+
+bool machine_snapshot_load(rvvm_machine_t* machine, const char* path)
+{
+	if (!machine || !path) return false;
+
+	snapshot_file_t file(fopen(path, "rb"));
+	if (!file) return false;
+
+	setvbuf(file.get(), nullptr, _IOFBF, 1 << 20);
+
+	snapshot_header_t header;
+	std::vector<uint64_t> regs;
+	if (!snapshot_read_head(file.get(), &header, &regs)) return false;
+
+	if (rvvm_get_opt(machine, RVVM_OPT_MEM_BASE) != header.mem_base) return false;
+	if (rvvm_get_opt(machine, RVVM_OPT_MEM_SIZE) != header.mem_size) return false;
+	if (rvvm_get_opt(machine, RVVM_OPT_HART_COUNT) != header.harts) return false;
+
+	uint8_t* mem = (uint8_t*)rvvm_get_dma_ptr(machine, header.mem_base, (size_t)header.mem_size);
+	if (!mem) return false;
+
+	snapshot_reader_t reader;
+	if (!snapshot_reader_init(&reader, file.get(), header.mem_size / SNAPSHOT_PAGE_SIZE)) return false;
+
+	bool ok = snapshot_load_pages(&reader, mem);
+
+	snapshot_reader_close(&reader);
+
+	return ok && snapshot_restore_regs(machine, regs.data(), header.harts, header.time, header.time_freq);
+}
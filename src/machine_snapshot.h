@@ -0,0 +1,24 @@
+#pragma once
+
+#include <rvvmlib.h>
+
+#include <stdint.h>
+
+#define MACHINE_SNAPSHOT_VERSION 4
+
+// Snapshot file layout, all fields little-endian:
+//   header, per hart x0-x31, f0-f31, pc as uint64_t,
+//   then RAM chunks of up to 64 pages, each followed by its non-zero pages
+//   compressed with XPRESS, or stored when that doesn't help. Zero pages are
+//   never written, a chunk with first_page == UINT64_MAX ends the file.
+
+// Saves the guest RAM, hart registers and the machine timer, the machine must be paused.
+// librvvm has no access to CSRs or device state, so the file only brings the guest back into
+// the very machine it was taken from, as hibernation does.
+bool machine_snapshot_save(rvvm_machine_t* machine, const char* path);
+
+// Gives guest RAM back to the OS, it reads as zeroes afterwards
+void machine_snapshot_release_ram(uint8_t* mem, size_t size);
+
+// Loads the state back into the machine it was saved from, which must be paused and powered
+bool machine_snapshot_load(rvvm_machine_t* machine, const char* path);
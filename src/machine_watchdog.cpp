@@ -0,0 +1,405 @@
+#include "machine_watchdog.h"
+
+#include "machine_scheduler.h"
+#include "hart_threads.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+typedef std::chrono::steady_clock watchdog_clock;
+
+typedef struct watchdog_hart_t
+{
+	uint64_t begin_ns;    // host time the hart had run for when the window began
+	uint64_t begin_idles;
+	uint64_t last_pc;
+	uint32_t samples;
+	std::unordered_map<uint64_t, uint32_t> pages; // PC samples per 4 KiB page
+} watchdog_hart_t;
+
+typedef struct watchdog_machine_t
+{
+	watchdog_clock::time_point begin;
+	std::vector<watchdog_hart_t> harts;
+	std::vector<uint64_t> threads_ns; // CPU time of each hart thread when the window began, threaded machines only
+	uint32_t strikes;
+	bool threaded;
+	bool seen;
+} watchdog_machine_t;
+
+static std::thread watchdog_thread;
+static std::atomic<bool> watchdog_active = false;
+static std::mutex watchdog_wait_mutex;
+static std::condition_variable watchdog_wait_cond;
+
+static std::mutex watchdog_mutex; // guards watchdog_reports
+static std::vector<machine_watchdog_report_t> watchdog_reports;
+
+static void watchdog_begin_window(watchdog_machine_t& state, watchdog_clock::time_point now)
+{
+	state.begin = now;
+
+	for (watchdog_hart_t& hart : state.harts)
+	{
+		hart.samples = 0;
+		hart.pages.clear();
+	}
+}
+
+// Nearly all PC samples of the window fell into the same page
+static bool watchdog_confined(const watchdog_hart_t& hart)
+{
+	if (!hart.samples) return false;
+
+	uint32_t hottest = 0;
+
+	for (auto& [page, count] : hart.pages)
+		hottest = std::max(hottest, count);
+
+	return hottest * 100 >= hart.samples * MACHINE_WATCHDOG_CONFINED_CENT;
+}
+
+// Ends the window of a machine, returns false if none of its harts was stuck
+static bool watchdog_judge(watchdog_machine_t& state, const machine_hart_sample_t* samples, double window_ms, machine_watchdog_report_t* out_report)
+{
+	for (uint32_t i = 0; i < state.harts.size(); i++)
+	{
+		watchdog_hart_t& hart = state.harts[i];
+		const machine_hart_sample_t& sample = samples[i];
+
+		double busy_ms = (double)(sample.used_ns - hart.begin_ns) / 1e6;
+
+		bool idled = sample.idles != hart.begin_idles;
+
+		hart.begin_ns = sample.used_ns;
+		hart.begin_idles = sample.idles;
+
+		if (idled || busy_ms < MACHINE_WATCHDOG_MIN_BUSY_MS || !watchdog_confined(hart)) continue;
+
+		out_report->hart_id = i;
+		out_report->pc = hart.last_pc;
+		out_report->busy_cent = (uint32_t)(busy_ms / window_ms * 100.0);
+
+		return true;
+	}
+
+	return false;
+}
+
+// Same for a threaded machine. Which thread runs which hart isn't known and harts idling in WFI
+// look confined as well, so confined harts only count as stuck if at least as many hart threads
+// were busy for the whole window.
+static bool watchdog_judge_threads(watchdog_machine_t& state, const std::vector<uint64_t>& threads_ns, double window_ms, machine_watchdog_report_t* out_report)
+{
+	std::vector<double> busy_ms;
+
+	for (size_t i = 0; i < threads_ns.size() && i < state.threads_ns.size(); i++)
+		busy_ms.push_back((double)(threads_ns[i] - state.threads_ns[i]) / 1e6);
+
+	state.threads_ns = threads_ns;
+
+	std::sort(busy_ms.begin(), busy_ms.end(), std::greater<double>());
+
+	uint32_t confined = 0;
+	uint32_t first = 0;
+
+	for (uint32_t i = 0; i < state.harts.size(); i++)
+	{
+		if (!watchdog_confined(state.harts[i])) continue;
+
+		if (!confined++)
+			first = i;
+	}
+
+	if (!confined || busy_ms.size() < confined || busy_ms[confined - 1] < MACHINE_WATCHDOG_MIN_BUSY_MS) return false;
+
+	out_report->hart_id = first;
+	out_report->pc = state.harts[first].last_pc;
+	out_report->busy_cent = (uint32_t)(busy_ms[confined - 1] / window_ms * 100.0);
+
+	return true;
+}
+
+// Counts a judged window towards the strikes of a machine, a window that wasn't stuck clears them
+static void watchdog_verdict(watchdog_machine_t& state, bool stuck, machine_watchdog_report_t& report, std::vector<machine_watchdog_report_t>& reports)
+{
+	if (stuck)
+	{
+		report.strikes = ++state.strikes;
+		reports.push_back(report);
+	}
+	else if (state.strikes)
+	{
+		state.strikes = 0;
+		reports.push_back(report);
+	}
+}
+
+static void watchdog_thread_func()
+{
+	std::unordered_map<gmod_machine_handle_t, watchdog_machine_t> machines;
+	std::vector<machine_hart_sample_t> samples;
+	std::vector<hart_threads_sample_t> threaded;
+
+	while (watchdog_active.load())
+	{
+		{
+			std::unique_lock<std::mutex> lock(watchdog_wait_mutex);
+			watchdog_wait_cond.wait_for(lock, std::chrono::milliseconds(MACHINE_WATCHDOG_SAMPLE_MS), [] { return !watchdog_active.load(); });
+		}
+
+		if (!watchdog_active.load()) break;
+
+		samples.clear();
+		machine_scheduler_sample(samples);
+
+		threaded.clear();
+		hart_threads_sample(threaded);
+
+		watchdog_clock::time_point now = watchdog_clock::now();
+
+		for (auto& [handle, state] : machines)
+			state.seen = false;
+
+		std::vector<machine_watchdog_report_t> reports;
+
+		// Harts of a machine come one after another
+		for (size_t i = 0; i < samples.size();)
+		{
+			gmod_machine_t* machine = samples[i].machine;
+			gmod_machine_handle_t handle = samples[i].handle;
+
+			size_t count = 1;
+			while (i + count < samples.size() && samples[i + count].machine == machine)
+				count++;
+
+			// Nothing to report it by
+			if (!handle)
+			{
+				i += count;
+				continue;
+			}
+
+			auto [it, added] = machines.try_emplace(handle);
+			watchdog_machine_t& state = it->second;
+
+			if (added || state.threaded || state.harts.size() != count)
+			{
+				state.harts.assign(count, {});
+				state.strikes = 0;
+				state.threaded = false;
+
+				for (size_t hart = 0; hart < count; hart++)
+				{
+					state.harts[hart].begin_ns = samples[i + hart].used_ns;
+					state.harts[hart].begin_idles = samples[i + hart].idles;
+				}
+
+				watchdog_begin_window(state, now);
+			}
+
+			state.seen = true;
+
+			for (size_t hart = 0; hart < count; hart++)
+			{
+				watchdog_hart_t& hart_state = state.harts[hart];
+
+				hart_state.last_pc = samples[i + hart].pc;
+				hart_state.pages[samples[i + hart].pc >> 12]++;
+				hart_state.samples++;
+			}
+
+			double window_ms = std::chrono::duration<double, std::milli>(now - state.begin).count();
+
+			if (window_ms >= MACHINE_WATCHDOG_WINDOW_MS)
+			{
+				machine_watchdog_report_t report = {};
+				report.handle = handle;
+
+				watchdog_verdict(state, watchdog_judge(state, &samples[i], window_ms, &report), report, reports);
+				watchdog_begin_window(state, now);
+			}
+
+			i += count;
+		}
+
+		for (const hart_threads_sample_t& sample : threaded)
+		{
+			if (!sample.handle || sample.pcs.empty()) continue;
+
+			auto [it, added] = machines.try_emplace(sample.handle);
+			watchdog_machine_t& state = it->second;
+
+			if (added || !state.threaded || state.harts.size() != sample.pcs.size())
+			{
+				state.harts.assign(sample.pcs.size(), {});
+				state.threads_ns = sample.thread_ns;
+				state.strikes = 0;
+				state.threaded = true;
+
+				watchdog_begin_window(state, now);
+			}
+
+			state.seen = true;
+
+			for (size_t hart = 0; hart < sample.pcs.size(); hart++)
+			{
+				watchdog_hart_t& hart_state = state.harts[hart];
+
+				hart_state.last_pc = sample.pcs[hart];
+				hart_state.pages[sample.pcs[hart] >> 12]++;
+				hart_state.samples++;
+			}
+
+			double window_ms = std::chrono::duration<double, std::milli>(now - state.begin).count();
+
+			if (window_ms >= MACHINE_WATCHDOG_WINDOW_MS)
+			{
+				machine_watchdog_report_t report = {};
+				report.handle = sample.handle;
+
+				watchdog_verdict(state, watchdog_judge_threads(state, sample.thread_ns, window_ms, &report), report, reports);
+				watchdog_begin_window(state, now);
+			}
+		}
+
+		// Paused or gone, their state starts over once they're back
+		for (auto it = machines.begin(); it != machines.end();)
+		{
+			if (!it->second.seen)
+				it = machines.erase(it);
+			else
+				++it;
+		}
+
+		if (!reports.empty())
+		{
+			std::lock_guard<std::mutex> lock(watchdog_mutex);
+			watchdog_reports.insert(watchdog_reports.end(), reports.begin(), reports.end());
+		}
+	}
+}
+
+void machine_watchdog_start()
+{
+	if (watchdog_active.exchange(true)) return;
+
+	watchdog_thread = std::thread(watchdog_thread_func);
+}
+
+void machine_watchdog_stop()
+{
+	if (!watchdog_active.exchange(false)) return;
+
+	{
+		std::lock_guard<std::mutex> lock(watchdog_wait_mutex);
+		watchdog_wait_cond.notify_all();
+	}
+
+	if (watchdog_thread.joinable())
+		watchdog_thread.join();
+
+	std::lock_guard<std::mutex> lock(watchdog_mutex);
+	watchdog_reports.clear();
+}
+
+bool machine_watchdog_running()
+{
+	return watchdog_active.load();
+}
+
+std::vector<machine_watchdog_report_t> machine_watchdog_poll()
+{
+	std::lock_guard<std::mutex> lock(watchdog_mutex);
+
+	std::vector<machine_watchdog_report_t> reports;
+	reports.swap(watchdog_reports);
+
+	return reports;
+}
+
+typedef struct machine_symbol_t
+{
+	uint64_t addr;
+	std::string name;
+} machine_symbol_t;
+
+typedef struct machine_symbols_t
+{
+	std::vector<machine_symbol_t> list; // sorted by address
+} machine_symbols_t;
+
+machine_symbols_t* machine_symbols_load(const char* path)
+{
+	std::ifstream file(path);
+
+	if (!file) return nullptr;
+
+	machine_symbols_t* symbols = new machine_symbols_t();
+
+	std::string line;
+
+	while (std::getline(file, line))
+	{
+		std::istringstream fields(line);
+
+		std::string addr, type, name;
+
+		if (!(fields >> addr >> type >> name)) continue;
+
+		char* end = nullptr;
+		uint64_t value = strtoull(addr.c_str(), &end, 16);
+
+		if (end == addr.c_str() || *end) continue;
+
+		symbols->list.push_back({ value, name });
+	}
+
+	std::stable_sort(symbols->list.begin(), symbols->list.end(), [](const machine_symbol_t& a, const machine_symbol_t& b) {
+		return a.addr < b.addr;
+	});
+
+	if (symbols->list.empty())
+	{
+		delete symbols;
+		return nullptr;
+	}
+
+	return symbols;
+}
+
+bool machine_symbols_lookup(machine_symbols_t* symbols, uint64_t addr, std::string& out)
+{
+	if (!symbols) return false;
+
+	auto it = std::upper_bound(symbols->list.begin(), symbols->list.end(), addr, [](uint64_t addr, const machine_symbol_t& symbol) {
+		return addr < symbol.addr;
+	});
+
+	if (it == symbols->list.begin()) return false;
+
+	--it;
+
+	char offset[32];
+	snprintf(offset, sizeof(offset), "+0x%llx", (unsigned long long)(addr - it->addr));
+
+	out = it->name + offset;
+
+	return true;
+}
+
+void machine_symbols_free(machine_symbols_t* symbols)
+{
+	delete symbols;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <gmod_machine.h>
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#define MACHINE_WATCHDOG_SAMPLE_MS     20
+#define MACHINE_WATCHDOG_WINDOW_MS     2000
+#define MACHINE_WATCHDOG_CONFINED_CENT 90  // of the PC samples in the hottest 4 KiB page for a hart to count as stuck
+#define MACHINE_WATCHDOG_MIN_BUSY_MS   100 // host time a hart must have run during the window
+
+typedef struct machine_watchdog_report_t
+{
+	gmod_machine_handle_t handle;
+	uint32_t hart_id;   // the first stuck hart
+	uint64_t pc;        // where it was last seen
+	uint32_t busy_cent; // of one host core, over the window
+	uint32_t strikes;   // windows in a row the machine had a stuck hart, 0 once it stopped
+} machine_watchdog_report_t;
+
+// Samples the harts of scheduled and threaded machines from a thread of its own. A hart is stuck
+// for a window when it ran for a while without ever going idle and nearly all of its PC samples
+// fell into the same page. Unlisted machines aren't watched.
+void machine_watchdog_start();
+void machine_watchdog_stop();
+bool machine_watchdog_running();
+
+// Machines that were stuck for another window, or stopped being stuck, since the last call.
+// The machines may have been freed since, resolve the handles with gmod_machine_from_handle().
+std::vector<machine_watchdog_report_t> machine_watchdog_poll();
+
+typedef struct machine_symbols_t machine_symbols_t;
+
+// Reads a System.map style list of "address type name" lines
+machine_symbols_t* machine_symbols_load(const char* path);
+
+// name+0xoffset of the closest symbol at or below addr
+bool machine_symbols_lookup(machine_symbols_t* symbols, uint64_t addr, std::string& out);
+
+void machine_symbols_free(machine_symbols_t* symbols);
@@ -4,6 +4,8 @@
 
 #include <thread>
 #include <map>
+#include <memory>
+#include <functional>
 
 extern "C"
 {
@@ -16,6 +18,11 @@ extern "C"
 }
 
 #include "mmio_atomic.h"
+#include "event_loop.h"
+#include "machine_scheduler.h"
+#include "machine_pool.h"
+#include "async_queue.h"
+#include "image_cache.h"
 
 #include <vector>
 #include <string>
@@ -23,17 +30,136 @@ extern "C"
 
 #include "dev_manager.h"
 
+static int machine_mt = -1;
+
+// Machine userdata hold the handle next to the machine, which tells whether it was destroyed since
+typedef struct lua_machine_t
+{
+	gmod_machine_t* machine;
+	gmod_machine_handle_t handle;
+} lua_machine_t;
+
+static void push_machine(GarrysMod::Lua::ILuaBase* LUA, gmod_machine_t* machine)
+{
+	if (!machine)
+	{
+		LUA->PushBool(false);
+		return;
+	}
+
+	LUA->PushUserType_Value(lua_machine_t{ machine, gmod_machine_get_handle(machine) }, machine_mt);
+}
+
+// Functions taking a machine take its id or its userdata, which lets them double as its methods
+static gmod_machine_t* check_machine(GarrysMod::Lua::ILuaBase* LUA, int index)
+{
+	if (LUA->IsType(index, machine_mt))
+	{
+		lua_machine_t* ref = LUA->GetUserType<lua_machine_t>(index, machine_mt);
+
+		// Destroyed, possibly through its id
+		if (!ref || gmod_machine_from_handle(ref->handle) != ref->machine) return nullptr;
+
+		return ref->machine;
+	}
+
+	return get_machine((int)LUA->CheckNumber(index));
+}
+
+static void invalidate_machine(GarrysMod::Lua::ILuaBase* LUA, int index)
+{
+	if (LUA->IsType(index, machine_mt))
+		LUA->SetUserType(index, nullptr);
+}
+
+// Pushes hook.Run and the event name, the arguments go on top before hook_run_end().
+// Returns false with nothing pushed if the hook library isn't there.
+static bool hook_run_begin(GarrysMod::Lua::ILuaBase* LUA, const char* event)
+{
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+	LUA->GetField(-1, "hook");
+
+	if (!LUA->IsType(-1, GarrysMod::Lua::Type::Table))
+	{
+		LUA->Pop(2);
+		return false;
+	}
+
+	LUA->GetField(-1, "Run");
+
+	if (!LUA->IsType(-1, GarrysMod::Lua::Type::Function))
+	{
+		LUA->Pop(3);
+		return false;
+	}
+
+	LUA->PushString(event);
+
+	return true;
+}
+
+// A failing hook mustn't abort the caller
+static void hook_run_end(GarrysMod::Lua::ILuaBase* LUA, const char* event, int args)
+{
+	if (LUA->PCall(args + 1, 0, 0) != 0)
+	{
+		printf("riscv %s hook failed: %s\n", event, LUA->GetString(-1));
+		LUA->Pop();
+	}
+
+	LUA->Pop(2);
+}
+
 LUA_FUNCTION(create_machine)
 {
 	int id = LUA->CheckNumber(1);
+
+	// create_machine(id, template) hands out a machine of a warm pool, already started
+	if (LUA->IsType(2, GarrysMod::Lua::Type::String))
+	{
+		bool warm = false;
+		gmod_machine_t* machine = machine_pool_take(LUA->GetString(2), id, &warm);
+
+		push_machine(LUA, machine);
+		LUA->PushBool(warm);
+
+		return 2;
+	}
+
 	int ram_size = LUA->CheckNumber(2);
 	int harts_num = LUA->IsType(3, GarrysMod::Lua::Type::Number) ? LUA->GetNumber(3) : 1;
 	bool is_64bit = LUA->IsType(4, GarrysMod::Lua::Type::Bool) ? LUA->GetBool(4) : true;
 
-	gmod_machine_t* machine = gmod_machine_create(id, ram_size, harts_num, is_64bit);
+	uint64_t shortfall = ram_size > 0 && harts_num > 0 ? gmod_machine_memory_shortfall(ram_size, harts_num) : 0;
+
+	// Scripts get the first say on which machines go to make room
+	if (shortfall && hook_run_begin(LUA, "RISCV_MemoryPressure"))
+	{
+		LUA->PushNumber(id);
+		LUA->PushNumber((double)shortfall);
+
+		hook_run_end(LUA, "RISCV_MemoryPressure", 2);
+	}
+
+	push_machine(LUA, gmod_machine_create(id, ram_size, harts_num, is_64bit));
+
+	return 1;
+}
+
+// get_machine(id) returns the userdata of a machine created some other way, e.g. provisioned
+LUA_FUNCTION(get_machine_object)
+{
+	push_machine(LUA, check_machine(LUA, 1));
+
+	return 1;
+}
+
+LUA_FUNCTION(get_machine_id)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
 
 	if (machine)
-		LUA->PushBool(true);
+		LUA->PushNumber(gmod_machine_get_id(machine));
 	else
 		LUA->PushBool(false);
 
@@ -42,8 +168,7 @@ LUA_FUNCTION(create_machine)
 
 LUA_FUNCTION(is_machine_running)
 {
-	int id = LUA->CheckNumber(1);
-	gmod_machine_t* machine = get_machine(id);
+	gmod_machine_t* machine = check_machine(LUA, 1);
 
 	if (machine)
 		LUA->PushBool(gmod_machine_is_running(machine));
@@ -55,8 +180,7 @@ LUA_FUNCTION(is_machine_running)
 
 LUA_FUNCTION(is_machine_powered)
 {
-	int id = LUA->CheckNumber(1);
-	gmod_machine_t* machine = get_machine(id);
+	gmod_machine_t* machine = check_machine(LUA, 1);
 
 	if (machine)
 		LUA->PushBool(gmod_machine_is_powered(machine));
@@ -68,235 +192,1257 @@ LUA_FUNCTION(is_machine_powered)
 
 LUA_FUNCTION(is_machine_exists)
 {
-	int id = LUA->CheckNumber(1);
-	gmod_machine_t* machine = get_machine(id);
+	gmod_machine_t* machine = check_machine(LUA, 1);
+
+	if (machine)
+		LUA->PushBool(true);
+	else
+		LUA->PushBool(false);
+
+	return 1;
+}
+
+LUA_FUNCTION(destroy_machine)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+
+	gmod_machine_destroy(machine);
+	invalidate_machine(LUA, 1);
+
+	return 0;
+}
+
+LUA_FUNCTION(set_page_merge)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	bool enable = LUA->GetBool(2);
+
+	LUA->PushBool(gmod_machine_set_page_merge(machine, enable));
+
+	return 1;
+}
+
+LUA_FUNCTION(set_merge_scan_rate)
+{
+	uint32_t mb_per_sec = (uint32_t)LUA->CheckNumber(1);
+
+	gmod_machine_merge_set_scan_rate(mb_per_sec);
+
+	return 0;
+}
+
+LUA_FUNCTION(get_merge_stats)
+{
+	gmod_merge_stats_t stats;
+	gmod_machine_get_merge_stats(&stats);
+
+	LUA->CreateTable();
+
+	LUA->PushNumber(stats.machines);
+	LUA->SetField(-2, "machines");
+
+	LUA->PushNumber((double)stats.shared_blocks);
+	LUA->SetField(-2, "shared_blocks");
+
+	LUA->PushNumber((double)stats.merged_blocks);
+	LUA->SetField(-2, "merged_blocks");
+
+	LUA->PushNumber((double)stats.saved_bytes / (1024.0 * 1024.0));
+	LUA->SetField(-2, "saved_mb");
+
+	LUA->PushNumber((double)stats.merges);
+	LUA->SetField(-2, "merges");
+
+	LUA->PushNumber((double)stats.unmerges);
+	LUA->SetField(-2, "unmerges");
+
+	LUA->PushNumber((double)stats.scans);
+	LUA->SetField(-2, "scans");
+
+	return 1;
+}
+
+LUA_FUNCTION(set_image_cache_size)
+{
+	uint32_t mb = (uint32_t)LUA->CheckNumber(1);
+
+	gmod_machine_image_cache_set_max(mb);
+
+	return 0;
+}
+
+LUA_FUNCTION(get_image_cache_stats)
+{
+	gmod_image_cache_stats_t stats;
+	gmod_machine_get_image_cache_stats(&stats);
+
+	LUA->CreateTable();
+
+	LUA->PushNumber(stats.images);
+	LUA->SetField(-2, "images");
+
+	LUA->PushNumber((double)stats.bytes / (1024.0 * 1024.0));
+	LUA->SetField(-2, "size_mb");
+
+	LUA->PushNumber((double)stats.hits);
+	LUA->SetField(-2, "hits");
+
+	LUA->PushNumber((double)stats.misses);
+	LUA->SetField(-2, "misses");
+
+	LUA->PushNumber((double)stats.reloads);
+	LUA->SetField(-2, "reloads");
+
+	return 1;
+}
+
+LUA_FUNCTION(set_memory_limit)
+{
+	uint64_t mb = (uint64_t)LUA->CheckNumber(1);
+	int policy = LUA->IsType(2, GarrysMod::Lua::Type::Number) ? (int)LUA->GetNumber(2) : GMOD_ADMIT_REJECT;
+
+	gmod_machine_memory_set_limit(mb << 20, policy);
+
+	return 0;
+}
+
+LUA_FUNCTION(get_memory_stats)
+{
+	gmod_memory_stats_t stats;
+	gmod_machine_get_memory_stats(&stats);
+
+	LUA->CreateTable();
+
+	LUA->PushNumber((double)stats.limit_bytes / (1024.0 * 1024.0));
+	LUA->SetField(-2, "limit_mb");
+
+	LUA->PushNumber((double)stats.committed_bytes / (1024.0 * 1024.0));
+	LUA->SetField(-2, "committed_mb");
+
+	LUA->PushNumber(stats.machines);
+	LUA->SetField(-2, "machines");
+
+	LUA->PushNumber((double)stats.rejected);
+	LUA->SetField(-2, "rejected");
+
+	LUA->PushNumber((double)stats.downsized);
+	LUA->SetField(-2, "downsized");
+
+	LUA->PushNumber((double)stats.hibernated);
+	LUA->SetField(-2, "hibernated");
+
+	return 1;
+}
+
+LUA_FUNCTION(get_machine_memory)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+
+	LUA->PushNumber((double)gmod_machine_get_memory(machine) / (1024.0 * 1024.0));
+
+	return 1;
+}
+
+LUA_FUNCTION(set_ram_reclaim)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	bool enable = LUA->GetBool(2);
+
+	LUA->PushBool(gmod_machine_set_ram_reclaim(machine, enable));
+
+	return 1;
+}
+
+LUA_FUNCTION(set_reclaim_scan_rate)
+{
+	uint32_t mb_per_sec = (uint32_t)LUA->CheckNumber(1);
+
+	gmod_machine_reclaim_set_scan_rate(mb_per_sec);
+
+	return 0;
+}
+
+LUA_FUNCTION(get_reclaim_stats)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+
+	gmod_reclaim_stats_t stats;
+
+	if (!gmod_machine_get_reclaim_stats(machine, &stats))
+	{
+		LUA->PushNil();
+		return 1;
+	}
+
+	LUA->CreateTable();
+
+	LUA->PushNumber((double)stats.resident_bytes / (1024.0 * 1024.0));
+	LUA->SetField(-2, "resident_mb");
+
+	LUA->PushNumber((double)stats.zero_bytes / (1024.0 * 1024.0));
+	LUA->SetField(-2, "zero_mb");
+
+	LUA->PushNumber((double)stats.released_bytes / (1024.0 * 1024.0));
+	LUA->SetField(-2, "released_mb");
+
+	LUA->PushNumber((double)stats.scans);
+	LUA->SetField(-2, "scans");
+
+	LUA->PushNumber(stats.last_pause_us);
+	LUA->SetField(-2, "last_pause_us");
+
+	return 1;
+}
+
+LUA_FUNCTION(set_hibernation)
+{
+	const char* dir = LUA->IsType(1, GarrysMod::Lua::Type::String) ? LUA->GetString(1) : nullptr;
+	uint32_t idle_s = LUA->IsType(2, GarrysMod::Lua::Type::Number) ? (uint32_t)LUA->GetNumber(2) : 0;
+
+	gmod_machine_hibernation_set(dir, idle_s);
+
+	return 0;
+}
+
+LUA_FUNCTION(hibernate_machine)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+
+	LUA->PushBool(gmod_machine_hibernate(machine));
+
+	return 1;
+}
+
+LUA_FUNCTION(resume_machine)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+
+	LUA->PushBool(gmod_machine_resume(machine));
+
+	return 1;
+}
+
+LUA_FUNCTION(is_machine_hibernated)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+
+	LUA->PushBool(gmod_machine_is_hibernated(machine));
+
+	return 1;
+}
+
+LUA_FUNCTION(get_hibernation_stats)
+{
+	gmod_hibernation_stats_t stats;
+	gmod_machine_get_hibernation_stats(&stats);
+
+	LUA->CreateTable();
+
+	LUA->PushNumber(stats.hibernated);
+	LUA->SetField(-2, "hibernated");
+
+	LUA->PushNumber((double)stats.hibernations);
+	LUA->SetField(-2, "hibernations");
+
+	LUA->PushNumber((double)stats.resumes);
+	LUA->SetField(-2, "resumes");
+
+	LUA->PushNumber(stats.failures);
+	LUA->SetField(-2, "failures");
+
+	LUA->PushNumber(stats.last_resume_ms);
+	LUA->SetField(-2, "last_resume_ms");
+
+	return 1;
+}
+
+LUA_FUNCTION(load_bootrom)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	const char* path = LUA->CheckString(2);
+
+	if (machine)
+		LUA->PushBool(gmod_machine_load_bootrom(machine, path));
+	else
+		LUA->PushBool(false);
+
+	return 1;
+}
+
+LUA_FUNCTION(load_kernel)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	const char* path = LUA->CheckString(2);
+
+	if (machine)
+		LUA->PushBool(gmod_machine_load_kernel(machine, path));
+	else
+		LUA->PushBool(false);
+
+	return 1;
+}
+
+LUA_FUNCTION(set_cmdline)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	const char* cmdline = LUA->CheckString(2);
 
 	if (machine)
+	{
+		gmod_machine_set_cmdline(machine, cmdline);
 		LUA->PushBool(true);
+	}
 	else
 		LUA->PushBool(false);
 
 	return 1;
 }
 
-LUA_FUNCTION(destroy_machine)
+LUA_FUNCTION(append_cmdline)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	const char* cmdline = LUA->CheckString(2);
+
+	if (machine)
+	{
+		gmod_machine_append_cmdline(machine, cmdline);
+		LUA->PushBool(true);
+	}
+	else
+		LUA->PushBool(false);
+
+	return 1;
+}
+
+LUA_FUNCTION(dump_dtb)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	const char* path = LUA->CheckString(2);
+
+	if (machine)
+		LUA->PushBool(gmod_machine_dump_dtb(machine, path));
+	else
+		LUA->PushBool(false);
+
+	return 1;
+}
+
+LUA_FUNCTION(load_dtb)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	const char* path = LUA->CheckString(2);
+
+	if (machine)
+		LUA->PushBool(gmod_machine_load_dtb(machine, path));
+	else
+		LUA->PushBool(false);
+
+	return 1;
+}
+
+LUA_FUNCTION(get_opt)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	int opt = LUA->CheckNumber(2);
+
+	if (machine)
+		LUA->PushNumber(gmod_machine_get_opt(machine, opt));
+	else
+		LUA->PushBool(false);
+
+	return 1;
+}
+
+LUA_FUNCTION(set_opt)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	int opt = LUA->CheckNumber(2);
+	int value = LUA->CheckNumber(3);
+
+	if (machine)
+		LUA->PushBool(gmod_machine_set_opt(machine, opt, value));
+	else
+		LUA->PushBool(false);
+
+	return 1;
+}
+
+LUA_FUNCTION(start_machine)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+
+	if (machine)
+		LUA->PushBool(gmod_machine_start(machine));
+	else
+		LUA->PushBool(false);
+
+	return 1;
+}
+
+LUA_FUNCTION(pause_machine)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+
+	if (machine)
+		LUA->PushBool(gmod_machine_pause(machine));
+	else
+		LUA->PushBool(false);
+
+	return 1;
+}
+
+LUA_FUNCTION(reset_machine)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	bool reset = LUA->IsType(2, GarrysMod::Lua::Type::Bool) ? LUA->GetBool(2) : false;
+
+	if (machine)
+	{
+		gmod_machine_reset(machine, reset);
+		LUA->PushBool(true);
+	}
+	else
+		LUA->PushBool(false);
+
+	return 1;
+}
+
+LUA_FUNCTION(load_def_devices)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+
+	if (!machine) return 0;
+
+	gmod_machine_load_def_devices(machine);
+
+	return 0;
+}
+
+LUA_FUNCTION(attach_nvme)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+
+	if (!machine) return 0;
+
+	const char* path = LUA->CheckString(2);
+	bool rw = LUA->IsType(3, GarrysMod::Lua::Type::Bool) ? LUA->GetBool(3) : false;
+
+	LUA->PushBool(gmod_machine_attach_nvme(machine, path, rw));
+
+	return 1;
+}
+
+// Callbacks of the *_async functions are held in the registry until their work completes,
+// they're called from the Tick hook with whether it worked
+static int get_async_callback(GarrysMod::Lua::ILuaBase* LUA, int index)
+{
+	if (!LUA->IsType(index, GarrysMod::Lua::Type::Function)) return -1;
+
+	LUA->Push(index);
+
+	return LUA->ReferenceCreate();
+}
+
+static void run_async_callback(GarrysMod::Lua::ILuaBase* LUA, int callback, bool ok)
+{
+	if (callback == -1) return;
+
+	LUA->ReferencePush(callback);
+	LUA->ReferenceFree(callback);
+	LUA->PushBool(ok);
+
+	if (LUA->PCall(1, 0, 0) != 0)
+	{
+		printf("riscv async callback failed: %s\n", LUA->GetString(-1));
+		LUA->Pop();
+	}
+}
+
+// Runs prepare on a worker, then apply on the Lua thread if prepare worked and the machine is
+// still there. finish runs on the Lua thread either way.
+static void submit_machine_async(GarrysMod::Lua::ILuaBase* LUA, gmod_machine_t* machine, int callback, std::function<bool()> prepare, std::function<bool(gmod_machine_t*)> apply, std::function<void()> finish = nullptr)
+{
+	gmod_machine_handle_t handle = gmod_machine_get_handle(machine);
+	auto prepared = std::make_shared<bool>(false);
+
+	async_queue_submit(
+		[prepare, prepared, handle] { *prepared = handle && prepare(); },
+		[LUA, callback, apply, finish, prepared, handle]
+		{
+			// Stale if destroyed while the worker ran, even if the id was reused since
+			gmod_machine_t* target = gmod_machine_from_handle(handle);
+			bool ok = *prepared && target && apply(target);
+
+			if (finish)
+				finish();
+
+			run_async_callback(LUA, callback, ok);
+		});
+}
+
+// Only checks the file can be opened before a machine is pointed at it, slow on cold or network
+// storage. RVVM opens it again on the Lua thread once it's attached.
+static bool open_async_file(const std::string& path, bool rw)
+{
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | (rw ? GENERIC_WRITE : 0), FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, 0, nullptr);
+
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	CloseHandle(file);
+
+	return true;
+}
+
+// Reads the file through once, RVVM still reads it on the Lua thread but finds it in the OS cache
+static bool prefetch_async_file(const std::string& path)
+{
+	FILE* file = fopen(path.c_str(), "rb");
+
+	if (!file) return false;
+
+	std::vector<char> buffer(1 << 16);
+
+	while (fread(buffer.data(), 1, buffer.size(), file) == buffer.size());
+
+	bool ok = !ferror(file);
+
+	fclose(file);
+
+	return ok;
+}
+
+// For pooled/ticked machines the image is read into the image cache on a worker, so that the
+// load itself is a cache hit. Threaded machines don't use the cache, theirs is only prefetched.
+static void submit_image_async(GarrysMod::Lua::ILuaBase* LUA, bool kernel)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	std::string path = LUA->CheckString(2);
+	int callback = get_async_callback(LUA, 3);
+
+	auto cached = std::make_shared<image_cache_entry_t*>(nullptr);
+	bool threaded = gmod_machine_get_opt(machine, GMOD_OPT_EXEC_MODE) == GMOD_EXEC_THREADED;
+
+	submit_machine_async(LUA, machine, callback,
+		[path, cached, threaded]
+		{
+			if (threaded) return prefetch_async_file(path);
+
+			*cached = image_cache_acquire(path.c_str());
+			return *cached != nullptr;
+		},
+		[path, kernel](gmod_machine_t* machine) { return kernel ? gmod_machine_load_kernel(machine, path.c_str()) : gmod_machine_load_bootrom(machine, path.c_str()); },
+		[cached] { image_cache_release(*cached); });
+}
+
+// load_bootrom_async(id, path, callback), the image of a threaded machine is only prefetched on a
+// worker, RVVM loads it on the Lua thread
+LUA_FUNCTION(load_bootrom_async)
+{
+	submit_image_async(LUA, false);
+
+	return 0;
+}
+
+// load_kernel_async(id, path, callback), same as load_bootrom_async
+LUA_FUNCTION(load_kernel_async)
+{
+	submit_image_async(LUA, true);
+
+	return 0;
+}
+
+// load_dtb_async(id, path, callback), the file is prefetched on a worker, RVVM loads it on the Lua thread
+LUA_FUNCTION(load_dtb_async)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	std::string path = LUA->CheckString(2);
+	int callback = get_async_callback(LUA, 3);
+
+	submit_machine_async(LUA, machine, callback,
+		[path] { return prefetch_async_file(path); },
+		[path](gmod_machine_t* machine) { return gmod_machine_load_dtb(machine, path.c_str()); });
+
+	return 0;
+}
+
+// attach_nvme_async(id, path, rw, callback), only the open is checked on a worker, the drive is
+// attached on the Lua thread, which RVVM blocks while it opens the image again
+LUA_FUNCTION(attach_nvme_async)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	std::string path = LUA->CheckString(2);
+	bool rw = LUA->IsType(3, GarrysMod::Lua::Type::Bool) ? LUA->GetBool(3) : false;
+	int callback = get_async_callback(LUA, 4);
+
+	submit_machine_async(LUA, machine, callback,
+		[path, rw] { return open_async_file(path, rw); },
+		[path, rw](gmod_machine_t* machine) { return gmod_machine_attach_nvme(machine, path.c_str(), rw); });
+
+	return 0;
+}
+
+// dump_dtb_async(id, path, callback), the tree is flattened right away and written out on a worker
+LUA_FUNCTION(dump_dtb_async)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	std::string path = LUA->CheckString(2);
+	int callback = get_async_callback(LUA, 3);
+
+	auto dtb = std::make_shared<std::vector<uint8_t>>(gmod_machine_serialize_dtb(machine, nullptr, 0));
+
+	bool serialized = !dtb->empty() && gmod_machine_serialize_dtb(machine, dtb->data(), dtb->size()) != 0;
+
+	async_queue_submit(
+		[path, dtb, serialized]
+		{
+			if (!serialized) return;
+
+			FILE* file = fopen(path.c_str(), "wb");
+
+			if (!file)
+			{
+				dtb->clear();
+				return;
+			}
+
+			if (fwrite(dtb->data(), 1, dtb->size(), file) != dtb->size())
+				dtb->clear();
+
+			if (fclose(file) != 0)
+				dtb->clear();
+		},
+		[LUA, callback, dtb, serialized] { run_async_callback(LUA, callback, serialized && !dtb->empty()); });
+
+	return 0;
+}
+
+// destroy_machine_async(id, callback), the id is free right away, the memory is given back on a worker
+LUA_FUNCTION(destroy_machine_async)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	int callback = get_async_callback(LUA, 2);
+
+	// Freed by the time the callback runs
+	bool found = machine != nullptr;
+
+	gmod_machine_detach(machine);
+	invalidate_machine(LUA, 1);
+
+	async_queue_submit(
+		[machine] { gmod_machine_free(machine); },
+		[LUA, callback, found] { run_async_callback(LUA, callback, found); });
+
+	return 0;
+}
+
+LUA_FUNCTION(get_async_stats)
+{
+	async_queue_stats_t stats = async_queue_get_stats();
+
+	LUA->CreateTable();
+
+	LUA->PushNumber(stats.queued);
+	LUA->SetField(-2, "queued");
+
+	LUA->PushNumber(stats.running);
+	LUA->SetField(-2, "running");
+
+	LUA->PushNumber(stats.completed);
+	LUA->SetField(-2, "completed");
+
+	LUA->PushNumber((double)stats.total);
+	LUA->SetField(-2, "total");
+
+	return 1;
+}
+
+LUA_FUNCTION(init_thread)
+{
+	event_loop_start();
+
+	return 0;
+}
+
+LUA_FUNCTION(set_event_period)
+{
+	uint32_t period = LUA->CheckNumber(1);
+
+	event_loop_set_period(period);
+
+	return 0;
+}
+
+LUA_FUNCTION(get_event_stats)
+{
+	event_loop_stats_t stats = event_loop_get_stats();
+
+	LUA->CreateTable();
+
+	LUA->PushNumber((double)stats.wakeups);
+	LUA->SetField(-2, "wakeups");
+
+	LUA->PushNumber((double)stats.kick_wakeups);
+	LUA->SetField(-2, "kick_wakeups");
+
+	LUA->PushNumber((double)stats.timer_wakeups);
+	LUA->SetField(-2, "timer_wakeups");
+
+	LUA->PushNumber(stats.kick_wakeups ? (double)stats.kick_latency_total_ns / stats.kick_wakeups / 1000.0 : 0.0);
+	LUA->SetField(-2, "kick_latency_avg_us");
+
+	LUA->PushNumber((double)stats.kick_latency_max_ns / 1000.0);
+	LUA->SetField(-2, "kick_latency_max_us");
+
+	LUA->PushNumber(stats.timer_wakeups ? (double)stats.timer_lateness_total_ns / stats.timer_wakeups / 1000.0 : 0.0);
+	LUA->SetField(-2, "timer_lateness_avg_us");
+
+	LUA->PushNumber((double)stats.timer_lateness_max_ns / 1000.0);
+	LUA->SetField(-2, "timer_lateness_max_us");
+
+	LUA->PushNumber((double)stats.idle_ns / 1000000.0);
+	LUA->SetField(-2, "idle_ms");
+
+	LUA->PushNumber(event_loop_get_period());
+	LUA->SetField(-2, "period_ms");
+
+	if (LUA->IsType(1, GarrysMod::Lua::Type::Bool) && LUA->GetBool(1))
+		event_loop_reset_stats();
+
+	return 1;
+}
+
+LUA_FUNCTION(get_scheduler_stats)
+{
+	machine_scheduler_stats_t stats = machine_scheduler_get_stats();
+
+	LUA->CreateTable();
+
+	LUA->PushNumber(stats.workers);
+	LUA->SetField(-2, "workers");
+
+	LUA->PushNumber(stats.machines);
+	LUA->SetField(-2, "machines");
+
+	LUA->PushNumber(stats.tasks);
+	LUA->SetField(-2, "tasks");
+
+	LUA->PushNumber((double)stats.steps);
+	LUA->SetField(-2, "steps");
+
+	LUA->PushNumber((double)stats.steals);
+	LUA->SetField(-2, "steals");
+
+	LUA->PushNumber((double)stats.busy_ns / 1000000.0);
+	LUA->SetField(-2, "busy_ms");
+
+	LUA->PushNumber((double)stats.idle_ns / 1000000.0);
+	LUA->SetField(-2, "idle_ms");
+
+	LUA->PushNumber((double)stats.idle_parks);
+	LUA->SetField(-2, "idle_parks");
+
+	LUA->PushNumber((double)stats.idle_wakes);
+	LUA->SetField(-2, "idle_wakes");
+
+	LUA->PushNumber((double)stats.preemptions);
+	LUA->SetField(-2, "preemptions");
+
+	return 1;
+}
+
+LUA_FUNCTION(get_tick_stats)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+
+	machine_budget_stats_t stats;
+
+	if (!machine || !machine_scheduler_get_budget_stats(machine, &stats))
+	{
+		LUA->PushNil();
+		return 1;
+	}
+
+	LUA->CreateTable();
+
+	LUA->PushNumber((double)gmod_machine_get_opt(machine, GMOD_OPT_TICK_BUDGET_US));
+	LUA->SetField(-2, "budget_us");
+
+	LUA->PushNumber((double)stats.ticks);
+	LUA->SetField(-2, "ticks");
+
+	LUA->PushNumber((double)stats.last_used_ns / 1000.0);
+	LUA->SetField(-2, "used_us");
+
+	LUA->PushNumber(stats.last_steps);
+	LUA->SetField(-2, "steps");
+
+	LUA->PushNumber((double)stats.overruns);
+	LUA->SetField(-2, "overruns");
+
+	LUA->PushNumber((double)stats.overrun_ns / 1000.0);
+	LUA->SetField(-2, "overrun_us");
+
+	LUA->PushNumber((double)stats.last_overrun_ns / 1000.0);
+	LUA->SetField(-2, "last_overrun_us");
+
+	machine_time_stats_t time_stats;
+
+	if (machine_scheduler_get_time_stats(machine, &time_stats))
+	{
+		LUA->PushNumber((double)time_stats.lag_ns / 1000000.0);
+		LUA->SetField(-2, "time_lag_ms");
+
+		LUA->PushNumber((double)time_stats.held_ns / 1000000.0);
+		LUA->SetField(-2, "time_held_ms");
+
+		LUA->PushNumber((double)time_stats.dropped_ns / 1000000.0);
+		LUA->SetField(-2, "time_dropped_ms");
+	}
+
+	return 1;
+}
+
+LUA_FUNCTION(set_owner)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	const char* owner = LUA->CheckString(2);
+
+	LUA->PushBool(gmod_machine_set_owner(machine, owner));
+
+	return 1;
+}
+
+LUA_FUNCTION(get_cpu_usage)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+
+	uint32_t usage = 0;
+	uint32_t share = 0;
+
+	if (!gmod_machine_get_cpu_usage(machine, &usage, &share))
+	{
+		LUA->PushNil();
+		return 1;
+	}
+
+	LUA->CreateTable();
+
+	LUA->PushNumber(usage);
+	LUA->SetField(-2, "usage");
+
+	LUA->PushNumber(share);
+	LUA->SetField(-2, "share");
+
+	LUA->PushString(gmod_machine_get_owner(machine));
+	LUA->SetField(-2, "owner");
+
+	return 1;
+}
+
+static double get_table_number(GarrysMod::Lua::ILuaBase* LUA, int index, const char* name, double def)
+{
+	LUA->GetField(index, name);
+	double value = LUA->IsType(-1, GarrysMod::Lua::Type::Number) ? LUA->GetNumber(-1) : def;
+	LUA->Pop();
+
+	return value;
+}
+
+static bool get_table_bool(GarrysMod::Lua::ILuaBase* LUA, int index, const char* name, bool def)
+{
+	LUA->GetField(index, name);
+	bool value = LUA->IsType(-1, GarrysMod::Lua::Type::Bool) ? LUA->GetBool(-1) : def;
+	LUA->Pop();
+
+	return value;
+}
+
+static std::string get_table_string(GarrysMod::Lua::ILuaBase* LUA, int index, const char* name)
+{
+	LUA->GetField(index, name);
+	std::string value = LUA->IsType(-1, GarrysMod::Lua::Type::String) ? LUA->GetString(-1) : "";
+	LUA->Pop();
+
+	return value;
+}
+
+// Array part of the table field, strings only
+static std::vector<std::string> get_table_strings(GarrysMod::Lua::ILuaBase* LUA, int index, const char* name)
+{
+	std::vector<std::string> values;
+
+	LUA->GetField(index, name);
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Table))
+	{
+		for (int i = 1;; i++)
+		{
+			LUA->PushNumber(i);
+			LUA->GetTable(-2);
+
+			if (!LUA->IsType(-1, GarrysMod::Lua::Type::String))
+			{
+				LUA->Pop();
+				break;
+			}
+
+			values.push_back(LUA->GetString(-1));
+			LUA->Pop();
+		}
+	}
+	LUA->Pop();
+
+	return values;
+}
+
+static machine_template_t get_table_template(GarrysMod::Lua::ILuaBase* LUA, int index, uint32_t default_exec_mode)
+{
+	machine_template_t tmpl = {};
+
+	tmpl.ram_size = (int)get_table_number(LUA, index, "ram_size", 0);
+	tmpl.harts = (int)get_table_number(LUA, index, "harts", 1);
+	tmpl.is_64bit = get_table_bool(LUA, index, "is_64bit", true);
+	tmpl.exec_mode = (uint32_t)get_table_number(LUA, index, "exec_mode", default_exec_mode);
+
+	tmpl.def_devices = get_table_bool(LUA, index, "def_devices", true);
+	tmpl.keyboard = get_table_bool(LUA, index, "keyboard", false);
+	tmpl.mouse = get_table_bool(LUA, index, "mouse", false);
+
+	// devices = { "keyboard", "mouse" } works too
+	for (const std::string& device : get_table_strings(LUA, index, "devices"))
+	{
+		if (device == "def_devices")
+			tmpl.def_devices = true;
+		else if (device == "keyboard")
+			tmpl.keyboard = true;
+		else if (device == "mouse")
+			tmpl.mouse = true;
+	}
+
+	tmpl.bootrom = get_table_string(LUA, index, "bootrom");
+	tmpl.kernel = get_table_string(LUA, index, "kernel");
+	tmpl.dtb = get_table_string(LUA, index, "dtb");
+	tmpl.cmdline = get_table_string(LUA, index, "cmdline");
+
+	tmpl.boot_ms = (uint32_t)get_table_number(LUA, index, "boot_ms", MACHINE_POOL_DEFAULT_BOOT_MS);
+
+	tmpl.nvme = get_table_strings(LUA, index, "nvme");
+
+	return tmpl;
+}
+
+LUA_FUNCTION(pool_define)
+{
+	const char* name = LUA->CheckString(1);
+	LUA->CheckType(2, GarrysMod::Lua::Type::Table);
+	uint32_t size = (uint32_t)LUA->CheckNumber(3);
+
+	machine_template_t tmpl = get_table_template(LUA, 2, GMOD_EXEC_POOLED);
+
+	LUA->PushBool(machine_pool_define(name, tmpl, size));
+
+	return 1;
+}
+
+// provision(template, count, first_id) creates and starts count machines under consecutive ids,
+// returns a table of their ids with false for those that didn't come up, and how many did
+LUA_FUNCTION(provision)
+{
+	LUA->CheckType(1, GarrysMod::Lua::Type::Table);
+	uint32_t count = (uint32_t)LUA->CheckNumber(2);
+
+	if (count > MACHINE_POOL_MAX_PROVISION) count = MACHINE_POOL_MAX_PROVISION;
+
+	int first_id = 1;
+
+	if (LUA->IsType(3, GarrysMod::Lua::Type::Number))
+		first_id = (int)LUA->GetNumber(3);
+	else
+	{
+		for (int id = first_id;; id++)
+		{
+			if (get_machine(id) != nullptr) continue;
+
+			// The first run of count free ids, so that the ids of a batch stay consecutive
+			bool free = true;
+			for (uint32_t i = 1; free && i < count; i++)
+				free = get_machine(id + (int)i) == nullptr;
+
+			if (!free) continue;
+
+			first_id = id;
+			break;
+		}
+	}
+
+	machine_template_t tmpl = get_table_template(LUA, 1, GMOD_EXEC_POOLED);
+
+	std::vector<gmod_machine_t*> machines;
+	uint32_t started = machine_pool_provision(tmpl, first_id, count, machines);
+
+	LUA->CreateTable();
+
+	for (uint32_t i = 0; i < (uint32_t)machines.size(); i++)
+	{
+		LUA->PushNumber(i + 1);
+
+		if (machines[i])
+			LUA->PushNumber(gmod_machine_get_id(machines[i]));
+		else
+			LUA->PushBool(false);
+
+		LUA->SetTable(-3);
+	}
+
+	LUA->PushNumber(started);
+
+	return 2;
+}
+
+LUA_FUNCTION(pool_set_size)
+{
+	const char* name = LUA->CheckString(1);
+	uint32_t size = (uint32_t)LUA->CheckNumber(2);
+
+	LUA->PushBool(machine_pool_set_size(name, size));
+
+	return 1;
+}
+
+LUA_FUNCTION(pool_remove)
+{
+	const char* name = LUA->CheckString(1);
+
+	machine_pool_remove(name);
+
+	return 0;
+}
+
+LUA_FUNCTION(pool_get_stats)
+{
+	const char* name = LUA->CheckString(1);
+
+	machine_pool_stats_t stats;
+
+	if (!machine_pool_get_stats(name, &stats))
+	{
+		LUA->PushNil();
+		return 1;
+	}
+
+	LUA->CreateTable();
+
+	LUA->PushNumber(stats.size);
+	LUA->SetField(-2, "size");
+
+	LUA->PushNumber(stats.ready);
+	LUA->SetField(-2, "ready");
+
+	LUA->PushNumber(stats.booting);
+	LUA->SetField(-2, "booting");
+
+	LUA->PushNumber((double)stats.hits);
+	LUA->SetField(-2, "hits");
+
+	LUA->PushNumber((double)stats.misses);
+	LUA->SetField(-2, "misses");
+
+	LUA->PushNumber((double)stats.boots);
+	LUA->SetField(-2, "boots");
+
+	LUA->PushNumber((double)stats.failures);
+	LUA->SetField(-2, "failures");
+
+	return 1;
+}
+
+LUA_FUNCTION(governor_enable)
 {
-	int id = LUA->CheckNumber(1);
-	
-	gmod_machine_destroy(get_machine(id));
+	bool enable = LUA->IsType(1, GarrysMod::Lua::Type::Bool) ? LUA->GetBool(1) : true;
+
+	gmod_machine_governor_enable(enable);
 
 	return 0;
 }
 
-LUA_FUNCTION(load_bootrom)
+LUA_FUNCTION(governor_set_budget)
 {
-	int id = LUA->CheckNumber(1);
-	const char* path = LUA->CheckString(2);
-	gmod_machine_t* machine = get_machine(id);
+	uint32_t cent = LUA->CheckNumber(1);
 
-	if (machine)
-		LUA->PushBool(gmod_machine_load_bootrom(machine, path));
-	else
-		LUA->PushBool(false);
+	gmod_machine_governor_set_budget(cent);
 
-	return 1;
+	return 0;
 }
 
-LUA_FUNCTION(load_kernel)
+LUA_FUNCTION(governor_set_owner_weight)
 {
-	int id = LUA->CheckNumber(1);
-	const char* path = LUA->CheckString(2);
-	gmod_machine_t* machine = get_machine(id);
+	const char* owner = LUA->CheckString(1);
+	uint32_t weight = LUA->CheckNumber(2);
 
-	if (machine)
-		LUA->PushBool(gmod_machine_load_kernel(machine, path));
-	else
-		LUA->PushBool(false);
+	gmod_machine_governor_set_owner_weight(owner, weight);
 
-	return 1;
+	return 0;
 }
 
-LUA_FUNCTION(set_cmdline)
+LUA_FUNCTION(governor_get_stats)
 {
-	int id = LUA->CheckNumber(1);
-	const char* cmdline = LUA->CheckString(2);
-	gmod_machine_t* machine = get_machine(id);
+	LUA->CreateTable();
 
-	if (machine)
-	{
-		gmod_machine_set_cmdline(machine, cmdline);
-		LUA->PushBool(true);
-	}
-	else
-		LUA->PushBool(false);
+	LUA->PushBool(gmod_machine_governor_enabled());
+	LUA->SetField(-2, "enabled");
+
+	LUA->PushNumber(gmod_machine_governor_get_budget());
+	LUA->SetField(-2, "budget");
+
+	LUA->PushNumber(gmod_machine_governor_get_used());
+	LUA->SetField(-2, "used");
 
 	return 1;
 }
 
-LUA_FUNCTION(append_cmdline)
+LUA_FUNCTION(watchdog_enable)
 {
-	int id = LUA->CheckNumber(1);
-	const char* cmdline = LUA->CheckString(2);
-	gmod_machine_t* machine = get_machine(id);
+	bool enable = LUA->IsType(1, GarrysMod::Lua::Type::Bool) ? LUA->GetBool(1) : true;
 
-	if (machine)
-	{
-		gmod_machine_append_cmdline(machine, cmdline);
-		LUA->PushBool(true);
-	}
-	else
-		LUA->PushBool(false);
+	gmod_machine_watchdog_enable(enable);
 
-	return 1;
+	return 0;
 }
 
-LUA_FUNCTION(dump_dtb)
+LUA_FUNCTION(watchdog_is_enabled)
 {
-	int id = LUA->CheckNumber(1);
-	const char* path = LUA->CheckString(2);
-	gmod_machine_t* machine = get_machine(id);
-
-	if (machine)
-		LUA->PushBool(gmod_machine_dump_dtb(machine, path));
-	else
-		LUA->PushBool(false);
+	LUA->PushBool(gmod_machine_watchdog_enabled());
 
 	return 1;
 }
 
-LUA_FUNCTION(load_dtb)
+LUA_FUNCTION(load_symbols)
 {
-	int id = LUA->CheckNumber(1);
+	gmod_machine_t* machine = check_machine(LUA, 1);
 	const char* path = LUA->CheckString(2);
-	gmod_machine_t* machine = get_machine(id);
 
-	if (machine)
-		LUA->PushBool(gmod_machine_load_dtb(machine, path));
-	else
-		LUA->PushBool(false);
+	LUA->PushBool(gmod_machine_load_symbols(machine, path));
 
 	return 1;
 }
 
-LUA_FUNCTION(get_opt)
+LUA_FUNCTION(set_affinity)
 {
-	int id = LUA->CheckNumber(1);
-	int opt = LUA->CheckNumber(2);
-	gmod_machine_t* machine = get_machine(id);
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	uint64_t core_mask = (uint64_t)LUA->CheckNumber(2);
 
-	if (machine)
-		LUA->PushNumber(gmod_machine_get_opt(machine, opt));
-	else
-		LUA->PushBool(false);
+	LUA->PushBool(gmod_machine_set_affinity(machine, core_mask));
 
 	return 1;
 }
 
-LUA_FUNCTION(set_opt)
+LUA_FUNCTION(set_priority)
 {
-	int id = LUA->CheckNumber(1);
-	int opt = LUA->CheckNumber(2);
-	int value = LUA->CheckNumber(3);
-	gmod_machine_t* machine = get_machine(id);
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	uint32_t priority = (uint32_t)LUA->CheckNumber(2);
 
-	if (machine)
-		LUA->PushBool(gmod_machine_set_opt(machine, opt, value));
-	else
-		LUA->PushBool(false);
+	LUA->PushBool(gmod_machine_set_opt(machine, GMOD_OPT_PRIORITY, priority));
 
 	return 1;
 }
 
-LUA_FUNCTION(start_machine)
+LUA_FUNCTION(set_numa_node)
 {
-	int id = LUA->CheckNumber(1);
-	gmod_machine_t* machine = get_machine(id);
+	gmod_machine_t* machine = check_machine(LUA, 1);
+	int node = LUA->CheckNumber(2);
 
-	if (machine)
-		LUA->PushBool(gmod_machine_start(machine));
-	else
-		LUA->PushBool(false);
+	LUA->PushBool(gmod_machine_set_numa_node(machine, node));
 
 	return 1;
 }
 
-LUA_FUNCTION(pause_machine)
+LUA_FUNCTION(reserve_cores)
 {
-	int id = LUA->CheckNumber(1);
-	gmod_machine_t* machine = get_machine(id);
+	uint64_t core_mask = (uint64_t)LUA->CheckNumber(1);
 
-	if (machine)
-		LUA->PushBool(gmod_machine_pause(machine));
-	else
-		LUA->PushBool(false);
+	machine_scheduler_set_reserved_cores(core_mask);
+
+	LUA->PushNumber((double)machine_scheduler_get_worker_cores());
 
 	return 1;
 }
 
-LUA_FUNCTION(reset_machine)
+LUA_FUNCTION(get_numa_nodes)
 {
-	int id = LUA->CheckNumber(1);
-	bool reset = LUA->IsType(2, GarrysMod::Lua::Type::Bool) ? LUA->GetBool(2) : false;
-	gmod_machine_t* machine = get_machine(id);
+	LUA->CreateTable();
 
-	if (machine)
+	int count = gmod_machine_get_numa_node_count();
+
+	for (int node = 0; node < count; node++)
 	{
-		gmod_machine_reset(machine, reset);
-		LUA->PushBool(true);
+		LUA->PushNumber(node);
+		LUA->PushNumber((double)gmod_machine_get_numa_node_cores(node));
+		LUA->SetTable(-3);
 	}
-	else
-		LUA->PushBool(false);
 
 	return 1;
 }
 
-LUA_FUNCTION(load_def_devices)
+static std::vector<machine_overrun_t> tick_overruns;
+
+LUA_FUNCTION(riscv_tick)
 {
-	int id = LUA->CheckNumber(1);
-	gmod_machine_t* machine = get_machine(id);
+	tick_overruns.clear();
 
-	if (!machine) return 0;
+	machine_scheduler_tick(tick_overruns);
 
-	gmod_machine_load_def_devices(machine);
+	gmod_machine_power_update();
+	gmod_machine_governor_update();
+	gmod_machine_hibernation_update();
+	gmod_machine_reclaim_update();
 
-	return 0;
-}
+	gmod_watchdog_event_t watchdog_events[16];
+	uint32_t watchdog_count = gmod_machine_watchdog_update(watchdog_events, 16);
 
-LUA_FUNCTION(attach_nvme)
-{
-	int id = LUA->CheckNumber(1);
-	gmod_machine_t* machine = get_machine(id);
+	async_queue_poll();
 
-	if (!machine) return 0;
+	for (uint32_t i = 0; i < watchdog_count; i++)
+	{
+		const gmod_watchdog_event_t& event = watchdog_events[i];
 
-	const char* path = LUA->CheckString(2);
-	bool rw = LUA->IsType(3, GarrysMod::Lua::Type::Bool) ? LUA->GetBool(3) : false;
+		if (!hook_run_begin(LUA, "RISCV_Runaway")) break;
 
-	LUA->PushBool(gmod_machine_attach_nvme(machine, path, rw));
+		LUA->PushNumber(event.id);
+		LUA->PushNumber(event.action);
 
-	return 1;
-}
+		LUA->CreateTable();
 
-std::thread event_thread;
-static bool thread_running = false;
+		LUA->PushNumber(event.hart);
+		LUA->SetField(-2, "hart");
 
-static void thread_func()
-{
-	while (thread_running)
-	{
-		rvvm_external_tick_eventloop(true);
-		std::this_thread::sleep_for(std::chrono::nanoseconds(10));
+		LUA->PushNumber((double)event.pc);
+		LUA->SetField(-2, "pc");
+
+		if (event.symbol[0])
+		{
+			LUA->PushString(event.symbol);
+			LUA->SetField(-2, "symbol");
+		}
+
+		LUA->PushNumber(event.busy_cent);
+		LUA->SetField(-2, "busy_cent");
+
+		LUA->PushNumber(event.cpu_cent);
+		LUA->SetField(-2, "cpu_cent");
+
+		hook_run_end(LUA, "RISCV_Runaway", 3);
 	}
-}
 
-LUA_FUNCTION(init_thread)
-{
-	if (thread_running) return 0;
+	for (const auto& overrun : tick_overruns)
+	{
+		// Hooks run above may have destroyed it
+		gmod_machine_t* machine = gmod_machine_from_handle(overrun.handle);
+		if (!machine || !hook_run_begin(LUA, "RISCV_BudgetOverrun")) continue;
 
-	thread_running = true;
-	event_thread = std::thread(thread_func);
+		LUA->PushNumber(gmod_machine_get_id(machine));
+		LUA->PushNumber((double)overrun.overrun_ns / 1000.0);
 
-	event_thread.detach();
+		hook_run_end(LUA, "RISCV_BudgetOverrun", 2);
+	}
 
 	return 0;
 }
@@ -355,8 +1501,7 @@ LUA_FUNCTION(unload_device)
 
 LUA_FUNCTION(attach_keyboard)
 {
-	int id = LUA->CheckNumber(1);
-	gmod_machine_t* machine = get_machine(id);
+	gmod_machine_t* machine = check_machine(LUA, 1);
 	if (!machine) {
 		LUA->PushBool(false);
 		return 1;
@@ -367,8 +1512,7 @@ LUA_FUNCTION(attach_keyboard)
 
 LUA_FUNCTION(attach_mouse)
 {
-	int id = LUA->CheckNumber(1);
-	gmod_machine_t* machine = get_machine(id);
+	gmod_machine_t* machine = check_machine(LUA, 1);
 	if (!machine) {
 		LUA->PushBool(false);
 		return 1;
@@ -379,9 +1523,8 @@ LUA_FUNCTION(attach_mouse)
 
 LUA_FUNCTION(keyboard_press)
 {
-	int id = LUA->CheckNumber(1);
+	gmod_machine_t* machine = check_machine(LUA, 1);
 	hid_key_t key = LUA->CheckNumber(2);
-	gmod_machine_t* machine = get_machine(id);
 	if (machine)
 		LUA->PushBool(gmod_machine_keyboard_press(machine, key));
 	else
@@ -391,9 +1534,8 @@ LUA_FUNCTION(keyboard_press)
 
 LUA_FUNCTION(keyboard_release)
 {
-	int id = LUA->CheckNumber(1);
+	gmod_machine_t* machine = check_machine(LUA, 1);
 	hid_key_t key = LUA->CheckNumber(2);
-	gmod_machine_t* machine = get_machine(id);
 	if (machine)
 		LUA->PushBool(gmod_machine_keyboard_release(machine, key));
 	else
@@ -403,9 +1545,8 @@ LUA_FUNCTION(keyboard_release)
 
 LUA_FUNCTION(mouse_press)
 {
-	int id = LUA->CheckNumber(1);
+	gmod_machine_t* machine = check_machine(LUA, 1);
 	hid_btns_t btns = LUA->CheckNumber(2);
-	gmod_machine_t* machine = get_machine(id);
 	if (machine)
 		LUA->PushBool(gmod_machine_mouse_press(machine, btns));
 	else
@@ -415,9 +1556,8 @@ LUA_FUNCTION(mouse_press)
 
 LUA_FUNCTION(mouse_release)
 {
-	int id = LUA->CheckNumber(1);
+	gmod_machine_t* machine = check_machine(LUA, 1);
 	hid_btns_t btns = LUA->CheckNumber(2);
-	gmod_machine_t* machine = get_machine(id);
 	if (machine)
 		LUA->PushBool(gmod_machine_mouse_release(machine, btns));
 	else
@@ -427,9 +1567,8 @@ LUA_FUNCTION(mouse_release)
 
 LUA_FUNCTION(mouse_scroll)
 {
-	int id = LUA->CheckNumber(1);
+	gmod_machine_t* machine = check_machine(LUA, 1);
 	int32_t offset = LUA->CheckNumber(2);
-	gmod_machine_t* machine = get_machine(id);
 	if (machine)
 		LUA->PushBool(gmod_machine_mouse_scroll(machine, offset));
 	else
@@ -439,10 +1578,9 @@ LUA_FUNCTION(mouse_scroll)
 
 LUA_FUNCTION(mouse_move)
 {
-	int id = LUA->CheckNumber(1);
+	gmod_machine_t* machine = check_machine(LUA, 1);
 	int32_t x = LUA->CheckNumber(2);
 	int32_t y = LUA->CheckNumber(3);
-	gmod_machine_t* machine = get_machine(id);
 	if (machine)
 		LUA->PushBool(gmod_machine_mouse_move(machine, x, y));
 	else
@@ -452,10 +1590,9 @@ LUA_FUNCTION(mouse_move)
 
 LUA_FUNCTION(mouse_place)
 {
-	int id = LUA->CheckNumber(1);
+	gmod_machine_t* machine = check_machine(LUA, 1);
 	int32_t x = LUA->CheckNumber(2);
 	int32_t y = LUA->CheckNumber(3);
-	gmod_machine_t* machine = get_machine(id);
 	if (machine)
 		LUA->PushBool(gmod_machine_mouse_place(machine, x, y));
 	else
@@ -465,10 +1602,9 @@ LUA_FUNCTION(mouse_place)
 
 LUA_FUNCTION(mouse_resolution)
 {
-	int id = LUA->CheckNumber(1);
+	gmod_machine_t* machine = check_machine(LUA, 1);
 	uint32_t x = LUA->CheckNumber(2);
 	uint32_t y = LUA->CheckNumber(3);
-	gmod_machine_t* machine = get_machine(id);
 	if (machine)
 		LUA->PushBool(gmod_machine_mouse_resolution(machine, x, y));
 	else
@@ -493,15 +1629,123 @@ void alloc_console()
 	SetConsoleOutputCP(CP_UTF8);
 }
 
+LUA_FUNCTION(machine__tostring)
+{
+	gmod_machine_t* machine = check_machine(LUA, 1);
+
+	if (machine)
+		LUA->PushString(("riscv_machine: " + std::to_string(gmod_machine_get_id(machine))).c_str());
+	else
+		LUA->PushString("riscv_machine: NULL");
+
+	return 1;
+}
+
+LUA_FUNCTION(machine__eq)
+{
+	lua_machine_t* a = LUA->GetUserType<lua_machine_t>(1, machine_mt);
+	lua_machine_t* b = LUA->GetUserType<lua_machine_t>(2, machine_mt);
+
+	LUA->PushBool(a && b && a->handle == b->handle);
+
+	return 1;
+}
+
+// m:start() is start_machine(m), the machine always comes first
+static const struct
+{
+	const char* name;
+	GarrysMod::Lua::CFunc func;
+} machine_methods[] = {
+	{ "id", get_machine_id },
+	{ "is_valid", is_machine_exists },
+	{ "is_running", is_machine_running },
+	{ "is_powered", is_machine_powered },
+	{ "start", start_machine },
+	{ "pause", pause_machine },
+	{ "reset", reset_machine },
+	{ "destroy", destroy_machine },
+	{ "destroy_async", destroy_machine_async },
+	{ "hibernate", hibernate_machine },
+	{ "resume", resume_machine },
+	{ "is_hibernated", is_machine_hibernated },
+	{ "set_page_merge", set_page_merge },
+	{ "set_ram_reclaim", set_ram_reclaim },
+	{ "get_memory", get_machine_memory },
+	{ "load_symbols", load_symbols },
+	{ "get_reclaim_stats", get_reclaim_stats },
+	{ "load_def_devices", load_def_devices },
+	{ "load_bootrom", load_bootrom },
+	{ "load_kernel", load_kernel },
+	{ "load_dtb", load_dtb },
+	{ "dump_dtb", dump_dtb },
+	{ "attach_nvme", attach_nvme },
+	{ "load_bootrom_async", load_bootrom_async },
+	{ "load_kernel_async", load_kernel_async },
+	{ "load_dtb_async", load_dtb_async },
+	{ "dump_dtb_async", dump_dtb_async },
+	{ "attach_nvme_async", attach_nvme_async },
+	{ "set_cmdline", set_cmdline },
+	{ "append_cmdline", append_cmdline },
+	{ "get_opt", get_opt },
+	{ "set_opt", set_opt },
+	{ "get_tick_stats", get_tick_stats },
+	{ "set_owner", set_owner },
+	{ "get_cpu_usage", get_cpu_usage },
+	{ "set_affinity", set_affinity },
+	{ "set_priority", set_priority },
+	{ "set_numa_node", set_numa_node },
+	{ "attach_keyboard", attach_keyboard },
+	{ "attach_mouse", attach_mouse },
+	{ "keyboard_press", keyboard_press },
+	{ "keyboard_release", keyboard_release },
+	{ "mouse_press", mouse_press },
+	{ "mouse_release", mouse_release },
+	{ "mouse_scroll", mouse_scroll },
+	{ "mouse_move", mouse_move },
+	{ "mouse_place", mouse_place },
+	{ "mouse_resolution", mouse_resolution },
+};
+
+static void init_machine_metatable(GarrysMod::Lua::ILuaBase* LUA)
+{
+	machine_mt = LUA->CreateMetaTable("riscv_machine");
+
+	for (const auto& method : machine_methods)
+	{
+		LUA->PushCFunction(method.func);
+		LUA->SetField(-2, method.name);
+	}
+
+	LUA->PushCFunction(machine__tostring);
+	LUA->SetField(-2, "__tostring");
+
+	LUA->PushCFunction(machine__eq);
+	LUA->SetField(-2, "__eq");
+
+	LUA->Push(-1);
+	LUA->SetField(-2, "__index");
+
+	LUA->Pop();
+}
+
 GMOD_MODULE_OPEN()
 {
 	alloc_console();
 
+	init_machine_metatable(LUA);
+
 	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
 		LUA->CreateTable();
 			LUA->PushCFunction(create_machine);
 			LUA->SetField(-2, "create_machine");
 
+			LUA->PushCFunction(get_machine_object);
+			LUA->SetField(-2, "get_machine");
+
+			LUA->PushCFunction(get_machine_id);
+			LUA->SetField(-2, "get_machine_id");
+
 			LUA->PushCFunction(is_machine_running);
 			LUA->SetField(-2, "is_machine_running");
 
@@ -514,12 +1758,69 @@ GMOD_MODULE_OPEN()
 			LUA->PushCFunction(destroy_machine);
 			LUA->SetField(-2, "destroy_machine");
 
+			LUA->PushCFunction(destroy_machine_async);
+			LUA->SetField(-2, "destroy_machine_async");
+
+			LUA->PushCFunction(set_page_merge);
+			LUA->SetField(-2, "set_page_merge");
+
+			LUA->PushCFunction(set_merge_scan_rate);
+			LUA->SetField(-2, "set_merge_scan_rate");
+
+			LUA->PushCFunction(get_merge_stats);
+			LUA->SetField(-2, "get_merge_stats");
+
+			LUA->PushCFunction(set_image_cache_size);
+			LUA->SetField(-2, "set_image_cache_size");
+
+			LUA->PushCFunction(get_image_cache_stats);
+			LUA->SetField(-2, "get_image_cache_stats");
+
+			LUA->PushCFunction(set_memory_limit);
+			LUA->SetField(-2, "set_memory_limit");
+
+			LUA->PushCFunction(get_memory_stats);
+			LUA->SetField(-2, "get_memory_stats");
+
+			LUA->PushCFunction(get_machine_memory);
+			LUA->SetField(-2, "get_machine_memory");
+
+			LUA->PushCFunction(set_ram_reclaim);
+			LUA->SetField(-2, "set_ram_reclaim");
+
+			LUA->PushCFunction(set_reclaim_scan_rate);
+			LUA->SetField(-2, "set_reclaim_scan_rate");
+
+			LUA->PushCFunction(get_reclaim_stats);
+			LUA->SetField(-2, "get_reclaim_stats");
+
+			LUA->PushCFunction(set_hibernation);
+			LUA->SetField(-2, "set_hibernation");
+
+			LUA->PushCFunction(hibernate_machine);
+			LUA->SetField(-2, "hibernate_machine");
+
+			LUA->PushCFunction(resume_machine);
+			LUA->SetField(-2, "resume_machine");
+
+			LUA->PushCFunction(is_machine_hibernated);
+			LUA->SetField(-2, "is_machine_hibernated");
+
+			LUA->PushCFunction(get_hibernation_stats);
+			LUA->SetField(-2, "get_hibernation_stats");
+
 			LUA->PushCFunction(load_bootrom);
 			LUA->SetField(-2, "load_bootrom");
 
+			LUA->PushCFunction(load_bootrom_async);
+			LUA->SetField(-2, "load_bootrom_async");
+
 			LUA->PushCFunction(load_kernel);
 			LUA->SetField(-2, "load_kernel");
 
+			LUA->PushCFunction(load_kernel_async);
+			LUA->SetField(-2, "load_kernel_async");
+
 			LUA->PushCFunction(set_cmdline);
 			LUA->SetField(-2, "set_cmdline");
 
@@ -529,9 +1830,15 @@ GMOD_MODULE_OPEN()
 			LUA->PushCFunction(dump_dtb);
 			LUA->SetField(-2, "dump_dtb");
 
+			LUA->PushCFunction(dump_dtb_async);
+			LUA->SetField(-2, "dump_dtb_async");
+
 			LUA->PushCFunction(load_dtb);
 			LUA->SetField(-2, "load_dtb");
 
+			LUA->PushCFunction(load_dtb_async);
+			LUA->SetField(-2, "load_dtb_async");
+
 			LUA->PushCFunction(get_opt);
 			LUA->SetField(-2, "get_opt");
 
@@ -553,6 +1860,12 @@ GMOD_MODULE_OPEN()
 			LUA->PushCFunction(attach_nvme);
 			LUA->SetField(-2, "attach_nvme");
 
+			LUA->PushCFunction(attach_nvme_async);
+			LUA->SetField(-2, "attach_nvme_async");
+
+			LUA->PushCFunction(get_async_stats);
+			LUA->SetField(-2, "get_async_stats");
+
 			// Devices table
 
 			LUA->CreateTable();
@@ -605,6 +1918,148 @@ GMOD_MODULE_OPEN()
 			LUA->PushCFunction(init_thread);
 			LUA->SetField(-2, "init_thread");
 
+			LUA->PushCFunction(set_event_period);
+			LUA->SetField(-2, "set_event_period");
+
+			LUA->PushCFunction(get_event_stats);
+			LUA->SetField(-2, "get_event_stats");
+
+			LUA->PushCFunction(get_scheduler_stats);
+			LUA->SetField(-2, "get_scheduler_stats");
+
+			LUA->PushNumber(GMOD_OPT_EXEC_MODE);
+			LUA->SetField(-2, "OPT_EXEC_MODE");
+
+			LUA->PushNumber(GMOD_EXEC_THREADED);
+			LUA->SetField(-2, "EXEC_THREADED");
+
+			LUA->PushNumber(GMOD_EXEC_POOLED);
+			LUA->SetField(-2, "EXEC_POOLED");
+
+			LUA->PushNumber(GMOD_EXEC_TICKED);
+			LUA->SetField(-2, "EXEC_TICKED");
+
+			LUA->PushNumber(GMOD_OPT_TICK_BUDGET_US);
+			LUA->SetField(-2, "OPT_TICK_BUDGET_US");
+
+			LUA->PushNumber(GMOD_OPT_TICK_STEPS);
+			LUA->SetField(-2, "OPT_TICK_STEPS");
+
+			LUA->PushCFunction(get_tick_stats);
+			LUA->SetField(-2, "get_tick_stats");
+
+			LUA->PushNumber(GMOD_OPT_CPU_WEIGHT);
+			LUA->SetField(-2, "OPT_CPU_WEIGHT");
+
+			LUA->PushNumber(GMOD_WATCHDOG_WARN);
+			LUA->SetField(-2, "WATCHDOG_WARN");
+
+			LUA->PushNumber(GMOD_WATCHDOG_THROTTLE);
+			LUA->SetField(-2, "WATCHDOG_THROTTLE");
+
+			LUA->PushNumber(GMOD_WATCHDOG_PAUSE);
+			LUA->SetField(-2, "WATCHDOG_PAUSE");
+
+			LUA->PushNumber(GMOD_WATCHDOG_RELEASE);
+			LUA->SetField(-2, "WATCHDOG_RELEASE");
+
+			LUA->PushNumber(GMOD_ADMIT_REJECT);
+			LUA->SetField(-2, "ADMIT_REJECT");
+
+			LUA->PushNumber(GMOD_ADMIT_DOWNSIZE);
+			LUA->SetField(-2, "ADMIT_DOWNSIZE");
+
+			LUA->PushNumber(GMOD_OPT_PRIORITY);
+			LUA->SetField(-2, "OPT_PRIORITY");
+
+			LUA->PushNumber(GMOD_PRIORITY_BACKGROUND);
+			LUA->SetField(-2, "PRIORITY_BACKGROUND");
+
+			LUA->PushNumber(GMOD_PRIORITY_NORMAL);
+			LUA->SetField(-2, "PRIORITY_NORMAL");
+
+			LUA->PushNumber(GMOD_PRIORITY_INTERACTIVE);
+			LUA->SetField(-2, "PRIORITY_INTERACTIVE");
+
+			LUA->PushNumber(GMOD_OPT_TIME_MODE);
+			LUA->SetField(-2, "OPT_TIME_MODE");
+
+			LUA->PushNumber(GMOD_OPT_TIME_CATCHUP_CENT);
+			LUA->SetField(-2, "OPT_TIME_CATCHUP_CENT");
+
+			LUA->PushNumber(GMOD_TIME_HOST);
+			LUA->SetField(-2, "TIME_HOST");
+
+			LUA->PushNumber(GMOD_TIME_VIRTUAL);
+			LUA->SetField(-2, "TIME_VIRTUAL");
+
+			LUA->PushCFunction(set_owner);
+			LUA->SetField(-2, "set_owner");
+
+			LUA->PushCFunction(get_cpu_usage);
+			LUA->SetField(-2, "get_cpu_usage");
+
+			LUA->PushCFunction(set_affinity);
+			LUA->SetField(-2, "set_affinity");
+
+			LUA->PushCFunction(set_priority);
+			LUA->SetField(-2, "set_priority");
+
+			LUA->PushCFunction(load_symbols);
+			LUA->SetField(-2, "load_symbols");
+
+			LUA->PushCFunction(set_numa_node);
+			LUA->SetField(-2, "set_numa_node");
+
+			LUA->PushCFunction(reserve_cores);
+			LUA->SetField(-2, "reserve_cores");
+
+			LUA->PushCFunction(get_numa_nodes);
+			LUA->SetField(-2, "get_numa_nodes");
+
+			// Governor table
+
+			LUA->CreateTable();
+				LUA->PushCFunction(governor_enable);
+				LUA->SetField(-2, "enable");
+
+				LUA->PushCFunction(governor_set_budget);
+				LUA->SetField(-2, "set_budget");
+
+				LUA->PushCFunction(governor_set_owner_weight);
+				LUA->SetField(-2, "set_owner_weight");
+
+				LUA->PushCFunction(governor_get_stats);
+				LUA->SetField(-2, "get_stats");
+			LUA->SetField(-2, "governor");
+
+			// Watchdog table
+			LUA->CreateTable();
+				LUA->PushCFunction(watchdog_enable);
+				LUA->SetField(-2, "enable");
+
+				LUA->PushCFunction(watchdog_is_enabled);
+				LUA->SetField(-2, "is_enabled");
+			LUA->SetField(-2, "watchdog");
+
+			// Warm pool table
+			LUA->CreateTable();
+				LUA->PushCFunction(pool_define);
+				LUA->SetField(-2, "define");
+
+				LUA->PushCFunction(pool_set_size);
+				LUA->SetField(-2, "set_size");
+
+				LUA->PushCFunction(pool_remove);
+				LUA->SetField(-2, "remove");
+
+				LUA->PushCFunction(pool_get_stats);
+				LUA->SetField(-2, "get_stats");
+			LUA->SetField(-2, "pool");
+
+			LUA->PushCFunction(provision);
+			LUA->SetField(-2, "provision");
+
 			LUA->PushString(RVVM_VERSION);
 			LUA->SetField(-2, "rvvm_version");
 
@@ -613,6 +2068,17 @@ GMOD_MODULE_OPEN()
 		LUA->SetField(-2, "riscv");
 	LUA->Pop();
 
+	machine_pool_init();
+
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+	LUA->GetField(-1, "hook");
+	LUA->GetField(-1, "Add");
+	LUA->PushString("Tick");
+	LUA->PushString("riscv_tick");
+	LUA->PushCFunction(riscv_tick);
+	LUA->Call(3, 0);
+	LUA->Pop(2);
+
 	dev_manager_init(LUA);
 
 	dev_manager_register_device(mmio_atomic_get_name, mmio_atomic_get_version, mmio_atomic_init_lua, mmio_atomic_register_functions, mmio_atomic_close);
@@ -622,13 +2088,41 @@ GMOD_MODULE_OPEN()
 
 GMOD_MODULE_CLOSE()
 {
-	gmod_machine_shutdown_all();
+	LUA->PushSpecial(GarrysMod::Lua::SPECIAL_GLOB);
+	LUA->GetField(-1, "hook");
+	LUA->GetField(-1, "Remove");
+	LUA->PushString("Tick");
+	LUA->PushString("riscv_tick");
+	LUA->Call(2, 0);
+	LUA->Pop(2);
+
+	event_loop_stop();
+
+	machine_pool_shutdown();
+	gmod_machine_watchdog_enable(false);
+	machine_scheduler_shutdown();
 
-	thread_running = false;
-	if (event_thread.joinable())
-		event_thread.join();
+	// Machines whose destroy is still queued are freed before the rest
+	async_queue_shutdown();
+
+	gmod_machine_shutdown_all();
 
 	dev_manager_close(LUA);
 
+	// Userdata outlive the module, their methods mustn't call into it
+	if (LUA->PushMetaTable(machine_mt))
+	{
+		LUA->PushCFunction(dev_manager_lua_nop_func);
+		LUA->SetField(-2, "__index");
+
+		LUA->PushNil();
+		LUA->SetField(-2, "__tostring");
+
+		LUA->PushNil();
+		LUA->SetField(-2, "__eq");
+
+		LUA->Pop();
+	}
+
 	return 0;
 }
@@ -0,0 +1,647 @@
+#include "page_merge.h"
+
+#include "ram_share.h"
+
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <unordered_map>
+#include <condition_variable>
+
+#include <Windows.h>
+
+// Placeholder flags, older SDKs don't have them
+#ifndef MEM_RESERVE_PLACEHOLDER
+#define MEM_RESERVE_PLACEHOLDER 0x00040000
+#endif
+
+#ifndef MEM_REPLACE_PLACEHOLDER
+#define MEM_REPLACE_PLACEHOLDER 0x00004000
+#endif
+
+#ifndef MEM_PRESERVE_PLACEHOLDER
+#define MEM_PRESERVE_PLACEHOLDER 0x00000002
+#endif
+
+#define MERGE_STORE_SLOTS  1024 // merged blocks per section, 64 MiB
+#define MERGE_MAX_STORES   256
+#define MERGE_BATCH_BLOCKS 64   // scanned per lock of the region list
+
+#define MERGE_BLOCK_PRIVATE 0
+#define MERGE_BLOCK_BUSY    1 // being merged or unmerged, faulting threads wait for it
+#define MERGE_BLOCK_SHARED  2
+
+typedef void* (WINAPI* merge_virtual_alloc2_t)(HANDLE, void*, SIZE_T, ULONG, ULONG, void*, ULONG);
+typedef void* (WINAPI* merge_map_view3_t)(HANDLE, HANDLE, void*, ULONG64, SIZE_T, ULONG, ULONG, void*, ULONG);
+typedef BOOL (WINAPI* merge_unmap_view2_t)(HANDLE, void*, ULONG);
+
+static merge_virtual_alloc2_t merge_virtual_alloc2 = nullptr;
+static merge_map_view3_t merge_map_view3 = nullptr;
+static merge_unmap_view2_t merge_unmap_view2 = nullptr;
+
+typedef struct page_merge_region_t
+{
+	uint8_t* mem;
+	size_t size;
+	size_t blocks;
+
+	// The allocation librvvm made, put back on removal
+	void* alloc_base;
+	size_t alloc_size;
+
+	std::unique_ptr<std::atomic<uint8_t>[]> state;
+	std::unique_ptr<uint32_t[]> slot; // of shared blocks
+	std::unique_ptr<uint64_t[]> hash; // from the previous pass, only touched by the scanner
+} page_merge_region_t;
+
+static std::atomic<page_merge_region_t*> merge_regions[PAGE_MERGE_MAX_REGIONS];
+static std::atomic<int> merge_handlers_active = 0;
+
+// Held by the scanner while it works on a batch of blocks, regions are only removed in between
+static std::mutex merge_mutex;
+static void* merge_handler = nullptr;
+
+// Merged copies live in pagefile-backed sections, the slots are only managed by the scanner
+static HANDLE store_sections[MERGE_MAX_STORES];
+static std::atomic<uint8_t*> store_data[MERGE_MAX_STORES];
+static std::atomic<uint32_t> slot_refs[MERGE_MAX_STORES * MERGE_STORE_SLOTS];
+static uint32_t store_count = 0;
+static std::vector<uint32_t> free_slots;
+static std::vector<uint64_t> slot_hash;
+static std::vector<bool> slot_used;
+static std::unordered_multimap<uint64_t, uint32_t> slots_by_hash;
+
+static std::thread merge_thread;
+static std::mutex merge_thread_mutex;
+static std::condition_variable merge_thread_cond;
+static bool merge_thread_stop = false;
+
+static std::atomic<uint32_t> merge_scan_mb = PAGE_MERGE_DEFAULT_SCAN_MB;
+
+static std::atomic<uint32_t> stat_regions = 0;
+static std::atomic<uint64_t> stat_shared = 0;
+static std::atomic<uint64_t> stat_merged = 0;
+static std::atomic<uint64_t> stat_merges = 0;
+static std::atomic<uint64_t> stat_unmerges = 0;
+static std::atomic<uint64_t> stat_scans = 0;
+
+static bool merge_load_api()
+{
+	if (merge_virtual_alloc2) return true;
+
+	// Only exported by kernelbase, and only since Windows 10 1803
+	HMODULE kernelbase = GetModuleHandleW(L"kernelbase.dll");
+	if (!kernelbase) return false;
+
+	merge_map_view3 = (merge_map_view3_t)GetProcAddress(kernelbase, "MapViewOfFile3");
+	merge_unmap_view2 = (merge_unmap_view2_t)GetProcAddress(kernelbase, "UnmapViewOfFile2");
+
+	if (!merge_map_view3 || !merge_unmap_view2) return false;
+
+	merge_virtual_alloc2 = (merge_virtual_alloc2_t)GetProcAddress(kernelbase, "VirtualAlloc2");
+
+	return merge_virtual_alloc2 != nullptr;
+}
+
+static uint8_t* merge_slot_data(uint32_t slot)
+{
+	return store_data[slot / MERGE_STORE_SLOTS].load() + (size_t)(slot % MERGE_STORE_SLOTS) * PAGE_MERGE_BLOCK_SIZE;
+}
+
+static bool merge_map_slot(uint32_t slot, uint8_t* addr)
+{
+	return merge_map_view3(store_sections[slot / MERGE_STORE_SLOTS], GetCurrentProcess(), addr,
+		(ULONG64)(slot % MERGE_STORE_SLOTS) * PAGE_MERGE_BLOCK_SIZE, PAGE_MERGE_BLOCK_SIZE, MEM_REPLACE_PLACEHOLDER, PAGE_READONLY, nullptr, 0) == addr;
+}
+
+static bool merge_alloc_private(uint8_t* addr)
+{
+	return merge_virtual_alloc2(nullptr, addr, PAGE_MERGE_BLOCK_SIZE, MEM_RESERVE | MEM_COMMIT | MEM_REPLACE_PLACEHOLDER, PAGE_READWRITE, nullptr, 0) == addr;
+}
+
+// Gives a shared block a private copy again, runs in the thread that tried to write it
+static bool merge_unshare(page_merge_region_t* region, size_t block)
+{
+	uint8_t* addr = region->mem + block * PAGE_MERGE_BLOCK_SIZE;
+	uint32_t slot = region->slot[block];
+
+	if (!merge_unmap_view2(GetCurrentProcess(), addr, MEM_PRESERVE_PLACEHOLDER)) return false;
+
+	if (!merge_alloc_private(addr))
+	{
+		// Out of memory, at least keep the block readable
+		merge_map_slot(slot, addr);
+		return false;
+	}
+
+	memcpy(addr, merge_slot_data(slot), PAGE_MERGE_BLOCK_SIZE);
+
+	slot_refs[slot]--;
+	stat_shared--;
+	stat_unmerges++;
+
+	return true;
+}
+
+static LONG CALLBACK page_merge_handler(PEXCEPTION_POINTERS info)
+{
+	EXCEPTION_RECORD* record = info->ExceptionRecord;
+
+	if (record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION || record->NumberParameters < 2)
+		return EXCEPTION_CONTINUE_SEARCH;
+
+	uint8_t* addr = (uint8_t*)record->ExceptionInformation[1];
+	bool write = record->ExceptionInformation[0] == 1;
+
+	// Counted before looking at the slots, page_merge_remove() waits for this to drop
+	merge_handlers_active++;
+
+	LONG result = EXCEPTION_CONTINUE_SEARCH;
+
+	for (auto& slot : merge_regions)
+	{
+		page_merge_region_t* region = slot.load();
+
+		if (!region || addr < region->mem || addr >= region->mem + region->size) continue;
+
+		std::atomic<uint8_t>& state = region->state[(size_t)(addr - region->mem) / PAGE_MERGE_BLOCK_SIZE];
+
+		for (;;)
+		{
+			uint8_t current = state.load();
+
+			// The block is unmapped or read-only for a moment, even reads end up here
+			if (current == MERGE_BLOCK_BUSY)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			// Changed while the fault was raised, retrying is enough
+			if (current == MERGE_BLOCK_PRIVATE || !write)
+			{
+				result = EXCEPTION_CONTINUE_EXECUTION;
+				break;
+			}
+
+			if (state.compare_exchange_strong(current, MERGE_BLOCK_BUSY))
+			{
+				bool ok = merge_unshare(region, (size_t)(addr - region->mem) / PAGE_MERGE_BLOCK_SIZE);
+
+				state.store(ok ? MERGE_BLOCK_PRIVATE : MERGE_BLOCK_SHARED);
+
+				if (ok)
+					result = EXCEPTION_CONTINUE_EXECUTION;
+
+				break;
+			}
+		}
+
+		break;
+	}
+
+	merge_handlers_active--;
+
+	return result;
+}
+
+static uint64_t merge_hash(const uint8_t* data)
+{
+	const uint64_t* words = (const uint64_t*)data;
+	uint64_t hash = 0x9E3779B97F4A7C15ULL;
+
+	for (size_t i = 0; i < PAGE_MERGE_BLOCK_SIZE / sizeof(uint64_t); i++)
+		hash = (hash ^ words[i]) * 0x100000001B3ULL + (hash >> 29);
+
+	return hash;
+}
+
+static bool merge_alloc_slot(uint32_t* out_slot)
+{
+	if (free_slots.empty())
+	{
+		if (store_count == MERGE_MAX_STORES) return false;
+
+		size_t size = (size_t)MERGE_STORE_SLOTS * PAGE_MERGE_BLOCK_SIZE;
+
+		HANDLE section = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, nullptr);
+		if (!section) return false;
+
+		uint8_t* data = (uint8_t*)MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, size);
+		if (!data)
+		{
+			CloseHandle(section);
+			return false;
+		}
+
+		store_sections[store_count] = section;
+		store_data[store_count].store(data);
+
+		slot_hash.resize((size_t)(store_count + 1) * MERGE_STORE_SLOTS);
+		slot_used.resize((size_t)(store_count + 1) * MERGE_STORE_SLOTS);
+
+		for (uint32_t i = MERGE_STORE_SLOTS; i-- > 0;)
+			free_slots.push_back(store_count * MERGE_STORE_SLOTS + i);
+
+		store_count++;
+	}
+
+	*out_slot = free_slots.back();
+	free_slots.pop_back();
+
+	slot_used[*out_slot] = true;
+	stat_merged++;
+
+	return true;
+}
+
+static void merge_free_slot(uint32_t slot)
+{
+	auto range = slots_by_hash.equal_range(slot_hash[slot]);
+
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		if (it->second == slot)
+		{
+			slots_by_hash.erase(it);
+			break;
+		}
+	}
+
+	slot_used[slot] = false;
+	free_slots.push_back(slot);
+	stat_merged--;
+}
+
+// Maps a private block of the region onto the merged copy in the slot if they're still identical
+static bool merge_block(page_merge_region_t* region, size_t block, uint32_t slot)
+{
+	std::atomic<uint8_t>& state = region->state[block];
+
+	uint8_t expected = MERGE_BLOCK_PRIVATE;
+	if (!state.compare_exchange_strong(expected, MERGE_BLOCK_BUSY)) return false;
+
+	uint8_t* addr = region->mem + block * PAGE_MERGE_BLOCK_SIZE;
+	const uint8_t* data = merge_slot_data(slot);
+
+	// Writers fault and wait from here on, so the comparison holds until the view is in
+	DWORD old_protect;
+	if (!VirtualProtect(addr, PAGE_MERGE_BLOCK_SIZE, PAGE_READONLY, &old_protect))
+	{
+		state.store(MERGE_BLOCK_PRIVATE);
+		return false;
+	}
+
+	if (memcmp(addr, data, PAGE_MERGE_BLOCK_SIZE) != 0 || !VirtualFree(addr, 0, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER))
+	{
+		VirtualProtect(addr, PAGE_MERGE_BLOCK_SIZE, PAGE_READWRITE, &old_protect);
+		state.store(MERGE_BLOCK_PRIVATE);
+		return false;
+	}
+
+	if (!merge_map_slot(slot, addr))
+	{
+		// The placeholder is still there, take a private copy again
+		if (merge_alloc_private(addr))
+			memcpy(addr, data, PAGE_MERGE_BLOCK_SIZE);
+
+		state.store(MERGE_BLOCK_PRIVATE);
+		return false;
+	}
+
+	region->slot[block] = slot;
+
+	// Has to stay unchanged for two passes again after it's written
+	region->hash[block] = 0;
+
+	slot_refs[slot]++;
+	stat_shared++;
+	stat_merges++;
+
+	state.store(MERGE_BLOCK_SHARED);
+
+	return true;
+}
+
+typedef struct merge_candidate_t
+{
+	size_t index;
+	page_merge_region_t* region;
+	size_t block;
+} merge_candidate_t;
+
+static void merge_scan_block(size_t index, page_merge_region_t* region, size_t block, std::unordered_map<uint64_t, merge_candidate_t>& candidates)
+{
+	if (region->state[block].load() != MERGE_BLOCK_PRIVATE) return;
+
+	uint8_t* addr = region->mem + block * PAGE_MERGE_BLOCK_SIZE;
+
+	// Only blocks that didn't change since the last pass, busy ones would be unmerged right away
+	uint64_t hash = merge_hash(addr);
+	bool stable = region->hash[block] == hash;
+
+	region->hash[block] = hash;
+
+	if (!stable) return;
+
+	auto range = slots_by_hash.equal_range(hash);
+
+	for (auto it = range.first; it != range.second; ++it)
+		if (merge_block(region, block, it->second))
+			return;
+
+	auto it = candidates.find(hash);
+
+	if (it == candidates.end())
+	{
+		candidates[hash] = { index, region, block };
+		return;
+	}
+
+	merge_candidate_t other = it->second;
+	it->second = { index, region, block };
+
+	if (merge_regions[other.index].load() != other.region || other.block >= other.region->blocks || (other.region == region && other.block == block))
+		return;
+
+	uint32_t slot;
+	if (!merge_alloc_slot(&slot)) return;
+
+	// Both blocks are compared against this copy while they're write-protected
+	memcpy(merge_slot_data(slot), addr, PAGE_MERGE_BLOCK_SIZE);
+
+	if (merge_block(region, block, slot))
+		merge_block(other.region, other.block, slot);
+
+	slot_hash[slot] = hash;
+	slots_by_hash.emplace(hash, slot);
+
+	if (slot_refs[slot].load() == 0)
+		merge_free_slot(slot);
+	else
+		candidates.erase(hash);
+}
+
+static void merge_thread_main()
+{
+	std::unordered_map<uint64_t, merge_candidate_t> candidates;
+
+	for (;;)
+	{
+		// Merged copies nobody maps anymore
+		for (uint32_t slot = 0; slot < store_count * MERGE_STORE_SLOTS; slot++)
+			if (slot_used[slot] && slot_refs[slot].load() == 0)
+				merge_free_slot(slot);
+
+		candidates.clear();
+
+		for (size_t index = 0; index < PAGE_MERGE_MAX_REGIONS; index++)
+		{
+			page_merge_region_t* region = merge_regions[index].load();
+			if (!region) continue;
+
+			for (size_t first = 0;; first += MERGE_BATCH_BLOCKS)
+			{
+				auto begin = std::chrono::steady_clock::now();
+
+				{
+					std::lock_guard<std::mutex> lock(merge_mutex);
+
+					// The region may be gone by now, it's only safe to look at while locked
+					if (merge_regions[index].load() != region || first >= region->blocks) break;
+
+					for (size_t block = first; block < first + MERGE_BATCH_BLOCKS && block < region->blocks; block++)
+						merge_scan_block(index, region, block, candidates);
+				}
+
+				auto budget = std::chrono::microseconds((uint64_t)MERGE_BATCH_BLOCKS * PAGE_MERGE_BLOCK_SIZE / merge_scan_mb.load());
+
+				std::unique_lock<std::mutex> lock(merge_thread_mutex);
+				if (merge_thread_cond.wait_until(lock, begin + budget, [] { return merge_thread_stop; }))
+					return;
+			}
+		}
+
+		stat_scans++;
+
+		std::unique_lock<std::mutex> lock(merge_thread_mutex);
+		if (merge_thread_cond.wait_for(lock, std::chrono::seconds(1), [] { return merge_thread_stop; }))
+			return;
+	}
+}
+
+// Releases whatever makes up the RAM right now and puts the original allocation back
+static void merge_restore_plain(page_merge_region_t* region, void* contents)
+{
+	for (size_t block = 0; block < region->blocks; block++)
+	{
+		uint8_t* addr = region->mem + block * PAGE_MERGE_BLOCK_SIZE;
+
+		if (region->state[block].load() == MERGE_BLOCK_SHARED)
+		{
+			merge_unmap_view2(GetCurrentProcess(), addr, 0);
+
+			slot_refs[region->slot[block]]--;
+			stat_shared--;
+		}
+		else
+			VirtualFree(addr, 0, MEM_RELEASE);
+	}
+
+	// A placeholder that was never split or replaced
+	VirtualFree(region->mem, 0, MEM_RELEASE);
+
+	if (!VirtualAlloc(region->alloc_base, region->alloc_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE))
+		VirtualAlloc(region->mem, region->size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+	if (!contents) return;
+
+	uint8_t* data = (uint8_t*)MapViewOfFile((HANDLE)contents, FILE_MAP_READ, 0, 0, region->size);
+
+	if (data)
+	{
+		memcpy(region->mem, data, region->size);
+		UnmapViewOfFile(data);
+	}
+}
+
+page_merge_region_t* page_merge_add(uint8_t* mem, size_t size)
+{
+	if (!mem || !size || size % PAGE_MERGE_BLOCK_SIZE || (uintptr_t)mem % PAGE_MERGE_BLOCK_SIZE) return nullptr;
+
+	std::lock_guard<std::mutex> lock(merge_mutex);
+
+	if (!merge_load_api()) return nullptr;
+
+	std::atomic<page_merge_region_t*>* free_slot = nullptr;
+
+	for (auto& slot : merge_regions)
+	{
+		page_merge_region_t* current = slot.load();
+
+		if (current && mem < current->mem + current->size && current->mem < mem + size) return nullptr;
+
+		if (!current && !free_slot)
+			free_slot = &slot;
+	}
+
+	if (!free_slot) return nullptr;
+
+	MEMORY_BASIC_INFORMATION info;
+	if (!VirtualQuery(mem, &info, sizeof(info)) || !info.AllocationBase || info.State != MEM_COMMIT) return nullptr;
+
+	std::unique_ptr<page_merge_region_t> region = std::make_unique<page_merge_region_t>();
+
+	region->mem = mem;
+	region->size = size;
+	region->blocks = size / PAGE_MERGE_BLOCK_SIZE;
+	region->alloc_base = info.AllocationBase;
+	region->alloc_size = ram_share_alloc_size(info.AllocationBase);
+
+	if ((uint8_t*)region->alloc_base + region->alloc_size < mem + size) return nullptr;
+
+	region->state = std::make_unique<std::atomic<uint8_t>[]>(region->blocks);
+	region->slot = std::make_unique<uint32_t[]>(region->blocks);
+	region->hash = std::make_unique<uint64_t[]>(region->blocks);
+
+	for (size_t i = 0; i < region->blocks; i++)
+	{
+		region->state[i].store(MERGE_BLOCK_PRIVATE, std::memory_order_relaxed);
+		region->slot[i] = 0;
+		region->hash[i] = 0;
+	}
+
+	if (!merge_handler)
+		merge_handler = AddVectoredExceptionHandler(1, page_merge_handler);
+
+	if (!merge_handler) return nullptr;
+
+	// Parked in a section while the allocation is swapped for one placeholder per block
+	void* contents = ram_share_create(mem, size);
+	if (!contents) return nullptr;
+
+	if (!VirtualFree(region->alloc_base, 0, MEM_RELEASE))
+	{
+		ram_share_close(contents);
+		return nullptr;
+	}
+
+	bool ok = merge_virtual_alloc2(nullptr, mem, size, MEM_RESERVE | MEM_RESERVE_PLACEHOLDER, PAGE_NOACCESS, nullptr, 0) == mem;
+
+	for (size_t offset = 0; ok && offset + PAGE_MERGE_BLOCK_SIZE < size; offset += PAGE_MERGE_BLOCK_SIZE)
+		ok = VirtualFree(mem + offset, PAGE_MERGE_BLOCK_SIZE, MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER) != FALSE;
+
+	for (size_t block = 0; ok && block < region->blocks; block++)
+		ok = merge_alloc_private(mem + block * PAGE_MERGE_BLOCK_SIZE);
+
+	uint8_t* data = ok ? (uint8_t*)MapViewOfFile((HANDLE)contents, FILE_MAP_READ, 0, 0, size) : nullptr;
+
+	if (data)
+	{
+		memcpy(mem, data, size);
+		UnmapViewOfFile(data);
+	}
+	else
+	{
+		merge_restore_plain(region.get(), contents);
+		ram_share_close(contents);
+		return nullptr;
+	}
+
+	ram_share_close(contents);
+
+	free_slot->store(region.get());
+	stat_regions++;
+
+	{
+		std::lock_guard<std::mutex> thread_lock(merge_thread_mutex);
+
+		if (!merge_thread.joinable())
+		{
+			merge_thread_stop = false;
+			merge_thread = std::thread(merge_thread_main);
+		}
+	}
+
+	return region.release();
+}
+
+void page_merge_remove(page_merge_region_t* region, bool keep_contents)
+{
+	if (!region) return;
+
+	std::lock_guard<std::mutex> lock(merge_mutex);
+
+	for (auto& slot : merge_regions)
+		if (slot.load() == region)
+			slot.store(nullptr);
+
+	// A handler that already picked the region up may still be using it
+	while (merge_handlers_active.load() != 0)
+		std::this_thread::yield();
+
+	void* contents = keep_contents ? ram_share_create(region->mem, region->size) : nullptr;
+
+	merge_restore_plain(region, contents);
+	ram_share_close(contents);
+
+	stat_regions--;
+
+	delete region;
+}
+
+void page_merge_set_scan_rate(uint32_t mb_per_sec)
+{
+	merge_scan_mb.store(mb_per_sec ? mb_per_sec : 1);
+}
+
+uint32_t page_merge_get_scan_rate()
+{
+	return merge_scan_mb.load();
+}
+
+page_merge_stats_t page_merge_get_stats()
+{
+	page_merge_stats_t stats = {};
+
+	stats.regions = stat_regions.load();
+	stats.shared_blocks = stat_shared.load();
+	stats.merged_blocks = stat_merged.load();
+	stats.merges = stat_merges.load();
+	stats.unmerges = stat_unmerges.load();
+	stats.scans = stat_scans.load();
+
+	return stats;
+}
+
+void page_merge_shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(merge_thread_mutex);
+		merge_thread_stop = true;
+	}
+
+	merge_thread_cond.notify_all();
+
+	if (merge_thread.joinable())
+		merge_thread.join();
+
+	for (uint32_t i = 0; i < store_count; i++)
+	{
+		UnmapViewOfFile(store_data[i].load());
+		CloseHandle(store_sections[i]);
+		store_data[i].store(nullptr);
+	}
+
+	store_count = 0;
+	free_slots.clear();
+	slot_hash.clear();
+	slot_used.clear();
+	slots_by_hash.clear();
+
+	stat_merged = 0;
+}
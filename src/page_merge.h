@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Windows can only map views at allocation granularity, so RAM is merged in 64 KiB blocks
+#define PAGE_MERGE_BLOCK_SIZE 65536
+#define PAGE_MERGE_MAX_REGIONS 256
+
+#define PAGE_MERGE_DEFAULT_SCAN_MB 64 // per second
+
+typedef struct page_merge_region_t page_merge_region_t;
+
+typedef struct page_merge_stats_t
+{
+	uint32_t regions;
+	uint64_t shared_blocks; // blocks of all regions mapped from a merged copy
+	uint64_t merged_blocks; // merged copies the shared blocks point to
+	uint64_t merges;
+	uint64_t unmerges;      // sharing broken by a write
+	uint64_t scans;         // full passes over all regions
+} page_merge_stats_t;
+
+// Rebuilds the RAM at mem out of separately mapped 64 KiB blocks, which a background thread
+// hashes and maps read-only onto a single copy once identical blocks stay unchanged for a full
+// pass. The first write to a merged block gets a private copy back from a vectored exception
+// handler. The machine must be paused. Needs placeholder support (Windows 10 1803 or newer).
+// Only user mode writes fault, I/O the OS completes into a merged block fails with an error.
+page_merge_region_t* page_merge_add(uint8_t* mem, size_t size);
+
+// Turns the region back into a plain allocation librvvm can free. The contents are only kept
+// if asked to, the machine must be paused either way.
+void page_merge_remove(page_merge_region_t* region, bool keep_contents);
+
+void page_merge_set_scan_rate(uint32_t mb_per_sec);
+uint32_t page_merge_get_scan_rate();
+
+page_merge_stats_t page_merge_get_stats();
+
+// Stops the scanner, all regions must be removed
+void page_merge_shutdown();
@@ -0,0 +1,309 @@
+#include "ram_reclaim.h"
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <condition_variable>
+
+#include <Windows.h>
+#include <Psapi.h>
+
+#define RECLAIM_BATCH_PAGES 512 // looked up in the working set at once, 2 MiB
+
+typedef struct ram_reclaim_region_t
+{
+	uint8_t* mem;
+	size_t size;
+	size_t pages;
+
+	std::unique_ptr<uint64_t[]> zero; // bit per page, found zeroed by the last look at it
+
+	uint64_t zero_pages;
+	uint64_t resident_pages;
+	uint64_t resident_counted; // of the pass going on
+	uint64_t released_pages;
+	uint64_t scans;
+} ram_reclaim_region_t;
+
+// Regions are only looked at while locked, the scanner holds it for one batch at a time
+static ram_reclaim_region_t* reclaim_regions[RAM_RECLAIM_MAX_REGIONS];
+static std::mutex reclaim_mutex;
+
+static std::thread reclaim_thread;
+static std::mutex reclaim_thread_mutex;
+static std::condition_variable reclaim_thread_cond;
+static bool reclaim_thread_stop = false;
+
+static std::atomic<uint32_t> reclaim_scan_mb = RAM_RECLAIM_DEFAULT_SCAN_MB;
+
+static bool reclaim_page_zero(const uint8_t* page)
+{
+	const uint64_t* words = (const uint64_t*)page;
+
+	for (size_t i = 0; i < RAM_RECLAIM_PAGE_SIZE / sizeof(uint64_t); i++)
+		if (words[i]) return false;
+
+	return true;
+}
+
+static void reclaim_mark(ram_reclaim_region_t* region, size_t page, bool zero)
+{
+	uint64_t bit = 1ULL << (page % 64);
+	uint64_t& word = region->zero[page / 64];
+
+	if (zero == ((word & bit) != 0)) return;
+
+	word ^= bit;
+
+	if (zero)
+		region->zero_pages++;
+	else
+		region->zero_pages--;
+}
+
+// Returns how many pages of the batch are resident
+static size_t reclaim_scan_batch(ram_reclaim_region_t* region, size_t first, size_t count)
+{
+	PSAPI_WORKING_SET_EX_INFORMATION info[RECLAIM_BATCH_PAGES];
+
+	for (size_t i = 0; i < count; i++)
+		info[i].VirtualAddress = region->mem + (first + i) * RAM_RECLAIM_PAGE_SIZE;
+
+	if (!QueryWorkingSetEx(GetCurrentProcess(), info, (DWORD)(count * sizeof(info[0])))) return 0;
+
+	size_t resident = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		size_t page = first + i;
+
+		// Reading it would fault it in just to find it empty
+		if (!info[i].VirtualAttributes.Valid)
+		{
+			reclaim_mark(region, page, false);
+			continue;
+		}
+
+		resident++;
+
+		reclaim_mark(region, page, reclaim_page_zero(region->mem + page * RAM_RECLAIM_PAGE_SIZE));
+	}
+
+	return resident;
+}
+
+static void reclaim_thread_main()
+{
+	for (;;)
+	{
+		for (size_t index = 0; index < RAM_RECLAIM_MAX_REGIONS; index++)
+		{
+			ram_reclaim_region_t* region;
+
+			{
+				std::lock_guard<std::mutex> lock(reclaim_mutex);
+				region = reclaim_regions[index];
+			}
+
+			if (!region) continue;
+
+			for (size_t first = 0;; first += RECLAIM_BATCH_PAGES)
+			{
+				auto begin = std::chrono::steady_clock::now();
+
+				size_t resident;
+
+				{
+					std::lock_guard<std::mutex> lock(reclaim_mutex);
+
+					// The region may be gone by now, it's only safe to look at while locked
+					if (reclaim_regions[index] != region || first >= region->pages) break;
+
+					size_t count = region->pages - first < RECLAIM_BATCH_PAGES ? region->pages - first : RECLAIM_BATCH_PAGES;
+
+					if (first == 0)
+						region->resident_counted = 0;
+
+					resident = reclaim_scan_batch(region, first, count);
+					region->resident_counted += resident;
+
+					if (first + count == region->pages)
+					{
+						region->resident_pages = region->resident_counted;
+						region->scans++;
+					}
+				}
+
+				// Only resident pages are read, the rest cost a working set lookup
+				auto budget = std::chrono::microseconds((uint64_t)resident * RAM_RECLAIM_PAGE_SIZE / reclaim_scan_mb.load());
+
+				std::unique_lock<std::mutex> lock(reclaim_thread_mutex);
+				if (reclaim_thread_cond.wait_until(lock, begin + budget, [] { return reclaim_thread_stop; }))
+					return;
+			}
+		}
+
+		std::unique_lock<std::mutex> lock(reclaim_thread_mutex);
+		if (reclaim_thread_cond.wait_for(lock, std::chrono::seconds(1), [] { return reclaim_thread_stop; }))
+			return;
+	}
+}
+
+ram_reclaim_region_t* ram_reclaim_add(uint8_t* mem, size_t size)
+{
+	if (!mem || !size || size % RAM_RECLAIM_PAGE_SIZE || (uintptr_t)mem % RAM_RECLAIM_PAGE_SIZE) return nullptr;
+
+	// Views and placeholders can't be decommitted page by page
+	MEMORY_BASIC_INFORMATION info;
+	if (!VirtualQuery(mem, &info, sizeof(info)) || info.State != MEM_COMMIT || info.Type != MEM_PRIVATE) return nullptr;
+
+	std::lock_guard<std::mutex> lock(reclaim_mutex);
+
+	ram_reclaim_region_t** free_slot = nullptr;
+
+	for (auto& slot : reclaim_regions)
+	{
+		if (slot && mem < slot->mem + slot->size && slot->mem < mem + size) return nullptr;
+
+		if (!slot && !free_slot)
+			free_slot = &slot;
+	}
+
+	if (!free_slot) return nullptr;
+
+	ram_reclaim_region_t* region = new ram_reclaim_region_t();
+
+	region->mem = mem;
+	region->size = size;
+	region->pages = size / RAM_RECLAIM_PAGE_SIZE;
+	region->zero = std::make_unique<uint64_t[]>((region->pages + 63) / 64);
+	region->zero_pages = 0;
+	region->resident_pages = 0;
+	region->resident_counted = 0;
+	region->released_pages = 0;
+	region->scans = 0;
+
+	*free_slot = region;
+
+	{
+		std::lock_guard<std::mutex> thread_lock(reclaim_thread_mutex);
+
+		if (!reclaim_thread.joinable())
+		{
+			reclaim_thread_stop = false;
+			reclaim_thread = std::thread(reclaim_thread_main);
+		}
+	}
+
+	return region;
+}
+
+void ram_reclaim_remove(ram_reclaim_region_t* region)
+{
+	if (!region) return;
+
+	{
+		std::lock_guard<std::mutex> lock(reclaim_mutex);
+
+		for (auto& slot : reclaim_regions)
+			if (slot == region)
+				slot = nullptr;
+	}
+
+	delete region;
+}
+
+// Gives the host memory back, the pages stay committed so that the guest can't tell
+static bool reclaim_free_run(ram_reclaim_region_t* region, size_t first, size_t count)
+{
+	uint8_t* addr = region->mem + first * RAM_RECLAIM_PAGE_SIZE;
+	size_t size = count * RAM_RECLAIM_PAGE_SIZE;
+
+	return VirtualFree(addr, size, MEM_DECOMMIT) && VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE);
+}
+
+size_t ram_reclaim_release(ram_reclaim_region_t* region, size_t max_pages)
+{
+	if (!region) return 0;
+
+	std::lock_guard<std::mutex> lock(reclaim_mutex);
+
+	size_t released = 0;
+	size_t run_first = 0;
+	size_t run_count = 0;
+
+	for (size_t page = 0; page < region->pages && released + run_count < max_pages; page++)
+	{
+		if (page % 64 == 0 && !region->zero[page / 64])
+		{
+			page += 63;
+			continue;
+		}
+
+		if (!(region->zero[page / 64] & (1ULL << (page % 64)))) continue;
+
+		reclaim_mark(region, page, false);
+
+		// The guest may have written it since the scan
+		if (!reclaim_page_zero(region->mem + page * RAM_RECLAIM_PAGE_SIZE)) continue;
+
+		if (run_count && run_first + run_count == page)
+		{
+			run_count++;
+			continue;
+		}
+
+		if (run_count && reclaim_free_run(region, run_first, run_count))
+			released += run_count;
+
+		run_first = page;
+		run_count = 1;
+	}
+
+	if (run_count && reclaim_free_run(region, run_first, run_count))
+		released += run_count;
+
+	region->released_pages += released;
+	region->resident_pages -= released < region->resident_pages ? released : region->resident_pages;
+
+	return released;
+}
+
+bool ram_reclaim_get_stats(ram_reclaim_region_t* region, ram_reclaim_stats_t* out_stats)
+{
+	if (!region || !out_stats) return false;
+
+	std::lock_guard<std::mutex> lock(reclaim_mutex);
+
+	out_stats->resident_pages = region->resident_pages;
+	out_stats->zero_pages = region->zero_pages;
+	out_stats->released_pages = region->released_pages;
+	out_stats->scans = region->scans;
+
+	return true;
+}
+
+void ram_reclaim_set_scan_rate(uint32_t mb_per_sec)
+{
+	reclaim_scan_mb.store(mb_per_sec ? mb_per_sec : 1);
+}
+
+uint32_t ram_reclaim_get_scan_rate()
+{
+	return reclaim_scan_mb.load();
+}
+
+void ram_reclaim_shutdown()
+{
+	{
+		std::lock_guard<std::mutex> lock(reclaim_thread_mutex);
+		reclaim_thread_stop = true;
+	}
+
+	reclaim_thread_cond.notify_all();
+
+	if (reclaim_thread.joinable())
+		reclaim_thread.join();
+}
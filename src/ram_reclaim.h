@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RAM_RECLAIM_PAGE_SIZE   4096
+#define RAM_RECLAIM_MAX_REGIONS 256
+
+#define RAM_RECLAIM_DEFAULT_SCAN_MB 256 // per second, of resident RAM
+
+typedef struct ram_reclaim_region_t ram_reclaim_region_t;
+
+typedef struct ram_reclaim_stats_t
+{
+	uint64_t resident_pages; // as of the last full pass
+	uint64_t zero_pages;     // resident and zeroed, waiting to be released
+	uint64_t released_pages;
+	uint64_t scans;
+} ram_reclaim_stats_t;
+
+// Hands the RAM at mem to a background thread that looks for resident pages the guest zeroed.
+// Pages that aren't resident are never read, so scanning doesn't fault anything in. The RAM
+// must stay a plain private allocation until the region is removed again.
+ram_reclaim_region_t* ram_reclaim_add(uint8_t* mem, size_t size);
+void ram_reclaim_remove(ram_reclaim_region_t* region);
+
+// Decommits up to max_pages of the zeroed pages found so far, each one is checked again first.
+// They read as zeroes afterwards and take no host memory until written. The machine must be paused.
+size_t ram_reclaim_release(ram_reclaim_region_t* region, size_t max_pages);
+
+bool ram_reclaim_get_stats(ram_reclaim_region_t* region, ram_reclaim_stats_t* out_stats);
+
+void ram_reclaim_set_scan_rate(uint32_t mb_per_sec);
+uint32_t ram_reclaim_get_scan_rate();
+
+// Stops the scanner, all regions must be removed
+void ram_reclaim_shutdown();
@@ -0,0 +1,46 @@
+#include "ram_share.h"
+
+#include <string.h>
+
+#include <Windows.h>
+
+void* ram_share_create(const uint8_t* mem, size_t size)
+{
+	if (!mem || !size) return nullptr;
+
+	HANDLE section = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, nullptr);
+	if (!section) return nullptr;
+
+	uint8_t* data = (uint8_t*)MapViewOfFile(section, FILE_MAP_WRITE, 0, 0, size);
+	if (!data)
+	{
+		CloseHandle(section);
+		return nullptr;
+	}
+
+	memcpy(data, mem, size);
+	UnmapViewOfFile(data);
+
+	return section;
+}
+
+void ram_share_close(void* section)
+{
+	if (section)
+		CloseHandle((HANDLE)section);
+}
+
+size_t ram_share_alloc_size(void* alloc_base)
+{
+	size_t size = 0;
+
+	for (;;)
+	{
+		MEMORY_BASIC_INFORMATION region;
+
+		if (!VirtualQuery((uint8_t*)alloc_base + size, &region, sizeof(region)) || region.AllocationBase != alloc_base)
+			return size;
+
+		size += region.RegionSize;
+	}
+}
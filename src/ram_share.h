@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Copies guest RAM into a new pagefile-backed section. Views keep the section alive
+// after its handle is closed.
+void* ram_share_create(const uint8_t* mem, size_t size);
+void ram_share_close(void* section);
+
+// Size of the whole allocation starting at alloc_base
+size_t ram_share_alloc_size(void* alloc_base);
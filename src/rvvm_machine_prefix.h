@@ -0,0 +1,95 @@
+#pragma once
+
+#include <rvvmlib.h>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <Windows.h>
+
+// librvvm only hands out an opaque rvvm_machine_t. These are the fields it starts with
+// (see rvvm.h), which don't depend on the USE_* flags librvvm was built with. Never
+// mirror anything that follows them.
+typedef struct rvvm_machine_prefix_t
+{
+	struct
+	{
+		rvvm_addr_t addr;
+		size_t size;
+		void* data;
+	} mem;
+
+	struct
+	{
+		rvvm_hart_t** data;
+		size_t size;
+		size_t count;
+	} harts;
+
+	struct
+	{
+		rvvm_mmio_dev_t** data;
+		size_t size;
+		size_t count;
+	} mmio_devs;
+
+	struct
+	{
+		rvvm_mmio_dev_t** data;
+		size_t size;
+		size_t count;
+	} msi_targets;
+
+	struct
+	{
+		uint64_t begin;
+		uint64_t freq;
+	} timer;
+
+	uint32_t running;
+	uint32_t power_state;
+} rvvm_machine_prefix_t;
+
+inline rvvm_machine_prefix_t* rvvm_machine_prefix(rvvm_machine_t* machine)
+{
+	return (rvvm_machine_prefix_t*)machine;
+}
+
+inline rvvm_hart_t* rvvm_machine_get_hart(rvvm_machine_t* machine, size_t hart_id)
+{
+	rvvm_machine_prefix_t* prefix = rvvm_machine_prefix(machine);
+
+	if (hart_id >= prefix->harts.count) return nullptr;
+
+	return prefix->harts.data[hart_id];
+}
+
+// Same as rvtimer_clocksource() in librvvm on Windows, which counts QueryPerformanceCounter ticks
+inline uint64_t rvvm_machine_clocksource(uint64_t freq)
+{
+	LARGE_INTEGER counter;
+	LARGE_INTEGER counter_freq;
+
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&counter_freq);
+
+	uint64_t clk = (uint64_t)counter.QuadPart;
+	uint64_t src_freq = (uint64_t)counter_freq.QuadPart;
+
+	return (clk / src_freq * freq) + (clk % src_freq * freq / src_freq);
+}
+
+// Machine timer (mtime) as seen by the guest
+inline uint64_t rvvm_machine_get_time(rvvm_machine_t* machine)
+{
+	rvvm_machine_prefix_t* prefix = rvvm_machine_prefix(machine);
+
+	return rvvm_machine_clocksource(prefix->timer.freq) - prefix->timer.begin;
+}
+
+inline void rvvm_machine_set_time(rvvm_machine_t* machine, uint64_t time)
+{
+	rvvm_machine_prefix_t* prefix = rvvm_machine_prefix(machine);
+
+	prefix->timer.begin = rvvm_machine_clocksource(prefix->timer.freq) - time;
+}